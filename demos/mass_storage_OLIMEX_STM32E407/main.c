@@ -7,6 +7,16 @@
 /* endpoint index */
 #define USB_MS_DATA_EP 1
 
+#if USB_MSD_TRACE_LEVEL > 0
+/* trace endpoint index, streamed on a second (vendor) interface */
+#define USB_TRACE_EP 2
+#define USB_CONFIG_INTERFACES 2
+#define USB_CONFIG_LENGTH 48
+#else
+#define USB_CONFIG_INTERFACES 1
+#define USB_CONFIG_LENGTH 32
+#endif
+
 /* USB device descriptor */
 static const uint8_t deviceDescriptorData[] =
 {
@@ -38,8 +48,8 @@ static const uint8_t configurationDescriptorData[] =
     /* configuration descriptor */
     USB_DESC_CONFIGURATION
     (
-        32,   /* total length                                             */
-        1,    /* number of interfaces                                     */
+        USB_CONFIG_LENGTH,     /* total length                            */
+        USB_CONFIG_INTERFACES, /* number of interfaces                    */
         1,    /* value that selects this configuration                    */
         0,    /* index of string descriptor describing this configuration */
         0xC0, /* attributes (self-powered)                                */
@@ -74,7 +84,30 @@ static const uint8_t configurationDescriptorData[] =
         USB_EP_MODE_TYPE_BULK, /* attributes (bulk)                              */
         64,                    /* max packet size                                */
         0x05                   /* polling interval (ignored for bulk end-points) */
+    ),
+
+#if USB_MSD_TRACE_LEVEL > 0
+    /* trace interface descriptor */
+    USB_DESC_INTERFACE
+    (
+        1,    /* interface number                                     */
+        0,    /* value used to select alternative setting             */
+        1,    /* number of end-points used by this interface          */
+        0xFF, /* interface class (vendor specific)                    */
+        0x00, /* interface sub-class                                  */
+        0x00, /* interface protocol                                   */
+        0     /* index of string descriptor describing this interface */
+    ),
+
+    /* end-point descriptor */
+    USB_DESC_ENDPOINT
+    (
+        USB_TRACE_EP | 0x80,   /* address (end point index | IN direction)       */
+        USB_EP_MODE_TYPE_BULK, /* attributes (bulk)                              */
+        64,                    /* max packet size                                */
+        0x05                   /* polling interval (ignored for bulk end-points) */
     )
+#endif
 };
 static const USBDescriptor configurationDescriptor =
 {
@@ -161,14 +194,19 @@ static const USBDescriptor* getDescriptor(USBDriver* usbp, uint8_t type, uint8_t
     return 0;
 }
 
+/* USB mass storage driver */
+USBMassStorageDriver UMSD1;
+
 /* Handles global events of the USB driver */
 static void usbEvent(USBDriver* usbp, usbevent_t event)
 {
+    (void)usbp;
+
     switch (event)
     {
         case USB_EVENT_CONFIGURED:
             chSysLockFromIsr();
-            msdConfigureHookI(usbp);
+            msdConfigureHookI(&UMSD1);
             chSysUnlockFromIsr();
             break;
 
@@ -209,11 +247,50 @@ static USBMassStorageConfig msdConfig =
     &usbActivity,
     "DVendor",
     "DProduct",
-    "0.1"
+    "0.1",
+    NULL,       /* default thread working area               */
+    0,
+    NORMALPRIO, /* thread priority                           */
+    8,          /* yield every 8 blocks during READ/WRITE_10 */
+    0           /* no time budget                            */
 };
 
-/* USB mass storage driver */
-USBMassStorageDriver UMSD1;
+#if !defined(DEMO_LATENCY_PROBE)
+#define DEMO_LATENCY_PROBE FALSE
+#endif
+
+#if DEMO_LATENCY_PROBE
+/* Worst-case wake-up jitter, in microseconds, of a thread competing with the
+   mass storage thread at the same priority */
+volatile uint32_t probeMaxJitter = 0;
+
+/* Wakes up every system tick and measures how late it is */
+static WORKING_AREA(probeThreadWA, 256);
+static msg_t probeThread(void *arg)
+{
+    (void)arg;
+    chRegSetThreadName("latency probe");
+
+    uint32_t period = 1000000 / CH_FREQUENCY;
+    halrtcnt_t last = halGetCounterValue();
+    systime_t next = chTimeNow();
+
+    while (TRUE)
+    {
+        next += 1;
+        chThdSleepUntil(next);
+
+        halrtcnt_t now = halGetCounterValue();
+        uint32_t elapsed = (now - last) / (halGetCounterFrequency() / 1000000);
+        last = now;
+
+        if ((elapsed > period) && (elapsed - period > probeMaxJitter))
+            probeMaxJitter = elapsed - period;
+    }
+
+    return 0;
+}
+#endif
 
 int main(void)
 {
@@ -228,10 +305,22 @@ int main(void)
     /* turn off the test LED */
     palClearPad(GPIOC, GPIOC_LED);
 
+#if DEMO_LATENCY_PROBE
+    /* compete with the mass storage thread */
+    chThdCreateStatic(probeThreadWA, sizeof(probeThreadWA), NORMALPRIO, probeThread, NULL);
+#endif
+
     /* initialize the USB mass storage driver */
     msdInit(&UMSD1);
+#if USB_MSD_TRACE_LEVEL > 0
+    msdConfig.trace_ep = USB_TRACE_EP;
+#endif
+#if USB_MSD_USE_VPD
+    msdConfig.serial_number = "000000000001"; /* same as the USB serial number */
+#endif
 
-    /* start the USB mass storage service */
+    /* start the USB mass storage service, the SD card is attached in the
+       background so the USB can enumerate right away */
     msdStart(&UMSD1, &msdConfig);
 
     /* start the USB driver */
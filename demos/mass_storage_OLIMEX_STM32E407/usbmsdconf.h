@@ -0,0 +1,42 @@
+/**
+ * @file    usbmsdconf.h
+ * @brief   USB mass storage driver configuration header.
+ * @details Three profiles are provided, selected with the USB_MSD_PROFILE
+ *          variable of the Makefile:
+ *          - MINIMAL: fixed 512 bytes blocks, mandatory commands only, no
+ *            statistics.
+ *          - DEFAULT: the driver defaults.
+ *          - FULL: deep buffers, metadata cache, warm-up and transfer
+ *            statistics, reported by LOG SENSE, and the trace interface.
+ *          .
+ */
+
+#ifndef _USBMSDCONF_H_
+#define _USBMSDCONF_H_
+
+#if defined(USB_MSD_PROFILE_MINIMAL)
+#define USB_MSD_BLOCK_SIZE                      512
+#define USB_MSD_BUFFER_BLOCKS                   1
+#define USB_MSD_STATS_LEVEL                     0
+#define USB_MSD_USE_CMD_MODE_SENSE_6            TRUE
+#define USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES  TRUE
+#define USB_MSD_USE_CMD_SEND_DIAGNOSTIC         FALSE
+#define USB_MSD_USE_CMD_START_STOP_UNIT         FALSE
+#define USB_MSD_USE_CMD_SYNCHRONIZE_CACHE_10    FALSE
+#define USB_MSD_USE_CMD_LOG_SENSE               FALSE
+#define USB_MSD_USE_VPD                         FALSE
+#define USB_MSD_USE_METADATA_CACHE              FALSE
+#define USB_MSD_USE_WARMUP                      FALSE
+
+#elif defined(USB_MSD_PROFILE_FULL)
+#define USB_MSD_BLOCK_SIZE                      512
+#define USB_MSD_BUFFER_BLOCKS                   8
+#define USB_MSD_STATS_LEVEL                     2
+#define USB_MSD_USE_CMD_LOG_SENSE               TRUE
+#define USB_MSD_TRACE_LEVEL                     2
+#define USB_MSD_USE_METADATA_CACHE              TRUE
+#define USB_MSD_USE_WARMUP                      TRUE
+
+#endif
+
+#endif /* _USBMSDCONF_H_ */
@@ -0,0 +1,317 @@
+#include "blk_overlay.h"
+
+#include <string.h>
+
+/**
+ * @brief Returns the overlay slot of a block, or -1 if it is unmodified
+ */
+#define ovl_slot_of(ovlp, blk) ((int32_t)(ovlp)->config->index[blk] - 1)
+
+/**
+ * @brief Reads an overlay slot
+ */
+static bool_t ovl_read_slot(OverlayBlockDevice *ovlp, uint32_t slot, uint8_t *buffer) {
+
+    if (ovlp->config->overlay_bbdp != NULL)
+        return blkRead(ovlp->config->overlay_bbdp, slot, buffer, 1);
+
+    memcpy(buffer, ovlp->config->slot_buffer + slot * ovlp->info.blk_size, ovlp->info.blk_size);
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Writes an overlay slot
+ */
+static bool_t ovl_write_slot(OverlayBlockDevice *ovlp, uint32_t slot, const uint8_t *buffer) {
+
+    if (ovlp->config->overlay_bbdp != NULL)
+        return blkWrite(ovlp->config->overlay_bbdp, slot, buffer, 1);
+
+    memcpy(ovlp->config->slot_buffer + slot * ovlp->info.blk_size, buffer, ovlp->info.blk_size);
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Removes a slot from the overlay, moving the last used slot into its place
+ * @note  Keeps the used slots packed so that allocation stays O(1).
+ */
+static bool_t ovl_release_slot(OverlayBlockDevice *ovlp, uint32_t slot, uint8_t *scratch) {
+
+    const OverlayBlockConfig *config = ovlp->config;
+    uint32_t last = ovlp->slots_used - 1;
+
+    if (slot != last) {
+        /* move the last slot into the freed one, the released block keeps
+           its slot if the move fails */
+        if (ovl_read_slot(ovlp, last, scratch) == CH_FAILED ||
+            ovl_write_slot(ovlp, slot, scratch) == CH_FAILED)
+            return CH_FAILED;
+        config->index[config->slot_blocks[slot]] = 0;
+        config->slot_blocks[slot] = config->slot_blocks[last];
+        config->index[config->slot_blocks[slot]] = (ovl_index_t)(slot + 1);
+    } else {
+        config->index[config->slot_blocks[slot]] = 0;
+    }
+
+    ovlp->slots_used = last;
+    return CH_SUCCESS;
+}
+
+static bool_t ovl_is_inserted(void *instance) {
+
+    OverlayBlockDevice *ovlp = (OverlayBlockDevice *)instance;
+    return blkIsInserted(ovlp->config->base);
+}
+
+static bool_t ovl_is_protected(void *instance) {
+
+    /* writes always go to the overlay */
+    (void)instance;
+    return FALSE;
+}
+
+static bool_t ovl_connect(void *instance) {
+
+    OverlayBlockDevice *ovlp = (OverlayBlockDevice *)instance;
+    return (ovlp->state == BLK_READY) ? CH_SUCCESS : CH_FAILED;
+}
+
+static bool_t ovl_disconnect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t ovl_read(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    OverlayBlockDevice *ovlp = (OverlayBlockDevice *)instance;
+    bool_t result = CH_SUCCESS;
+
+    if (startblk + n > ovlp->info.blk_num)
+        return CH_FAILED;
+
+    chMtxLock(&ovlp->mtx);
+
+    while (n > 0) {
+        int32_t slot = ovl_slot_of(ovlp, startblk);
+
+        if (slot >= 0) {
+            /* modified block, served from the overlay */
+            result = ovl_read_slot(ovlp, (uint32_t)slot, buffer);
+            startblk++;
+            buffer += ovlp->info.blk_size;
+            n--;
+        } else {
+            /* run of unmodified blocks, read straight from the base image
+               into the caller buffer */
+            uint32_t run = 1;
+            while (run < n && ovl_slot_of(ovlp, startblk + run) < 0)
+                run++;
+            result = blkRead(ovlp->config->base, startblk, buffer, run);
+            startblk += run;
+            buffer += run * ovlp->info.blk_size;
+            n -= run;
+        }
+
+        if (result == CH_FAILED)
+            break;
+    }
+
+    chMtxUnlock();
+    return result;
+}
+
+static bool_t ovl_write(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n) {
+
+    OverlayBlockDevice *ovlp = (OverlayBlockDevice *)instance;
+    const OverlayBlockConfig *config = ovlp->config;
+    bool_t result = CH_SUCCESS;
+
+    if (startblk + n > ovlp->info.blk_num)
+        return CH_FAILED;
+
+    chMtxLock(&ovlp->mtx);
+
+    for (; n > 0; n--, startblk++, buffer += ovlp->info.blk_size) {
+        int32_t slot = ovl_slot_of(ovlp, startblk);
+        bool_t allocated = FALSE;
+
+        if (slot < 0) {
+            /* first write to this block, allocate a new slot */
+            if (ovlp->slots_used >= config->slot_count) {
+                /* overlay is full */
+                result = CH_FAILED;
+                break;
+            }
+            slot = (int32_t)ovlp->slots_used++;
+            config->slot_blocks[slot] = startblk;
+            config->index[startblk] = (ovl_index_t)(slot + 1);
+            allocated = TRUE;
+        }
+
+        if (ovl_write_slot(ovlp, (uint32_t)slot, buffer) == CH_FAILED) {
+            /* the new slot may hold the data of a released block */
+            if (allocated) {
+                ovlp->slots_used--;
+                config->index[startblk] = 0;
+            }
+            result = CH_FAILED;
+            break;
+        }
+    }
+
+    chMtxUnlock();
+    return result;
+}
+
+static bool_t ovl_sync(void *instance) {
+
+    OverlayBlockDevice *ovlp = (OverlayBlockDevice *)instance;
+
+    if (ovlp->config->overlay_bbdp != NULL)
+        return blkSync(ovlp->config->overlay_bbdp);
+    return CH_SUCCESS;
+}
+
+static bool_t ovl_get_info(void *instance, BlockDeviceInfo *bdip) {
+
+    OverlayBlockDevice *ovlp = (OverlayBlockDevice *)instance;
+
+    if (ovlp->state != BLK_READY)
+        return CH_FAILED;
+
+    *bdip = ovlp->info;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Virtual methods table
+ */
+static const struct OverlayBlockDeviceVMT ovl_vmt = {
+    ovl_is_inserted,
+    ovl_is_protected,
+    ovl_connect,
+    ovl_disconnect,
+    ovl_read,
+    ovl_write,
+    ovl_sync,
+    ovl_get_info
+};
+
+/**
+ * @brief Initializes an overlay block device
+ */
+void ovlInit(OverlayBlockDevice *ovlp) {
+
+    chDbgCheck(ovlp != NULL, "ovlInit");
+
+    ovlp->vmt = &ovl_vmt;
+    ovlp->state = BLK_STOP;
+    ovlp->config = NULL;
+    ovlp->slots_used = 0;
+    chMtxInit(&ovlp->mtx);
+}
+
+/**
+ * @brief Starts an overlay block device
+ */
+void ovlStart(OverlayBlockDevice *ovlp, const OverlayBlockConfig *config) {
+
+    chDbgCheck(ovlp != NULL, "ovlStart");
+    chDbgCheck(config != NULL, "ovlStart");
+    chDbgCheck(config->base != NULL, "ovlStart");
+    chDbgCheck(config->index != NULL, "ovlStart");
+    chDbgCheck(config->slot_blocks != NULL, "ovlStart");
+    chDbgCheck((config->overlay_bbdp != NULL) || (config->slot_buffer != NULL), "ovlStart");
+    chDbgCheck(config->slot_count <= OVL_MAX_SLOTS, "ovlStart");
+    chDbgCheck(blkGetDriverState(config->base) == BLK_READY, "ovlStart");
+
+    ovlp->config = config;
+    blkGetInfo(config->base, &ovlp->info);
+    chDbgCheck(ovlp->info.blk_size <= OVL_MAX_BLOCK_SIZE, "ovlStart");
+
+    /* start with an empty overlay */
+    memset(config->index, 0, OVL_INDEX_SIZE(ovlp->info.blk_num));
+    ovlp->slots_used = 0;
+
+    ovlp->state = BLK_READY;
+}
+
+/**
+ * @brief Stops an overlay block device
+ */
+void ovlStop(OverlayBlockDevice *ovlp) {
+
+    chDbgCheck(ovlp != NULL, "ovlStop");
+
+    chMtxLock(&ovlp->mtx);
+    ovlp->state = BLK_STOP;
+    ovlp->slots_used = 0;
+    chMtxUnlock();
+}
+
+/**
+ * @brief Writes all the modified blocks back to the base block device
+ */
+bool_t ovlCommit(OverlayBlockDevice *ovlp) {
+
+    const OverlayBlockConfig *config = ovlp->config;
+    bool_t result = CH_SUCCESS;
+    uint32_t slot = 0;
+
+    uint8_t *scratch = (uint8_t *)ovlp->scratch;
+
+    chDbgCheck(ovlp->state == BLK_READY, "ovlCommit");
+
+    chMtxLock(&ovlp->mtx);
+
+    while (slot < ovlp->slots_used) {
+        if (ovl_read_slot(ovlp, slot, scratch) == CH_FAILED ||
+            blkWrite(config->base, config->slot_blocks[slot], scratch, 1) == CH_FAILED) {
+            /* keep this block in the overlay and try the next one */
+            result = CH_FAILED;
+            slot++;
+            continue;
+        }
+
+        /* the last slot moves into this one, so don't advance */
+        if (ovl_release_slot(ovlp, slot, scratch) == CH_FAILED) {
+            result = CH_FAILED;
+            break;
+        }
+    }
+
+    if (blkSync(config->base) == CH_FAILED)
+        result = CH_FAILED;
+
+    chMtxUnlock();
+    return result;
+}
+
+/**
+ * @brief Drops all the modified blocks, reverting to the base image
+ */
+void ovlDiscard(OverlayBlockDevice *ovlp) {
+
+    const OverlayBlockConfig *config = ovlp->config;
+    uint32_t slot;
+
+    chDbgCheck(ovlp->state == BLK_READY, "ovlDiscard");
+
+    chMtxLock(&ovlp->mtx);
+
+    /* only clear the index entries that are in use */
+    for (slot = 0; slot < ovlp->slots_used; slot++)
+        config->index[config->slot_blocks[slot]] = 0;
+    ovlp->slots_used = 0;
+
+    chMtxUnlock();
+}
+
+/**
+ * @brief Returns the number of overlay slots currently in use
+ */
+uint32_t ovlGetUsedSlots(OverlayBlockDevice *ovlp) {
+
+    return ovlp->slots_used;
+}
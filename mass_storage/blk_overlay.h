@@ -0,0 +1,149 @@
+/**
+ * @file    blk_overlay.h
+ * @brief   Copy-on-write overlay block device
+ * @details Serves reads from a read-only base block device and redirects
+ *          writes to a sector-granular overlay kept in RAM or on a secondary
+ *          block device. The overlay can later be committed to the base
+ *          device or discarded.
+ */
+
+#ifndef _BLK_OVERLAY_H_
+#define _BLK_OVERLAY_H_
+
+#include "ch.h"
+#include "hal.h"
+
+/**
+ * @brief Largest block size of the base device
+ */
+#if !defined(OVL_MAX_BLOCK_SIZE) || defined(__DOXYGEN__)
+#define OVL_MAX_BLOCK_SIZE 512
+#endif
+
+/**
+ * @brief Type of an overlay index entry
+ * @note  An entry holds the overlay slot number plus one, zero meaning that
+ *        the block is unmodified and is served from the base device.
+ */
+typedef uint16_t ovl_index_t;
+
+/**
+ * @brief Maximum number of overlay slots
+ */
+#define OVL_MAX_SLOTS 0xFFFE
+
+/**
+ * @brief Size in bytes of the index needed for a base device of @p blk_num blocks
+ */
+#define OVL_INDEX_SIZE(blk_num) ((blk_num) * sizeof(ovl_index_t))
+
+/**
+ * @brief Overlay block device configuration structure
+ */
+typedef struct {
+    /**
+    * @brief Read-only base block device (e.g. factory image in flash)
+    */
+    BaseBlockDevice *base;
+
+    /**
+    * @brief Optional secondary block device holding the overlay slots
+    * @note  When NULL, the overlay slots are stored in @p slot_buffer.
+    */
+    BaseBlockDevice *overlay_bbdp;
+
+    /**
+    * @brief RAM storage for the overlay slots
+    * @note  Must hold @p slot_count blocks of the base block size. Unused when
+    *        @p overlay_bbdp is set.
+    */
+    uint8_t *slot_buffer;
+
+    /**
+    * @brief Number of overlay slots (maximum @p OVL_MAX_SLOTS)
+    */
+    uint32_t slot_count;
+
+    /**
+    * @brief Block to slot lookup index, one entry per base block
+    * @note  Use @p OVL_INDEX_SIZE to size it.
+    */
+    ovl_index_t *index;
+
+    /**
+    * @brief Slot to block reverse map, one entry per overlay slot
+    */
+    uint32_t *slot_blocks;
+
+} OverlayBlockConfig;
+
+/**
+ * @brief @p OverlayBlockDevice virtual methods table
+ */
+struct OverlayBlockDeviceVMT {
+    _base_block_device_methods
+};
+
+/**
+ * @brief   Overlay block device structure.
+ * @details This structure holds all the states and members of a
+ *          copy-on-write overlay block device.
+ */
+typedef struct {
+    const struct OverlayBlockDeviceVMT *vmt;
+    _base_block_device_data
+    const OverlayBlockConfig *config;
+    Mutex mtx;
+    BlockDeviceInfo info;
+    uint32_t slots_used;
+    /* word aligned as the block devices may use DMA */
+    uint32_t scratch[OVL_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+} OverlayBlockDevice;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Initializes an overlay block device.
+ */
+void ovlInit(OverlayBlockDevice *ovlp);
+
+/**
+ * @brief   Starts an overlay block device.
+ * @details The base block device must be ready, and the overlay starts empty.
+ */
+void ovlStart(OverlayBlockDevice *ovlp, const OverlayBlockConfig *config);
+
+/**
+ * @brief   Stops an overlay block device.
+ * @details The overlay content is lost, commit it first if needed.
+ */
+void ovlStop(OverlayBlockDevice *ovlp);
+
+/**
+ * @brief   Writes all the modified blocks back to the base block device.
+ * @details Successfully committed blocks are removed from the overlay.
+ *
+ * @return              The operation status.
+ * @retval CH_SUCCESS   All the blocks have been committed.
+ * @retval CH_FAILED    A block could not be read from the overlay or written
+ *                      to the base device, it remains in the overlay.
+ */
+bool_t ovlCommit(OverlayBlockDevice *ovlp);
+
+/**
+ * @brief   Drops all the modified blocks, reverting to the base image.
+ */
+void ovlDiscard(OverlayBlockDevice *ovlp);
+
+/**
+ * @brief   Returns the number of overlay slots currently in use.
+ */
+uint32_t ovlGetUsedSlots(OverlayBlockDevice *ovlp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLK_OVERLAY_H_ */
@@ -0,0 +1,299 @@
+#include "blk_raid.h"
+
+/**
+ * @brief Transfers the part of the current request that belongs to a member
+ */
+static bool_t raid_run_member(RaidBlockDevice *rdp, uint32_t member) {
+
+    const RaidConfig *config = rdp->config;
+    BaseBlockDevice *bbdp = config->members[member];
+    uint32_t stripe_blocks = config->stripe_blocks;
+    uint32_t blk = rdp->startblk;
+    uint32_t end = rdp->startblk + rdp->n;
+
+    /* mirrored writes go entirely to every member */
+    if ((config->mode == RAID_MODE_MIRROR) && rdp->write)
+        return blkWrite(bbdp, rdp->startblk, rdp->buffer, rdp->n);
+
+    /* walk the stripes, only handling the ones owned by this member */
+    while (blk < end) {
+        uint32_t stripe = blk / stripe_blocks;
+        uint32_t count = stripe_blocks - (blk % stripe_blocks);
+        if (count > end - blk)
+            count = end - blk;
+
+        if ((stripe % config->member_count) == member) {
+            uint32_t member_blk = blk;
+            uint8_t *buffer = rdp->buffer + (blk - rdp->startblk) * rdp->info.blk_size;
+
+            if (config->mode == RAID_MODE_STRIPE)
+                member_blk = (stripe / config->member_count) * stripe_blocks + (blk % stripe_blocks);
+
+            if (rdp->write) {
+                if (blkWrite(bbdp, member_blk, buffer, count) == CH_FAILED)
+                    return CH_FAILED;
+            } else {
+                if (blkRead(bbdp, member_blk, buffer, count) == CH_FAILED)
+                    return CH_FAILED;
+            }
+        }
+
+        blk += count;
+    }
+
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Member worker thread
+ */
+static msg_t raid_worker_thread(void *arg) {
+
+    raid_worker_t *wp = (raid_worker_t *)arg;
+    RaidBlockDevice *rdp = (RaidBlockDevice *)wp->owner;
+
+    chRegSetThreadName("RAID");
+
+    while (TRUE) {
+        chBSemWait(&wp->start);
+        if (chThdShouldTerminate())
+            break;
+
+        wp->result = raid_run_member(rdp, wp->index);
+        chSemSignal(&rdp->done);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Splits a request over the members and waits for its completion
+ */
+static bool_t raid_transfer(RaidBlockDevice *rdp, bool_t write, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    const RaidConfig *config = rdp->config;
+    bool_t result = CH_SUCCESS;
+    uint32_t i;
+
+    if ((n == 0) || (startblk + n > rdp->info.blk_num))
+        return CH_FAILED;
+
+    chMtxLock(&rdp->mtx);
+
+    if (rdp->state != BLK_READY) {
+        chMtxUnlock();
+        return CH_FAILED;
+    }
+
+    rdp->write = write;
+    rdp->startblk = startblk;
+    rdp->n = n;
+    rdp->buffer = buffer;
+
+    uint32_t first_stripe = startblk / config->stripe_blocks;
+    uint32_t stripes = (startblk + n - 1) / config->stripe_blocks - first_stripe + 1;
+    uint32_t involved = (stripes < config->member_count) ? stripes : config->member_count;
+
+    if ((config->mode == RAID_MODE_MIRROR) && write)
+        involved = config->member_count;
+
+    if (involved == 1) {
+        /* a single member is involved, no need to wake the workers up */
+        result = raid_run_member(rdp, first_stripe % config->member_count);
+    } else {
+        /* consecutive stripes belong to distinct members */
+        for (i = 0; i < involved; i++)
+            chBSemSignal(&rdp->workers[(first_stripe + i) % config->member_count].start);
+        for (i = 0; i < involved; i++)
+            chSemWait(&rdp->done);
+        for (i = 0; i < involved; i++)
+            if (rdp->workers[(first_stripe + i) % config->member_count].result == CH_FAILED)
+                result = CH_FAILED;
+    }
+
+    if ((result == CH_FAILED) && (config->mode == RAID_MODE_MIRROR) && !write) {
+        /* read the whole range from any member still able to serve it */
+        for (i = 0; i < config->member_count; i++) {
+            if (blkRead(config->members[i], startblk, buffer, n) == CH_SUCCESS) {
+                result = CH_SUCCESS;
+                break;
+            }
+        }
+    }
+
+    chMtxUnlock();
+    return result;
+}
+
+static bool_t raid_is_inserted(void *instance) {
+
+    RaidBlockDevice *rdp = (RaidBlockDevice *)instance;
+    uint32_t i;
+
+    for (i = 0; i < rdp->config->member_count; i++)
+        if (!blkIsInserted(rdp->config->members[i]))
+            return FALSE;
+    return TRUE;
+}
+
+static bool_t raid_is_protected(void *instance) {
+
+    RaidBlockDevice *rdp = (RaidBlockDevice *)instance;
+    uint32_t i;
+
+    for (i = 0; i < rdp->config->member_count; i++)
+        if (blkIsWriteProtected(rdp->config->members[i]))
+            return TRUE;
+    return FALSE;
+}
+
+static bool_t raid_connect(void *instance) {
+
+    RaidBlockDevice *rdp = (RaidBlockDevice *)instance;
+    return (rdp->state == BLK_READY) ? CH_SUCCESS : CH_FAILED;
+}
+
+static bool_t raid_disconnect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t raid_read(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    return raid_transfer((RaidBlockDevice *)instance, FALSE, startblk, buffer, n);
+}
+
+static bool_t raid_write(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n) {
+
+    return raid_transfer((RaidBlockDevice *)instance, TRUE, startblk, (uint8_t *)buffer, n);
+}
+
+static bool_t raid_sync(void *instance) {
+
+    RaidBlockDevice *rdp = (RaidBlockDevice *)instance;
+    bool_t result = CH_SUCCESS;
+    uint32_t i;
+
+    for (i = 0; i < rdp->config->member_count; i++)
+        if (blkSync(rdp->config->members[i]) == CH_FAILED)
+            result = CH_FAILED;
+    return result;
+}
+
+static bool_t raid_get_info(void *instance, BlockDeviceInfo *bdip) {
+
+    RaidBlockDevice *rdp = (RaidBlockDevice *)instance;
+
+    if (rdp->state != BLK_READY)
+        return CH_FAILED;
+
+    *bdip = rdp->info;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Virtual methods table
+ */
+static const struct RaidBlockDeviceVMT raid_vmt = {
+    raid_is_inserted,
+    raid_is_protected,
+    raid_connect,
+    raid_disconnect,
+    raid_read,
+    raid_write,
+    raid_sync,
+    raid_get_info
+};
+
+/**
+ * @brief Initializes a RAID block device
+ */
+void raidInit(RaidBlockDevice *rdp) {
+
+    chDbgCheck(rdp != NULL, "raidInit");
+
+    rdp->vmt = &raid_vmt;
+    rdp->state = BLK_STOP;
+    rdp->config = NULL;
+    chMtxInit(&rdp->mtx);
+    chSemInit(&rdp->done, 0);
+}
+
+/**
+ * @brief Starts a RAID block device
+ */
+void raidStart(RaidBlockDevice *rdp, const RaidConfig *config) {
+
+    uint32_t i;
+
+    chDbgCheck(rdp != NULL, "raidStart");
+    chDbgCheck(config != NULL, "raidStart");
+    chDbgCheck((config->member_count > 0) && (config->member_count <= RAID_MAX_MEMBERS), "raidStart");
+    chDbgCheck(config->stripe_blocks > 0, "raidStart");
+
+    rdp->config = config;
+
+    /* the volume is limited by the smallest member */
+    uint32_t blk_num = 0xFFFFFFFF;
+    for (i = 0; i < config->member_count; i++) {
+        BlockDeviceInfo info;
+
+        chDbgCheck(blkGetDriverState(config->members[i]) == BLK_READY, "raidStart");
+        blkGetInfo(config->members[i], &info);
+        chDbgCheck((i == 0) || (info.blk_size == rdp->info.blk_size), "raidStart");
+
+        rdp->info.blk_size = info.blk_size;
+        if (info.blk_num < blk_num)
+            blk_num = info.blk_num;
+    }
+
+    if (config->mode == RAID_MODE_STRIPE)
+        blk_num = (blk_num / config->stripe_blocks) * config->stripe_blocks * config->member_count;
+    rdp->info.blk_num = blk_num;
+
+    /* start one worker per member */
+    tprio_t prio = (config->worker_prio != 0) ? config->worker_prio : NORMALPRIO;
+    for (i = 0; i < config->member_count; i++) {
+        raid_worker_t *wp = &rdp->workers[i];
+
+        wp->owner = rdp;
+        wp->index = i;
+        wp->result = CH_SUCCESS;
+        chBSemInit(&wp->start, TRUE);
+        wp->thread = chThdCreateStatic(wp->wa, sizeof(wp->wa), prio, raid_worker_thread, wp);
+    }
+
+    rdp->state = BLK_READY;
+}
+
+/**
+ * @brief Stops a RAID block device
+ */
+void raidStop(RaidBlockDevice *rdp) {
+
+    uint32_t i;
+
+    chDbgCheck(rdp != NULL, "raidStop");
+
+    /* wait for the current request */
+    chMtxLock(&rdp->mtx);
+
+    /* never started or already stopped, no worker to stop */
+    if (rdp->state != BLK_READY) {
+        chMtxUnlock();
+        return;
+    }
+    rdp->state = BLK_STOP;
+
+    for (i = 0; i < rdp->config->member_count; i++) {
+        raid_worker_t *wp = &rdp->workers[i];
+
+        chThdTerminate(wp->thread);
+        chBSemSignal(&wp->start);
+        chThdWait(wp->thread);
+        wp->thread = NULL;
+    }
+
+    chMtxUnlock();
+}
@@ -0,0 +1,137 @@
+/**
+ * @file    blk_raid.h
+ * @brief   Striped and mirrored block device aggregator
+ * @details Combines several block devices into a single one, either striped
+ *          (RAID-0) or mirrored (RAID-1). Each member device is driven by its
+ *          own worker thread so that the members transfer in parallel.
+ */
+
+#ifndef _BLK_RAID_H_
+#define _BLK_RAID_H_
+
+#include "ch.h"
+#include "hal.h"
+
+/**
+ * @brief Maximum number of member devices
+ */
+#if !defined(RAID_MAX_MEMBERS) || defined(__DOXYGEN__)
+#define RAID_MAX_MEMBERS 2
+#endif
+
+/**
+ * @brief Working area size of the member worker threads
+ */
+#if !defined(RAID_WORKER_WA_SIZE) || defined(__DOXYGEN__)
+#define RAID_WORKER_WA_SIZE 512
+#endif
+
+/**
+ * @brief Aggregation modes
+ */
+typedef enum {
+    RAID_MODE_STRIPE,   /**< RAID-0, blocks are striped over the members      */
+    RAID_MODE_MIRROR    /**< RAID-1, writes go to all members, reads are
+                             interleaved between them stripe by stripe      */
+} raid_mode_t;
+
+/**
+ * @brief RAID block device configuration structure
+ */
+typedef struct {
+    /**
+    * @brief Aggregation mode
+    */
+    raid_mode_t mode;
+
+    /**
+    * @brief Member block devices, all using the same block size
+    */
+    BaseBlockDevice *members[RAID_MAX_MEMBERS];
+
+    /**
+    * @brief Number of member block devices
+    */
+    uint32_t member_count;
+
+    /**
+    * @brief Stripe size in blocks
+    * @note  In mirror mode this is the read interleaving granularity.
+    */
+    uint32_t stripe_blocks;
+
+    /**
+    * @brief Priority of the member worker threads, @p NORMALPRIO when zero
+    */
+    tprio_t worker_prio;
+
+} RaidConfig;
+
+/**
+ * @brief Member worker structure
+ */
+typedef struct {
+    void *owner;
+    uint32_t index;
+    Thread *thread;
+    BinarySemaphore start;
+    bool_t result;
+    WORKING_AREA(wa, RAID_WORKER_WA_SIZE);
+} raid_worker_t;
+
+/**
+ * @brief @p RaidBlockDevice virtual methods table
+ */
+struct RaidBlockDeviceVMT {
+    _base_block_device_methods
+};
+
+/**
+ * @brief   RAID block device structure.
+ * @details This structure holds all the states and members of a RAID block
+ *          device.
+ */
+typedef struct {
+    const struct RaidBlockDeviceVMT *vmt;
+    _base_block_device_data
+    const RaidConfig *config;
+    Mutex mtx;
+    Semaphore done;
+    BlockDeviceInfo info;
+
+    /* request being processed by the workers */
+    bool_t write;
+    uint32_t startblk;
+    uint32_t n;
+    uint8_t *buffer;
+
+    raid_worker_t workers[RAID_MAX_MEMBERS];
+} RaidBlockDevice;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Initializes a RAID block device.
+ */
+void raidInit(RaidBlockDevice *rdp);
+
+/**
+ * @brief   Starts a RAID block device.
+ * @details The member block devices must be ready. One worker thread is
+ *          started per member.
+ */
+void raidStart(RaidBlockDevice *rdp, const RaidConfig *config);
+
+/**
+ * @brief   Stops a RAID block device.
+ * @details Waits for the current request, if any, and stops the workers.
+ */
+void raidStop(RaidBlockDevice *rdp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLK_RAID_H_ */
@@ -0,0 +1,387 @@
+#include "blk_sched.h"
+
+#include <string.h>
+
+/**
+ * @brief Removes a request from the queue
+ */
+static void sched_unlink(SchedBlockDevice *sdp, sched_request_t *rp) {
+
+    sched_request_t **pp = &sdp->queue;
+
+    while (*pp != rp)
+        pp = &(*pp)->next;
+    *pp = rp->next;
+    rp->next = NULL;
+}
+
+/**
+ * @brief Accounts the dispatch of a request
+ */
+static void sched_account(SchedBlockDevice *sdp, sched_request_t *rp, systime_t now) {
+
+    sched_stats_t *stats = &sdp->stats[rp->source];
+    systime_t wait = now - rp->arrival;
+
+    stats->depth--;
+    stats->requests++;
+    stats->blocks += rp->n;
+    stats->wait_time += wait;
+    if (wait > stats->max_wait)
+        stats->max_wait = wait;
+}
+
+/**
+ * @brief Returns a queued request continuing a run, or NULL
+ */
+static sched_request_t *sched_find_adjacent(SchedBlockDevice *sdp, sched_op_t op, uint32_t end) {
+
+    sched_request_t *rp;
+
+    for (rp = sdp->queue; rp != NULL; rp = rp->next)
+        if ((rp->op == op) && (rp->startblk == end))
+            return rp;
+
+    return NULL;
+}
+
+/**
+ * @brief Picks the next requests, merged with the adjacent ones
+ * @note  The picked requests are linked through @p next.
+ */
+static sched_request_t *sched_pick(SchedBlockDevice *sdp) {
+
+    const SchedConfig *config = sdp->config;
+    systime_t now = chTimeNow();
+    sched_request_t *first, *last, *rp;
+    uint32_t total;
+
+    chMtxLock(&sdp->mtx);
+
+    if (sdp->queue == NULL) {
+        chMtxUnlock();
+        return NULL;
+    }
+
+    /* synchronizations are not reordered */
+    for (first = sdp->queue; first != NULL; first = first->next)
+        if (first->op == SCHED_OP_SYNC)
+            break;
+    if (first == NULL)
+        first = config->policy(sdp);
+
+    sched_unlink(sdp, first);
+    sched_account(sdp, first, now);
+    last = first;
+    total = first->n;
+
+    /* merge the requests following the picked one on the media */
+    if ((first->op != SCHED_OP_SYNC) && (config->merge_buffer != NULL)) {
+        while ((rp = sched_find_adjacent(sdp, first->op, last->startblk + last->n)) != NULL) {
+            if (total + rp->n > config->merge_blocks)
+                break;
+
+            sched_unlink(sdp, rp);
+            sched_account(sdp, rp, now);
+            sdp->stats[rp->source].merged++;
+            last->next = rp;
+            last = rp;
+            total += rp->n;
+        }
+    }
+
+    if (first->op != SCHED_OP_SYNC)
+        sdp->head = first->startblk + total;
+    sdp->dispatches++;
+
+    chMtxUnlock();
+    return first;
+}
+
+/**
+ * @brief Transfers picked requests and completes them
+ */
+static void sched_execute(SchedBlockDevice *sdp, sched_request_t *first) {
+
+    const SchedConfig *config = sdp->config;
+    BaseBlockDevice *base = config->base;
+    uint32_t blk_size = sdp->info.blk_size;
+    sched_request_t *rp, *next;
+    uint32_t total = 0;
+    bool_t result;
+
+    if (first->op == SCHED_OP_SYNC) {
+        result = blkSync(base);
+    } else if (first->next == NULL) {
+        if (first->op == SCHED_OP_READ)
+            result = blkRead(base, first->startblk, first->buffer, first->n);
+        else
+            result = blkWrite(base, first->startblk, first->buffer, first->n);
+    } else {
+        for (rp = first; rp != NULL; rp = rp->next)
+            total += rp->n;
+
+        if (first->op == SCHED_OP_READ) {
+            result = blkRead(base, first->startblk, config->merge_buffer, total);
+            total = 0;
+            for (rp = first; rp != NULL; rp = rp->next) {
+                memcpy(rp->buffer, config->merge_buffer + total * blk_size, rp->n * blk_size);
+                total += rp->n;
+            }
+        } else {
+            total = 0;
+            for (rp = first; rp != NULL; rp = rp->next) {
+                memcpy(config->merge_buffer + total * blk_size, rp->buffer, rp->n * blk_size);
+                total += rp->n;
+            }
+            result = blkWrite(base, first->startblk, config->merge_buffer, total);
+        }
+    }
+
+    for (rp = first; rp != NULL; rp = next) {
+        next = rp->next;
+        rp->result = result;
+        chBSemSignal(&rp->done);
+    }
+}
+
+/**
+ * @brief Dispatcher thread
+ */
+static msg_t sched_dispatch_thread(void *arg) {
+
+    SchedBlockDevice *sdp = (SchedBlockDevice *)arg;
+    sched_request_t *rp;
+
+    chRegSetThreadName("IOSched");
+
+    while (TRUE) {
+        chBSemWait(&sdp->wakeup);
+
+        while ((rp = sched_pick(sdp)) != NULL)
+            sched_execute(sdp, rp);
+
+        if (chThdShouldTerminate())
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Queues a request and waits for its completion
+ */
+static bool_t sched_submit(SchedPort *pp, sched_op_t op, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    SchedBlockDevice *sdp = (SchedBlockDevice *)pp->owner;
+    sched_stats_t *stats = &sdp->stats[pp->source];
+    sched_request_t request, **tail;
+
+    if ((op != SCHED_OP_SYNC) &&
+        ((n == 0) || (startblk >= sdp->info.blk_num) || (n > sdp->info.blk_num - startblk)))
+        return CH_FAILED;
+
+    request.next = NULL;
+    request.source = pp->source;
+    request.op = op;
+    request.startblk = startblk;
+    request.n = n;
+    request.buffer = buffer;
+    request.result = CH_FAILED;
+    chBSemInit(&request.done, TRUE);
+
+    chMtxLock(&sdp->mtx);
+
+    if (pp->state != BLK_READY) {
+        chMtxUnlock();
+        return CH_FAILED;
+    }
+
+    request.arrival = chTimeNow();
+    for (tail = &sdp->queue; *tail != NULL; tail = &(*tail)->next)
+        ;
+    *tail = &request;
+
+    if (++stats->depth > stats->max_depth)
+        stats->max_depth = stats->depth;
+
+    chMtxUnlock();
+
+    chBSemSignal(&sdp->wakeup);
+    chBSemWait(&request.done);
+    return request.result;
+}
+
+static bool_t sched_is_inserted(void *instance) {
+
+    SchedBlockDevice *sdp = (SchedBlockDevice *)((SchedPort *)instance)->owner;
+    return blkIsInserted(sdp->config->base);
+}
+
+static bool_t sched_is_protected(void *instance) {
+
+    SchedBlockDevice *sdp = (SchedBlockDevice *)((SchedPort *)instance)->owner;
+    return blkIsWriteProtected(sdp->config->base);
+}
+
+static bool_t sched_connect(void *instance) {
+
+    SchedPort *pp = (SchedPort *)instance;
+    return (pp->state == BLK_READY) ? CH_SUCCESS : CH_FAILED;
+}
+
+static bool_t sched_disconnect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t sched_read(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    return sched_submit((SchedPort *)instance, SCHED_OP_READ, startblk, buffer, n);
+}
+
+static bool_t sched_write(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n) {
+
+    return sched_submit((SchedPort *)instance, SCHED_OP_WRITE, startblk, (uint8_t *)buffer, n);
+}
+
+static bool_t sched_sync(void *instance) {
+
+    return sched_submit((SchedPort *)instance, SCHED_OP_SYNC, 0, NULL, 0);
+}
+
+static bool_t sched_get_info(void *instance, BlockDeviceInfo *bdip) {
+
+    SchedPort *pp = (SchedPort *)instance;
+
+    if (pp->state != BLK_READY)
+        return CH_FAILED;
+
+    *bdip = ((SchedBlockDevice *)pp->owner)->info;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Virtual methods table
+ */
+static const struct SchedPortVMT sched_vmt = {
+    sched_is_inserted,
+    sched_is_protected,
+    sched_connect,
+    sched_disconnect,
+    sched_read,
+    sched_write,
+    sched_sync,
+    sched_get_info
+};
+
+/**
+ * @brief Elevator policy
+ */
+sched_request_t *schedPolicyElevator(SchedBlockDevice *sdp) {
+
+    sched_request_t *rp, *ahead = NULL, *lowest = NULL;
+
+    for (rp = sdp->queue; rp != NULL; rp = rp->next) {
+        if ((rp->startblk >= sdp->head) && ((ahead == NULL) || (rp->startblk < ahead->startblk)))
+            ahead = rp;
+        if ((lowest == NULL) || (rp->startblk < lowest->startblk))
+            lowest = rp;
+    }
+
+    return (ahead != NULL) ? ahead : lowest;
+}
+
+/**
+ * @brief Deadline policy
+ */
+sched_request_t *schedPolicyDeadline(SchedBlockDevice *sdp) {
+
+    systime_t now = chTimeNow();
+    sched_request_t *rp;
+
+    /* the queue is in arrival order, the first expired request is the oldest */
+    for (rp = sdp->queue; rp != NULL; rp = rp->next)
+        if ((systime_t)(now - rp->arrival) >= sdp->config->expire[rp->source])
+            return rp;
+
+    return schedPolicyElevator(sdp);
+}
+
+/**
+ * @brief Initializes an I/O scheduler block device
+ */
+void schedInit(SchedBlockDevice *sdp) {
+
+    uint32_t i;
+
+    chDbgCheck(sdp != NULL, "schedInit");
+
+    sdp->config = NULL;
+    sdp->thread = NULL;
+    chMtxInit(&sdp->mtx);
+    chBSemInit(&sdp->wakeup, TRUE);
+
+    for (i = 0; i < SCHED_SOURCES; i++) {
+        SchedPort *pp = &sdp->ports[i];
+
+        pp->vmt = &sched_vmt;
+        pp->state = BLK_STOP;
+        pp->owner = sdp;
+        pp->source = (sched_source_t)i;
+    }
+}
+
+/**
+ * @brief Starts an I/O scheduler block device
+ */
+void schedStart(SchedBlockDevice *sdp, const SchedConfig *config) {
+
+    uint32_t i;
+
+    chDbgCheck(sdp != NULL, "schedStart");
+    chDbgCheck(config != NULL, "schedStart");
+    chDbgCheck(config->policy != NULL, "schedStart");
+    chDbgCheck(blkGetDriverState(config->base) == BLK_READY, "schedStart");
+
+    sdp->config = config;
+    blkGetInfo(config->base, &sdp->info);
+
+    sdp->queue = NULL;
+    sdp->head = 0;
+    sdp->dispatches = 0;
+    memset(sdp->stats, 0, sizeof(sdp->stats));
+
+    tprio_t prio = (config->dispatch_prio != 0) ? config->dispatch_prio : NORMALPRIO;
+    sdp->thread = chThdCreateStatic(sdp->wa, sizeof(sdp->wa), prio, sched_dispatch_thread, sdp);
+
+    for (i = 0; i < SCHED_SOURCES; i++)
+        sdp->ports[i].state = BLK_READY;
+}
+
+/**
+ * @brief Stops an I/O scheduler block device
+ */
+void schedStop(SchedBlockDevice *sdp) {
+
+    uint32_t i;
+
+    chDbgCheck(sdp != NULL, "schedStop");
+
+    /* never started or already stopped */
+    if (sdp->thread == NULL)
+        return;
+
+    /* refuse new requests */
+    chMtxLock(&sdp->mtx);
+    for (i = 0; i < SCHED_SOURCES; i++)
+        sdp->ports[i].state = BLK_STOP;
+    chMtxUnlock();
+
+    /* the dispatcher drains the queue before terminating */
+    chThdTerminate(sdp->thread);
+    chBSemSignal(&sdp->wakeup);
+    chThdWait(sdp->thread);
+    sdp->thread = NULL;
+}
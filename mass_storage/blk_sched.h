@@ -0,0 +1,201 @@
+/**
+ * @file    blk_sched.h
+ * @brief   I/O scheduler block device
+ * @details Queues the requests that several sources (host, read-ahead,
+ *          write-back, firmware) issue to a block device through their own
+ *          port, a dispatcher thread issuing them in the order chosen by a
+ *          pluggable policy. Adjacent requests going in the same direction
+ *          are merged into a single transfer.
+ */
+
+#ifndef _BLK_SCHED_H_
+#define _BLK_SCHED_H_
+
+#include "ch.h"
+#include "hal.h"
+
+/**
+ * @brief Working area size of the dispatcher thread
+ */
+#if !defined(SCHED_DISPATCH_WA_SIZE) || defined(__DOXYGEN__)
+#define SCHED_DISPATCH_WA_SIZE 512
+#endif
+
+/**
+ * @brief Request sources
+ */
+typedef enum {
+    SCHED_HOST = 0,         /**< Host READ_10/WRITE_10                        */
+    SCHED_READ_AHEAD = 1,   /**< Speculative reads                            */
+    SCHED_WRITE_BACK = 2,   /**< Cache flushes                                */
+    SCHED_FIRMWARE = 3,     /**< Application threads                          */
+    SCHED_SOURCES = 4
+} sched_source_t;
+
+/**
+ * @brief Request operations
+ */
+typedef enum {
+    SCHED_OP_READ,
+    SCHED_OP_WRITE,
+    SCHED_OP_SYNC
+} sched_op_t;
+
+/**
+ * @brief   Queued request structure
+ * @details Lives on the stack of the requesting thread until completion.
+ */
+typedef struct sched_request {
+    struct sched_request *next;
+    sched_source_t source;
+    sched_op_t op;
+    uint32_t startblk;
+    uint32_t n;
+    uint8_t *buffer;
+    systime_t arrival;
+    BinarySemaphore done;
+    bool_t result;
+} sched_request_t;
+
+typedef struct SchedBlockDevice SchedBlockDevice;
+
+/**
+ * @brief   Scheduling policy
+ * @details Returns the queued request to dispatch next, the queue is never
+ *          empty when called.
+ */
+typedef sched_request_t *(*sched_policy_t)(SchedBlockDevice *sdp);
+
+/**
+ * @brief Per source statistics structure
+ */
+typedef struct {
+    uint32_t requests;
+    uint32_t blocks;
+    uint32_t merged;
+    uint32_t depth;
+    uint32_t max_depth;
+    systime_t wait_time;
+    systime_t max_wait;
+} sched_stats_t;
+
+/**
+ * @brief I/O scheduler block device configuration structure
+ */
+typedef struct {
+    /**
+    * @brief Underlying block device
+    */
+    BaseBlockDevice *base;
+
+    /**
+    * @brief Scheduling policy, @p schedPolicyDeadline or @p schedPolicyElevator
+    */
+    sched_policy_t policy;
+
+    /**
+    * @brief Time after which a request of each source is served first
+    * @note  Only used by the deadline policy.
+    */
+    systime_t expire[SCHED_SOURCES];
+
+    /**
+    * @brief Merge buffer, holding @p merge_blocks blocks
+    * @note  Requests are not merged when NULL.
+    */
+    uint8_t *merge_buffer;
+
+    /**
+    * @brief Size of the merge buffer in blocks
+    */
+    uint32_t merge_blocks;
+
+    /**
+    * @brief Priority of the dispatcher thread, @p NORMALPRIO when zero
+    */
+    tprio_t dispatch_prio;
+
+} SchedConfig;
+
+/**
+ * @brief @p SchedPort virtual methods table
+ */
+struct SchedPortVMT {
+    _base_block_device_methods
+};
+
+/**
+ * @brief   I/O scheduler port structure.
+ * @details Block device through which one source queues its requests.
+ */
+typedef struct {
+    const struct SchedPortVMT *vmt;
+    _base_block_device_data
+    void *owner;
+    sched_source_t source;
+} SchedPort;
+
+/**
+ * @brief   I/O scheduler block device structure.
+ * @details This structure holds all the states and members of an I/O
+ *          scheduler block device.
+ */
+struct SchedBlockDevice {
+    const SchedConfig *config;
+    Mutex mtx;
+    BinarySemaphore wakeup;
+    Thread *thread;
+    sched_request_t *queue;
+    uint32_t head;
+    uint32_t dispatches;
+    BlockDeviceInfo info;
+    SchedPort ports[SCHED_SOURCES];
+    sched_stats_t stats[SCHED_SOURCES];
+    WORKING_AREA(wa, SCHED_DISPATCH_WA_SIZE);
+};
+
+/**
+ * @brief   Returns the port of a source.
+ */
+#define schedGetPort(sdp, source) ((BaseBlockDevice *)&(sdp)->ports[(source)])
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Initializes an I/O scheduler block device.
+ */
+void schedInit(SchedBlockDevice *sdp);
+
+/**
+ * @brief   Starts an I/O scheduler block device.
+ * @details The underlying block device must be ready.
+ */
+void schedStart(SchedBlockDevice *sdp, const SchedConfig *config);
+
+/**
+ * @brief   Stops an I/O scheduler block device.
+ * @details The queued requests are served before the dispatcher stops.
+ */
+void schedStop(SchedBlockDevice *sdp);
+
+/**
+ * @brief   Deadline policy.
+ * @details Serves the oldest request whose source expiration time has elapsed,
+ *          the elevator order otherwise.
+ */
+sched_request_t *schedPolicyDeadline(SchedBlockDevice *sdp);
+
+/**
+ * @brief   Elevator policy.
+ * @details Serves the requests in ascending block order from the last
+ *          dispatched block, wrapping around to the lowest one (C-LOOK).
+ */
+sched_request_t *schedPolicyElevator(SchedBlockDevice *sdp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLK_SCHED_H_ */
@@ -0,0 +1,325 @@
+#include "blk_shared.h"
+
+#include <string.h>
+
+/**
+ * @brief Waits for the turn of a view, then takes the underlying device
+ */
+static bool_t shared_acquire(SharedBlockView *vp, uint32_t n) {
+
+    SharedBlockDevice *sdp = (SharedBlockDevice *)vp->owner;
+    shared_source_t source = vp->source;
+    shared_source_t other = (source == SHARED_HOST) ? SHARED_FIRMWARE : SHARED_HOST;
+    systime_t start = chTimeNow();
+
+    chMtxLock(&sdp->mtx);
+    sdp->waiting[source]++;
+
+    /* let the other view go once this one has used its quantum */
+    while (sdp->busy || ((sdp->waiting[other] > 0) && (sdp->last == source) &&
+                         (sdp->streak >= sdp->config->quantum[source])))
+        chCondWait(&sdp->cond);
+
+    sdp->waiting[source]--;
+
+    if (vp->state != BLK_READY) {
+        chCondBroadcast(&sdp->cond);
+        chMtxUnlock();
+        return CH_FAILED;
+    }
+
+    if (sdp->last != source) {
+        sdp->last = source;
+        sdp->streak = 0;
+    }
+    sdp->streak += n;
+    sdp->busy = TRUE;
+    chMtxUnlock();
+
+    vp->requests++;
+    vp->blocks += n;
+    vp->wait_time += chTimeNow() - start;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Releases the underlying device
+ */
+static void shared_release(SharedBlockDevice *sdp) {
+
+    chMtxLock(&sdp->mtx);
+    sdp->busy = FALSE;
+    chCondBroadcast(&sdp->cond);
+    chMtxUnlock();
+}
+
+/**
+ * @brief Returns the cache slot holding a block, or -1
+ */
+static int32_t shared_cache_lookup(SharedBlockDevice *sdp, uint32_t block) {
+
+    const SharedConfig *config = sdp->config;
+    uint32_t i;
+
+    for (i = 0; i < config->cache_blocks; i++)
+        if (config->cache_slots[i].block == block)
+            return (int32_t)i;
+
+    return -1;
+}
+
+/**
+ * @brief Returns the address of the data of a cache slot
+ */
+static inline uint8_t *shared_cache_data(SharedBlockDevice *sdp, uint32_t slot) {
+
+    return sdp->config->cache_buffer + slot * sdp->info.blk_size;
+}
+
+/**
+ * @brief Reads one block through the cache
+ */
+static bool_t shared_cache_read(SharedBlockDevice *sdp, uint32_t block, uint8_t *buffer) {
+
+    const SharedConfig *config = sdp->config;
+    int32_t slot = shared_cache_lookup(sdp, block);
+    uint32_t i;
+
+    if (slot < 0) {
+        /* replace the least recently used slot */
+        slot = 0;
+        for (i = 1; i < config->cache_blocks; i++)
+            if (config->cache_slots[i].last_use < config->cache_slots[slot].last_use)
+                slot = (int32_t)i;
+
+        config->cache_slots[slot].block = SHARED_FREE;
+        if (blkRead(config->base, block, shared_cache_data(sdp, slot), 1) == CH_FAILED)
+            return CH_FAILED;
+
+        config->cache_slots[slot].block = block;
+        sdp->cache_misses++;
+    } else {
+        sdp->cache_hits++;
+    }
+
+    config->cache_slots[slot].last_use = ++sdp->use_counter;
+    memcpy(buffer, shared_cache_data(sdp, slot), sdp->info.blk_size);
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Updates, or drops on failure, the cached copies of written blocks
+ */
+static void shared_cache_update(SharedBlockDevice *sdp, uint32_t startblk, const uint8_t *buffer, uint32_t n, bool_t result) {
+
+    const SharedConfig *config = sdp->config;
+    uint32_t i;
+
+    for (i = 0; i < config->cache_blocks; i++) {
+        shared_slot_t *sp = &config->cache_slots[i];
+
+        if ((sp->block == SHARED_FREE) || (sp->block < startblk) || (sp->block >= startblk + n))
+            continue;
+
+        if (result == CH_SUCCESS)
+            memcpy(shared_cache_data(sdp, i), buffer + (sp->block - startblk) * sdp->info.blk_size,
+                   sdp->info.blk_size);
+        else
+            sp->block = SHARED_FREE;
+    }
+}
+
+static bool_t shared_is_inserted(void *instance) {
+
+    SharedBlockDevice *sdp = (SharedBlockDevice *)((SharedBlockView *)instance)->owner;
+    return blkIsInserted(sdp->config->base);
+}
+
+static bool_t shared_is_protected(void *instance) {
+
+    SharedBlockView *vp = (SharedBlockView *)instance;
+    SharedBlockDevice *sdp = (SharedBlockDevice *)vp->owner;
+
+    if ((vp->source == SHARED_FIRMWARE) && (sdp->config->mode == SHARED_FIRMWARE_READ_ONLY))
+        return TRUE;
+    return blkIsWriteProtected(sdp->config->base);
+}
+
+static bool_t shared_connect(void *instance) {
+
+    SharedBlockView *vp = (SharedBlockView *)instance;
+    return (vp->state == BLK_READY) ? CH_SUCCESS : CH_FAILED;
+}
+
+static bool_t shared_disconnect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t shared_read(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    SharedBlockView *vp = (SharedBlockView *)instance;
+    SharedBlockDevice *sdp = (SharedBlockDevice *)vp->owner;
+    bool_t result = CH_SUCCESS;
+    uint32_t i;
+
+    if ((n == 0) || (startblk >= sdp->info.blk_num) || (n > sdp->info.blk_num - startblk))
+        return CH_FAILED;
+
+    if (shared_acquire(vp, n) == CH_FAILED)
+        return CH_FAILED;
+
+    if ((sdp->config->cache_blocks == 0) || (n > SHARED_CACHE_MAX_RUN)) {
+        result = blkRead(sdp->config->base, startblk, buffer, n);
+    } else {
+        for (i = 0; (i < n) && (result == CH_SUCCESS); i++)
+            result = shared_cache_read(sdp, startblk + i, buffer + i * sdp->info.blk_size);
+    }
+
+    shared_release(sdp);
+    return result;
+}
+
+static bool_t shared_write(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n) {
+
+    SharedBlockView *vp = (SharedBlockView *)instance;
+    SharedBlockDevice *sdp = (SharedBlockDevice *)vp->owner;
+    bool_t result;
+
+    if ((vp->source == SHARED_FIRMWARE) && (sdp->config->mode == SHARED_FIRMWARE_READ_ONLY))
+        return CH_FAILED;
+
+    if ((n == 0) || (startblk >= sdp->info.blk_num) || (n > sdp->info.blk_num - startblk))
+        return CH_FAILED;
+
+    if (shared_acquire(vp, n) == CH_FAILED)
+        return CH_FAILED;
+
+    /* write-through, the cache never holds dirty blocks */
+    result = blkWrite(sdp->config->base, startblk, buffer, n);
+    shared_cache_update(sdp, startblk, buffer, n, result);
+
+    shared_release(sdp);
+    return result;
+}
+
+static bool_t shared_sync(void *instance) {
+
+    SharedBlockView *vp = (SharedBlockView *)instance;
+    SharedBlockDevice *sdp = (SharedBlockDevice *)vp->owner;
+    bool_t result;
+
+    if (shared_acquire(vp, 0) == CH_FAILED)
+        return CH_FAILED;
+
+    result = blkSync(sdp->config->base);
+
+    shared_release(sdp);
+    return result;
+}
+
+static bool_t shared_get_info(void *instance, BlockDeviceInfo *bdip) {
+
+    SharedBlockView *vp = (SharedBlockView *)instance;
+
+    if (vp->state != BLK_READY)
+        return CH_FAILED;
+
+    *bdip = ((SharedBlockDevice *)vp->owner)->info;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Virtual methods table
+ */
+static const struct SharedBlockViewVMT shared_vmt = {
+    shared_is_inserted,
+    shared_is_protected,
+    shared_connect,
+    shared_disconnect,
+    shared_read,
+    shared_write,
+    shared_sync,
+    shared_get_info
+};
+
+/**
+ * @brief Initializes a view of a shared block device
+ */
+static void shared_view_init(SharedBlockDevice *sdp, SharedBlockView *vp, shared_source_t source) {
+
+    vp->vmt = &shared_vmt;
+    vp->state = BLK_STOP;
+    vp->owner = sdp;
+    vp->source = source;
+    vp->requests = 0;
+    vp->blocks = 0;
+    vp->wait_time = 0;
+}
+
+/**
+ * @brief Initializes a shared block device
+ */
+void sharedInit(SharedBlockDevice *sdp) {
+
+    chDbgCheck(sdp != NULL, "sharedInit");
+
+    sdp->config = NULL;
+    chMtxInit(&sdp->mtx);
+    chCondInit(&sdp->cond);
+    shared_view_init(sdp, &sdp->host, SHARED_HOST);
+    shared_view_init(sdp, &sdp->firmware, SHARED_FIRMWARE);
+}
+
+/**
+ * @brief Starts a shared block device
+ */
+void sharedStart(SharedBlockDevice *sdp, const SharedConfig *config) {
+
+    uint32_t i;
+
+    chDbgCheck(sdp != NULL, "sharedStart");
+    chDbgCheck(config != NULL, "sharedStart");
+    chDbgCheck(blkGetDriverState(config->base) == BLK_READY, "sharedStart");
+    chDbgCheck((config->cache_blocks == 0) || ((config->cache_buffer != NULL) && (config->cache_slots != NULL)),
+               "sharedStart");
+
+    sdp->config = config;
+    blkGetInfo(config->base, &sdp->info);
+
+    sdp->busy = FALSE;
+    sdp->last = SHARED_HOST;
+    sdp->streak = 0;
+    sdp->waiting[SHARED_HOST] = 0;
+    sdp->waiting[SHARED_FIRMWARE] = 0;
+    sdp->use_counter = 0;
+    sdp->cache_hits = 0;
+    sdp->cache_misses = 0;
+
+    for (i = 0; i < config->cache_blocks; i++) {
+        config->cache_slots[i].block = SHARED_FREE;
+        config->cache_slots[i].last_use = 0;
+    }
+
+    sdp->host.state = BLK_READY;
+    sdp->firmware.state = BLK_READY;
+}
+
+/**
+ * @brief Stops a shared block device
+ */
+void sharedStop(SharedBlockDevice *sdp) {
+
+    chDbgCheck(sdp != NULL, "sharedStop");
+
+    /* wait for the current request, the waiting ones then fail */
+    chMtxLock(&sdp->mtx);
+    while (sdp->busy)
+        chCondWait(&sdp->cond);
+
+    sdp->host.state = BLK_STOP;
+    sdp->firmware.state = BLK_STOP;
+    chCondBroadcast(&sdp->cond);
+    chMtxUnlock();
+}
@@ -0,0 +1,170 @@
+/**
+ * @file    blk_shared.h
+ * @brief   Shared access block device
+ * @details Arbitrates a block device between the mass storage thread (host
+ *          view) and application threads (firmware view). Requests of both
+ *          views are serialized, the views taking turns whenever both have
+ *          requests pending, and small requests go through a write-through
+ *          block cache shared by the two views.
+ */
+
+#ifndef _BLK_SHARED_H_
+#define _BLK_SHARED_H_
+
+#include "ch.h"
+#include "hal.h"
+
+/**
+ * @brief Largest request, in blocks, going through the cache
+ * @note  Larger requests are directly transferred, the cached copies of the
+ *        written blocks being updated.
+ */
+#if !defined(SHARED_CACHE_MAX_RUN) || defined(__DOXYGEN__)
+#define SHARED_CACHE_MAX_RUN 4
+#endif
+
+/**
+ * @brief Block index of a free cache slot
+ */
+#define SHARED_FREE 0xFFFFFFFF
+
+/**
+ * @brief Request sources
+ */
+typedef enum {
+    SHARED_HOST = 0,    /**< USB host, through the mass storage driver       */
+    SHARED_FIRMWARE = 1 /**< Application threads                             */
+} shared_source_t;
+
+/**
+ * @brief Firmware access modes
+ */
+typedef enum {
+    SHARED_FIRMWARE_READ_WRITE, /**< The firmware may read and write          */
+    SHARED_FIRMWARE_READ_ONLY   /**< The firmware view is write protected     */
+} shared_mode_t;
+
+/**
+ * @brief Cache slot structure
+ */
+typedef struct {
+    uint32_t block;
+    uint32_t last_use;
+} shared_slot_t;
+
+/**
+ * @brief Shared block device configuration structure
+ */
+typedef struct {
+    /**
+    * @brief Underlying block device
+    */
+    BaseBlockDevice *base;
+
+    /**
+    * @brief Firmware access mode
+    */
+    shared_mode_t mode;
+
+    /**
+    * @brief Blocks a view may transfer in a row while the other one waits
+    * @note  Indexed by @p shared_source_t, a larger firmware quantum favors
+    *        application throughput over the host.
+    */
+    uint32_t quantum[2];
+
+    /**
+    * @brief Cache buffer, holding @p cache_blocks blocks
+    */
+    uint8_t *cache_buffer;
+
+    /**
+    * @brief Cache slots
+    */
+    shared_slot_t *cache_slots;
+
+    /**
+    * @brief Number of cache slots, 0 to disable the cache
+    */
+    uint32_t cache_blocks;
+
+} SharedConfig;
+
+/**
+ * @brief @p SharedBlockView virtual methods table
+ */
+struct SharedBlockViewVMT {
+    _base_block_device_methods
+};
+
+/**
+ * @brief   Shared block device view structure.
+ * @details Block device through which one source accesses the shared device.
+ */
+typedef struct {
+    const struct SharedBlockViewVMT *vmt;
+    _base_block_device_data
+    void *owner;
+    shared_source_t source;
+    uint32_t requests;
+    uint32_t blocks;
+    systime_t wait_time;
+} SharedBlockView;
+
+/**
+ * @brief   Shared block device structure.
+ * @details This structure holds all the states and members of a shared block
+ *          device.
+ */
+typedef struct {
+    const SharedConfig *config;
+    Mutex mtx;
+    CondVar cond;
+    bool_t busy;
+    shared_source_t last;
+    uint32_t streak;
+    uint32_t waiting[2];
+    BlockDeviceInfo info;
+    uint32_t use_counter;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+    SharedBlockView host;
+    SharedBlockView firmware;
+} SharedBlockDevice;
+
+/**
+ * @brief   Returns the view to pass to the mass storage driver.
+ */
+#define sharedGetHostDevice(sdp) ((BaseBlockDevice *)&(sdp)->host)
+
+/**
+ * @brief   Returns the view to use from the application.
+ */
+#define sharedGetFirmwareDevice(sdp) ((BaseBlockDevice *)&(sdp)->firmware)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Initializes a shared block device.
+ */
+void sharedInit(SharedBlockDevice *sdp);
+
+/**
+ * @brief   Starts a shared block device.
+ * @details The underlying block device must be ready.
+ */
+void sharedStart(SharedBlockDevice *sdp, const SharedConfig *config);
+
+/**
+ * @brief   Stops a shared block device.
+ * @details Waits for the current request, both views are then stopped.
+ */
+void sharedStop(SharedBlockDevice *sdp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLK_SHARED_H_ */
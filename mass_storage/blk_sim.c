@@ -0,0 +1,238 @@
+#include "blk_sim.h"
+
+#include <string.h>
+
+/**
+ * @brief Returns the next number of the random generator (xorshift32)
+ */
+static uint32_t sim_random(SimBlockDevice *simp) {
+
+    uint32_t x = simp->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    simp->random = x;
+    return x;
+}
+
+/**
+ * @brief Returns a random duration up to @p max_us
+ */
+static uint32_t sim_jitter(SimBlockDevice *simp, uint32_t max_us) {
+
+    return (max_us > 0) ? sim_random(simp) % (max_us + 1) : 0;
+}
+
+/**
+ * @brief Draws the number of blocks written before the next stall
+ */
+static void sim_gc_reload(SimBlockDevice *simp) {
+
+    uint32_t interval = simp->config->gc_interval;
+
+    simp->gc_countdown = interval / 2 + sim_random(simp) % (interval + 1);
+    if (simp->gc_countdown == 0)
+        simp->gc_countdown = 1;
+}
+
+/**
+ * @brief Returns the modeled duration of a request, in microseconds
+ */
+static uint32_t sim_model(SimBlockDevice *simp, sim_op_t op, uint32_t startblk, uint32_t n) {
+
+    const SimBlockConfig *config = simp->config;
+    const sim_timing_t *timing = &config->timing[op];
+    uint64_t transfer = 0;
+    uint64_t us;
+
+    if (timing->bandwidth > 0) {
+        uint64_t block = (uint64_t)simp->info.blk_size * 1000000 / timing->bandwidth;
+
+        transfer = block + block * (n - 1) * timing->multi_block_percent / 100;
+    }
+
+    if ((op == SIM_OP_WRITE) && (config->au_blocks > 0) &&
+        ((startblk % config->au_blocks) == 0) && ((n % config->au_blocks) == 0)) {
+        transfer = transfer * config->au_percent / 100;
+        simp->stats.aligned_writes++;
+    }
+
+    us = timing->latency_us + sim_jitter(simp, timing->jitter_us) + transfer;
+
+    /* the media stalls once enough blocks have been written */
+    if ((op == SIM_OP_WRITE) && (config->gc_interval > 0)) {
+        if (n >= simp->gc_countdown) {
+            us += config->gc_stall_us + sim_jitter(simp, config->gc_jitter_us);
+            simp->stats.gc_stalls++;
+            sim_gc_reload(simp);
+        } else {
+            simp->gc_countdown -= n;
+        }
+    }
+
+    return (us > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)us;
+}
+
+/**
+ * @brief Waits for the modeled duration of a request
+ * @note  The fraction of system tick left is carried over to the next request.
+ */
+static void sim_delay(SimBlockDevice *simp, uint32_t us) {
+
+    uint64_t carry = simp->carry + (uint64_t)us * CH_FREQUENCY;
+    systime_t ticks = (systime_t)(carry / 1000000);
+
+    simp->carry = (uint32_t)(carry % 1000000);
+    simp->stats.busy_us += us;
+    if (us > simp->stats.max_us)
+        simp->stats.max_us = us;
+
+    if (ticks > 0)
+        chThdSleep(ticks);
+}
+
+/**
+ * @brief Transfers a request to the base device after its modeled duration
+ */
+static bool_t sim_transfer(SimBlockDevice *simp, sim_op_t op, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    bool_t result;
+
+    if ((n == 0) || (startblk >= simp->info.blk_num) || (n > simp->info.blk_num - startblk))
+        return CH_FAILED;
+
+    chMtxLock(&simp->mtx);
+
+    if (simp->state != BLK_READY) {
+        chMtxUnlock();
+        return CH_FAILED;
+    }
+
+    simp->stats.requests[op]++;
+    simp->stats.blocks[op] += n;
+    sim_delay(simp, sim_model(simp, op, startblk, n));
+
+    if (op == SIM_OP_READ)
+        result = blkRead(simp->config->base, startblk, buffer, n);
+    else
+        result = blkWrite(simp->config->base, startblk, buffer, n);
+
+    chMtxUnlock();
+    return result;
+}
+
+static bool_t sim_is_inserted(void *instance) {
+
+    SimBlockDevice *simp = (SimBlockDevice *)instance;
+    return blkIsInserted(simp->config->base);
+}
+
+static bool_t sim_is_protected(void *instance) {
+
+    SimBlockDevice *simp = (SimBlockDevice *)instance;
+    return blkIsWriteProtected(simp->config->base);
+}
+
+static bool_t sim_connect(void *instance) {
+
+    SimBlockDevice *simp = (SimBlockDevice *)instance;
+    return (simp->state == BLK_READY) ? CH_SUCCESS : CH_FAILED;
+}
+
+static bool_t sim_disconnect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t sim_read(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    return sim_transfer((SimBlockDevice *)instance, SIM_OP_READ, startblk, buffer, n);
+}
+
+static bool_t sim_write(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n) {
+
+    return sim_transfer((SimBlockDevice *)instance, SIM_OP_WRITE, startblk, (uint8_t *)buffer, n);
+}
+
+static bool_t sim_sync(void *instance) {
+
+    SimBlockDevice *simp = (SimBlockDevice *)instance;
+    return blkSync(simp->config->base);
+}
+
+static bool_t sim_get_info(void *instance, BlockDeviceInfo *bdip) {
+
+    SimBlockDevice *simp = (SimBlockDevice *)instance;
+
+    if (simp->state != BLK_READY)
+        return CH_FAILED;
+
+    *bdip = simp->info;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Virtual methods table
+ */
+static const struct SimBlockDeviceVMT sim_vmt = {
+    sim_is_inserted,
+    sim_is_protected,
+    sim_connect,
+    sim_disconnect,
+    sim_read,
+    sim_write,
+    sim_sync,
+    sim_get_info
+};
+
+/**
+ * @brief Initializes a simulated media block device
+ */
+void simInit(SimBlockDevice *simp) {
+
+    chDbgCheck(simp != NULL, "simInit");
+
+    simp->vmt = &sim_vmt;
+    simp->state = BLK_STOP;
+    simp->config = NULL;
+    chMtxInit(&simp->mtx);
+}
+
+/**
+ * @brief Starts a simulated media block device
+ */
+void simStart(SimBlockDevice *simp, const SimBlockConfig *config) {
+
+    chDbgCheck(simp != NULL, "simStart");
+    chDbgCheck(config != NULL, "simStart");
+    chDbgCheck(config->base != NULL, "simStart");
+    chDbgCheck(config->seed != 0, "simStart");
+    chDbgCheck(blkGetDriverState(config->base) == BLK_READY, "simStart");
+
+    simp->config = config;
+    blkGetInfo(config->base, &simp->info);
+
+    simp->random = config->seed;
+    simp->carry = 0;
+    simp->gc_countdown = 0;
+    memset(&simp->stats, 0, sizeof(simp->stats));
+    if (config->gc_interval > 0)
+        sim_gc_reload(simp);
+
+    simp->state = BLK_READY;
+}
+
+/**
+ * @brief Stops a simulated media block device
+ */
+void simStop(SimBlockDevice *simp) {
+
+    chDbgCheck(simp != NULL, "simStop");
+
+    /* wait for the current request */
+    chMtxLock(&simp->mtx);
+    simp->state = BLK_STOP;
+    chMtxUnlock();
+}
@@ -0,0 +1,165 @@
+/**
+ * @file    blk_sim.h
+ * @brief   Simulated media block device
+ * @details Stores the data on a base block device (e.g. a RAM disk) and
+ *          delays each request by the time a modeled media would take: fixed
+ *          latency, bandwidth, faster multi-block transfers, allocation unit
+ *          aligned writes and periodic garbage collection stalls. The random
+ *          parts of the model are drawn from a seeded generator so that runs
+ *          are reproducible.
+ */
+
+#ifndef _BLK_SIM_H_
+#define _BLK_SIM_H_
+
+#include "ch.h"
+#include "hal.h"
+
+/**
+ * @brief Simulated media operations
+ */
+typedef enum {
+    SIM_OP_READ = 0,
+    SIM_OP_WRITE = 1
+} sim_op_t;
+
+/**
+ * @brief Timing of an operation
+ */
+typedef struct {
+    /**
+    * @brief Fixed latency of a request, in microseconds
+    */
+    uint32_t latency_us;
+
+    /**
+    * @brief Maximum random latency added to a request, in microseconds
+    */
+    uint32_t jitter_us;
+
+    /**
+    * @brief Bandwidth in bytes per second, 0 for an instant transfer
+    */
+    uint32_t bandwidth;
+
+    /**
+    * @brief Transfer time of the blocks following the first one of a request,
+    *        in percent of the time of a single block
+    */
+    uint32_t multi_block_percent;
+
+} sim_timing_t;
+
+/**
+ * @brief Simulated media block device configuration structure
+ */
+typedef struct {
+    /**
+    * @brief Block device holding the data
+    */
+    BaseBlockDevice *base;
+
+    /**
+    * @brief Timings, indexed by @p sim_op_t
+    */
+    sim_timing_t timing[2];
+
+    /**
+    * @brief Allocation unit size in blocks, 0 to disable the alignment bonus
+    */
+    uint32_t au_blocks;
+
+    /**
+    * @brief Transfer time of the writes covering whole allocation units, in
+    *        percent of the normal time
+    */
+    uint32_t au_percent;
+
+    /**
+    * @brief Average number of written blocks between two garbage collection
+    *        stalls, 0 to disable the stalls
+    * @note  The actual interval is drawn between half and one and a half times
+    *        this value.
+    */
+    uint32_t gc_interval;
+
+    /**
+    * @brief Duration of a garbage collection stall, in microseconds
+    */
+    uint32_t gc_stall_us;
+
+    /**
+    * @brief Maximum random duration added to a stall, in microseconds
+    */
+    uint32_t gc_jitter_us;
+
+    /**
+    * @brief Seed of the random generator, must not be zero
+    */
+    uint32_t seed;
+
+} SimBlockConfig;
+
+/**
+ * @brief Simulated media statistics structure
+ */
+typedef struct {
+    uint32_t requests[2];
+    uint32_t blocks[2];
+    uint32_t aligned_writes;
+    uint32_t gc_stalls;
+    uint64_t busy_us;
+    uint32_t max_us;
+} sim_stats_t;
+
+/**
+ * @brief @p SimBlockDevice virtual methods table
+ */
+struct SimBlockDeviceVMT {
+    _base_block_device_methods
+};
+
+/**
+ * @brief   Simulated media block device structure.
+ * @details This structure holds all the states and members of a simulated
+ *          media block device.
+ */
+typedef struct {
+    const struct SimBlockDeviceVMT *vmt;
+    _base_block_device_data
+    const SimBlockConfig *config;
+    Mutex mtx;
+    BlockDeviceInfo info;
+    uint32_t random;
+    uint32_t gc_countdown;
+    uint32_t carry;
+    sim_stats_t stats;
+} SimBlockDevice;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Initializes a simulated media block device.
+ */
+void simInit(SimBlockDevice *simp);
+
+/**
+ * @brief   Starts a simulated media block device.
+ * @details The base block device must be ready. The random generator is
+ *          seeded and the statistics are cleared, so that each start replays
+ *          the same timings for the same requests.
+ */
+void simStart(SimBlockDevice *simp, const SimBlockConfig *config);
+
+/**
+ * @brief   Stops a simulated media block device.
+ */
+void simStop(SimBlockDevice *simp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLK_SIM_H_ */
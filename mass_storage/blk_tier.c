@@ -0,0 +1,504 @@
+#include "blk_tier.h"
+
+#include <string.h>
+
+/* Persisted map layout */
+#define TIER_MAP_MAGIC  0x52454954 /* "TIER" */
+#define TIER_MAP_HEADER 12
+#define TIER_MAP_ENTRY  5
+
+/**
+ * @brief Number of blocks of an extent, the last one may be truncated
+ */
+static inline uint32_t tier_extent_size(TierBlockDevice *tdp, uint32_t extent) {
+
+    uint32_t start = extent * tdp->config->extent_blocks;
+    uint32_t n = tdp->info.blk_num - start;
+    return (n < tdp->config->extent_blocks) ? n : tdp->config->extent_blocks;
+}
+
+/**
+ * @brief Returns the fast tier slot holding an extent, or -1
+ */
+static int32_t tier_lookup(TierBlockDevice *tdp, uint32_t extent) {
+
+    uint32_t i;
+
+    for (i = 0; i < tdp->config->slot_count; i++)
+        if (tdp->config->slots[i].extent == extent)
+            return (int32_t)i;
+
+    return -1;
+}
+
+/**
+ * @brief Reads blocks of a fast tier slot
+ */
+static bool_t tier_fast_read(TierBlockDevice *tdp, uint32_t slot, uint32_t offset, uint8_t *buffer, uint32_t n) {
+
+    const TierConfig *config = tdp->config;
+
+    if (config->fast != NULL)
+        return blkRead(config->fast, 1 + slot * config->extent_blocks + offset, buffer, n);
+
+    memcpy(buffer, config->fast_buffer + (slot * config->extent_blocks + offset) * tdp->info.blk_size,
+           n * tdp->info.blk_size);
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Writes blocks of a fast tier slot
+ */
+static bool_t tier_fast_write(TierBlockDevice *tdp, uint32_t slot, uint32_t offset, const uint8_t *buffer, uint32_t n) {
+
+    const TierConfig *config = tdp->config;
+
+    if (config->fast != NULL)
+        return blkWrite(config->fast, 1 + slot * config->extent_blocks + offset, buffer, n);
+
+    memcpy(config->fast_buffer + (slot * config->extent_blocks + offset) * tdp->info.blk_size, buffer,
+           n * tdp->info.blk_size);
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Writes a dirty slot back to the slow tier
+ */
+static bool_t tier_write_back(TierBlockDevice *tdp, uint32_t slot) {
+
+    const TierConfig *config = tdp->config;
+    tier_slot_t *sp = &config->slots[slot];
+    uint32_t start = sp->extent * config->extent_blocks;
+    uint32_t n = tier_extent_size(tdp, sp->extent);
+    uint32_t i;
+
+    if (!sp->dirty)
+        return CH_SUCCESS;
+
+    if (config->fast == NULL) {
+        if (blkWrite(config->slow, start, config->fast_buffer + slot * config->extent_blocks * tdp->info.blk_size, n) == CH_FAILED)
+            return CH_FAILED;
+    } else {
+        for (i = 0; i < n; i++) {
+            if (tier_fast_read(tdp, slot, i, tdp->scratch, 1) == CH_FAILED ||
+                blkWrite(config->slow, start + i, tdp->scratch, 1) == CH_FAILED)
+                return CH_FAILED;
+        }
+    }
+
+    sp->dirty = 0;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Loads an extent from the slow tier into a slot
+ */
+static bool_t tier_load(TierBlockDevice *tdp, uint32_t slot, uint32_t extent) {
+
+    const TierConfig *config = tdp->config;
+    uint32_t start = extent * config->extent_blocks;
+    uint32_t n = tier_extent_size(tdp, extent);
+    uint32_t i;
+
+    if (config->fast == NULL)
+        return blkRead(config->slow, start, config->fast_buffer + slot * config->extent_blocks * tdp->info.blk_size, n);
+
+    for (i = 0; i < n; i++) {
+        if (blkRead(config->slow, start + i, tdp->scratch, 1) == CH_FAILED ||
+            tier_fast_write(tdp, slot, i, tdp->scratch, 1) == CH_FAILED)
+            return CH_FAILED;
+    }
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Invalidates the persisted map before the fast tier diverges from it
+ */
+static bool_t tier_invalidate_map(TierBlockDevice *tdp) {
+
+    const TierConfig *config = tdp->config;
+
+    if (!tdp->map_valid)
+        return CH_SUCCESS;
+
+    memset(tdp->scratch, 0, tdp->info.blk_size);
+    if (blkWrite(config->fast, 0, tdp->scratch, 1) == CH_FAILED ||
+        blkSync(config->fast) == CH_FAILED)
+        return CH_FAILED;
+
+    tdp->map_valid = FALSE;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Counts an access to a non resident extent, promoting it if it is hot enough
+ *
+ * @return              The slot the extent has been promoted to, or -1.
+ */
+static int32_t tier_account(TierBlockDevice *tdp, uint32_t extent) {
+
+    const TierConfig *config = tdp->config;
+    uint16_t *heat = &config->heat[extent % config->heat_count];
+    uint32_t i;
+
+    if (*heat < 0xFFFF)
+        (*heat)++;
+
+    /* age all the counters so that the hot set can move */
+    if (++tdp->accesses >= config->decay_interval) {
+        tdp->accesses = 0;
+        for (i = 0; i < config->heat_count; i++)
+            config->heat[i] >>= 1;
+        for (i = 0; i < config->slot_count; i++)
+            config->slots[i].hits >>= 1;
+    }
+
+    if (*heat < config->promote_threshold)
+        return -1;
+
+    /* pick a free slot, or else the coldest resident extent */
+    uint32_t victim = 0;
+    for (i = 0; i < config->slot_count; i++) {
+        if (config->slots[i].extent == TIER_FREE) {
+            victim = i;
+            break;
+        }
+        if (config->slots[i].hits < config->slots[victim].hits)
+            victim = i;
+    }
+
+    tier_slot_t *sp = &config->slots[victim];
+    if ((sp->extent != TIER_FREE) && (sp->hits >= *heat))
+        return -1;
+
+    if (tier_invalidate_map(tdp) == CH_FAILED)
+        return -1;
+
+    if (sp->extent != TIER_FREE) {
+        /* demote */
+        if (tier_write_back(tdp, victim) == CH_FAILED)
+            return -1;
+        sp->extent = TIER_FREE;
+        tdp->demotions++;
+    }
+
+    if (tier_load(tdp, victim, extent) == CH_FAILED)
+        return -1;
+
+    sp->extent = extent;
+    sp->hits = *heat;
+    sp->dirty = 0;
+    *heat = 0;
+    tdp->promotions++;
+
+    return (int32_t)victim;
+}
+
+static bool_t tier_is_inserted(void *instance) {
+
+    TierBlockDevice *tdp = (TierBlockDevice *)instance;
+    return blkIsInserted(tdp->config->slow);
+}
+
+static bool_t tier_is_protected(void *instance) {
+
+    TierBlockDevice *tdp = (TierBlockDevice *)instance;
+    return blkIsWriteProtected(tdp->config->slow);
+}
+
+static bool_t tier_connect(void *instance) {
+
+    TierBlockDevice *tdp = (TierBlockDevice *)instance;
+    return (tdp->state == BLK_READY) ? CH_SUCCESS : CH_FAILED;
+}
+
+static bool_t tier_disconnect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t tier_read(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    TierBlockDevice *tdp = (TierBlockDevice *)instance;
+    const TierConfig *config = tdp->config;
+    bool_t result = CH_SUCCESS;
+
+    if (startblk + n > tdp->info.blk_num)
+        return CH_FAILED;
+
+    chMtxLock(&tdp->mtx);
+
+    while ((n > 0) && (result == CH_SUCCESS)) {
+        uint32_t extent = startblk / config->extent_blocks;
+        uint32_t offset = startblk % config->extent_blocks;
+        uint32_t count = config->extent_blocks - offset;
+        if (count > n)
+            count = n;
+
+        int32_t slot = tier_lookup(tdp, extent);
+        if (slot < 0)
+            slot = tier_account(tdp, extent);
+
+        if (slot >= 0) {
+            tier_slot_t *sp = &config->slots[slot];
+            if (sp->hits < 0xFFFF)
+                sp->hits++;
+            tdp->fast_hits++;
+            result = tier_fast_read(tdp, (uint32_t)slot, offset, buffer, count);
+        } else {
+            tdp->slow_accesses++;
+            result = blkRead(config->slow, startblk, buffer, count);
+        }
+
+        startblk += count;
+        buffer += count * tdp->info.blk_size;
+        n -= count;
+    }
+
+    chMtxUnlock();
+    return result;
+}
+
+static bool_t tier_write(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n) {
+
+    TierBlockDevice *tdp = (TierBlockDevice *)instance;
+    const TierConfig *config = tdp->config;
+    bool_t result = CH_SUCCESS;
+
+    if (startblk + n > tdp->info.blk_num)
+        return CH_FAILED;
+
+    chMtxLock(&tdp->mtx);
+
+    while ((n > 0) && (result == CH_SUCCESS)) {
+        uint32_t extent = startblk / config->extent_blocks;
+        uint32_t offset = startblk % config->extent_blocks;
+        uint32_t count = config->extent_blocks - offset;
+        if (count > n)
+            count = n;
+
+        int32_t slot = tier_lookup(tdp, extent);
+
+        if (slot >= 0) {
+            /* write-back, the slow tier is updated on demotion or sync */
+            tier_slot_t *sp = &config->slots[slot];
+            if (!sp->dirty && (tier_invalidate_map(tdp) == CH_FAILED)) {
+                result = CH_FAILED;
+                break;
+            }
+            if (sp->hits < 0xFFFF)
+                sp->hits++;
+            sp->dirty = 1;
+            tdp->fast_hits++;
+            result = tier_fast_write(tdp, (uint32_t)slot, offset, buffer, count);
+        } else {
+            /* write-through, the extent is loaded with the new data if promoted */
+            tdp->slow_accesses++;
+            result = blkWrite(config->slow, startblk, buffer, count);
+            if (result == CH_SUCCESS)
+                tier_account(tdp, extent);
+        }
+
+        startblk += count;
+        buffer += count * tdp->info.blk_size;
+        n -= count;
+    }
+
+    chMtxUnlock();
+    return result;
+}
+
+static bool_t tier_sync(void *instance) {
+
+    TierBlockDevice *tdp = (TierBlockDevice *)instance;
+
+    if (tierFlush(tdp) == CH_FAILED)
+        return CH_FAILED;
+    return blkSync(tdp->config->slow);
+}
+
+static bool_t tier_get_info(void *instance, BlockDeviceInfo *bdip) {
+
+    TierBlockDevice *tdp = (TierBlockDevice *)instance;
+
+    if (tdp->state != BLK_READY)
+        return CH_FAILED;
+
+    *bdip = tdp->info;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Virtual methods table
+ */
+static const struct TierBlockDeviceVMT tier_vmt = {
+    tier_is_inserted,
+    tier_is_protected,
+    tier_connect,
+    tier_disconnect,
+    tier_read,
+    tier_write,
+    tier_sync,
+    tier_get_info
+};
+
+/**
+ * @brief Restores the promotion map persisted in the fast tier
+ */
+static void tier_load_map(TierBlockDevice *tdp) {
+
+    const TierConfig *config = tdp->config;
+    const uint8_t *map = tdp->scratch;
+    uint32_t extents = (tdp->info.blk_num + config->extent_blocks - 1) / config->extent_blocks;
+    uint32_t i;
+
+    if ((config->fast == NULL) || (config->slot_count > TIER_MAP_MAX_SLOTS))
+        return;
+    if (blkRead(config->fast, 0, tdp->scratch, 1) == CH_FAILED)
+        return;
+
+    uint32_t magic, slot_count, extent_blocks;
+    memcpy(&magic, &map[0], 4);
+    memcpy(&slot_count, &map[4], 4);
+    memcpy(&extent_blocks, &map[8], 4);
+    if ((magic != TIER_MAP_MAGIC) || (slot_count != config->slot_count) ||
+        (extent_blocks != config->extent_blocks))
+        return;
+
+    for (i = 0; i < config->slot_count; i++) {
+        const uint8_t *entry = &map[TIER_MAP_HEADER + i * TIER_MAP_ENTRY];
+        uint32_t extent;
+
+        /* a map of another volume, start empty */
+        memcpy(&extent, entry, 4);
+        if ((extent != TIER_FREE) && (extent >= extents))
+            return;
+    }
+
+    for (i = 0; i < config->slot_count; i++) {
+        const uint8_t *entry = &map[TIER_MAP_HEADER + i * TIER_MAP_ENTRY];
+        memcpy(&config->slots[i].extent, entry, 4);
+        config->slots[i].dirty = entry[4];
+        config->slots[i].hits = config->promote_threshold;
+    }
+
+    tdp->map_valid = TRUE;
+}
+
+/**
+ * @brief Initializes a tiered block device
+ */
+void tierInit(TierBlockDevice *tdp) {
+
+    chDbgCheck(tdp != NULL, "tierInit");
+
+    tdp->vmt = &tier_vmt;
+    tdp->state = BLK_STOP;
+    tdp->config = NULL;
+    chMtxInit(&tdp->mtx);
+}
+
+/**
+ * @brief Starts a tiered block device
+ */
+void tierStart(TierBlockDevice *tdp, const TierConfig *config) {
+
+    uint32_t i;
+
+    chDbgCheck(tdp != NULL, "tierStart");
+    chDbgCheck(config != NULL, "tierStart");
+    chDbgCheck((config->fast != NULL) || (config->fast_buffer != NULL), "tierStart");
+    chDbgCheck((config->slot_count > 0) && (config->extent_blocks > 0), "tierStart");
+    chDbgCheck((config->heat_count > 0) && (config->decay_interval > 0), "tierStart");
+    chDbgCheck(blkGetDriverState(config->slow) == BLK_READY, "tierStart");
+
+    tdp->config = config;
+    blkGetInfo(config->slow, &tdp->info);
+    chDbgCheck(tdp->info.blk_size <= sizeof(tdp->scratch), "tierStart");
+
+    tdp->accesses = 0;
+    tdp->fast_hits = 0;
+    tdp->slow_accesses = 0;
+    tdp->promotions = 0;
+    tdp->demotions = 0;
+    tdp->map_valid = FALSE;
+
+    for (i = 0; i < config->heat_count; i++)
+        config->heat[i] = 0;
+    for (i = 0; i < config->slot_count; i++) {
+        config->slots[i].extent = TIER_FREE;
+        config->slots[i].hits = 0;
+        config->slots[i].dirty = 0;
+    }
+
+    tier_load_map(tdp);
+
+    tdp->state = BLK_READY;
+}
+
+/**
+ * @brief Stops a tiered block device
+ */
+void tierStop(TierBlockDevice *tdp) {
+
+    chDbgCheck(tdp != NULL, "tierStop");
+
+    tierFlush(tdp);
+    tierSaveMap(tdp);
+
+    chMtxLock(&tdp->mtx);
+    tdp->state = BLK_STOP;
+    chMtxUnlock();
+}
+
+/**
+ * @brief Writes the dirty extents back to the slow tier
+ */
+bool_t tierFlush(TierBlockDevice *tdp) {
+
+    bool_t result = CH_SUCCESS;
+    uint32_t i;
+
+    chMtxLock(&tdp->mtx);
+    for (i = 0; i < tdp->config->slot_count; i++)
+        if ((tdp->config->slots[i].extent != TIER_FREE) && (tier_write_back(tdp, i) == CH_FAILED))
+            result = CH_FAILED;
+    chMtxUnlock();
+
+    return result;
+}
+
+/**
+ * @brief Persists the promotion map to the fast tier block device
+ */
+bool_t tierSaveMap(TierBlockDevice *tdp) {
+
+    const TierConfig *config = tdp->config;
+    uint8_t *map = tdp->scratch;
+    uint32_t magic = TIER_MAP_MAGIC;
+    uint32_t i;
+
+    if ((config->fast == NULL) || (config->slot_count > TIER_MAP_MAX_SLOTS))
+        return CH_FAILED;
+
+    chMtxLock(&tdp->mtx);
+
+    memset(map, 0, tdp->info.blk_size);
+    memcpy(&map[0], &magic, 4);
+    memcpy(&map[4], &config->slot_count, 4);
+    memcpy(&map[8], &config->extent_blocks, 4);
+    for (i = 0; i < config->slot_count; i++) {
+        uint8_t *entry = &map[TIER_MAP_HEADER + i * TIER_MAP_ENTRY];
+        memcpy(entry, &config->slots[i].extent, 4);
+        entry[4] = config->slots[i].dirty;
+    }
+
+    bool_t result = blkWrite(config->fast, 0, map, 1);
+    if (result == CH_SUCCESS)
+        result = blkSync(config->fast);
+    tdp->map_valid = (result == CH_SUCCESS);
+
+    chMtxUnlock();
+    return result;
+}
@@ -0,0 +1,173 @@
+/**
+ * @file    blk_tier.h
+ * @brief   Tiered storage block device
+ * @details Keeps the most accessed extents of a slow block device (e.g. a SD
+ *          card) in a small fast tier (internal SRAM or flash). Extents are
+ *          promoted once their access count goes over a threshold, the
+ *          coldest resident extent being demoted to make room. Writes to
+ *          resident extents are written back to the slow tier on demotion
+ *          and on synchronization.
+ */
+
+#ifndef _BLK_TIER_H_
+#define _BLK_TIER_H_
+
+#include "ch.h"
+#include "hal.h"
+
+/**
+ * @brief Extent index of a free fast tier slot
+ */
+#define TIER_FREE 0xFFFFFFFF
+
+/**
+ * @brief Maximum number of slots whose map can be persisted in one block
+ */
+#define TIER_MAP_MAX_SLOTS 96
+
+/**
+ * @brief Fast tier slot structure
+ */
+typedef struct {
+    uint32_t extent;
+    uint16_t hits;
+    uint8_t dirty;
+} tier_slot_t;
+
+/**
+ * @brief Tiered block device configuration structure
+ */
+typedef struct {
+    /**
+    * @brief Slow tier block device
+    */
+    BaseBlockDevice *slow;
+
+    /**
+    * @brief Optional fast tier block device
+    * @note  Block 0 holds the persisted map, slot N is stored from block
+    *        1 + N * @p extent_blocks. When NULL, @p fast_buffer is used.
+    */
+    BaseBlockDevice *fast;
+
+    /**
+    * @brief RAM fast tier, holding @p slot_count extents
+    */
+    uint8_t *fast_buffer;
+
+    /**
+    * @brief Fast tier slots
+    */
+    tier_slot_t *slots;
+
+    /**
+    * @brief Number of fast tier slots
+    */
+    uint32_t slot_count;
+
+    /**
+    * @brief Size of an extent in blocks (promotion granularity)
+    */
+    uint32_t extent_blocks;
+
+    /**
+    * @brief Hashed extent access counters
+    * @note  Their number is independent of the volume size, unrelated extents
+    *        sharing a counter only makes promotion slightly eager.
+    */
+    uint16_t *heat;
+
+    /**
+    * @brief Number of access counters
+    */
+    uint32_t heat_count;
+
+    /**
+    * @brief Access count needed for an extent to be promoted
+    */
+    uint16_t promote_threshold;
+
+    /**
+    * @brief Number of accesses after which all the counters are halved
+    */
+    uint32_t decay_interval;
+
+} TierConfig;
+
+/**
+ * @brief @p TierBlockDevice virtual methods table
+ */
+struct TierBlockDeviceVMT {
+    _base_block_device_methods
+};
+
+/**
+ * @brief   Tiered block device structure.
+ * @details This structure holds all the states and members of a tiered block
+ *          device.
+ */
+typedef struct {
+    const struct TierBlockDeviceVMT *vmt;
+    _base_block_device_data
+    const TierConfig *config;
+    Mutex mtx;
+    BlockDeviceInfo info;
+    uint32_t accesses;
+    uint32_t fast_hits;
+    uint32_t slow_accesses;
+    uint32_t promotions;
+    uint32_t demotions;
+    bool_t map_valid;
+    uint8_t scratch[512];
+} TierBlockDevice;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Initializes a tiered block device.
+ */
+void tierInit(TierBlockDevice *tdp);
+
+/**
+ * @brief   Starts a tiered block device.
+ * @details The slow and fast block devices must be ready. If the fast tier is
+ *          a block device holding a valid map, the previously promoted
+ *          extents are restored.
+ * @note    The persisted map is invalidated before the first promotion,
+ *          demotion or write to a clean extent after it has been loaded or
+ *          saved. After an unclean power-off the fast tier starts empty, and
+ *          the writes not yet written back to the slow tier are lost.
+ */
+void tierStart(TierBlockDevice *tdp, const TierConfig *config);
+
+/**
+ * @brief   Stops a tiered block device.
+ * @details The dirty extents are written back and the map is persisted.
+ */
+void tierStop(TierBlockDevice *tdp);
+
+/**
+ * @brief   Writes the dirty extents back to the slow tier.
+ *
+ * @return              The operation status.
+ * @retval CH_SUCCESS   All the extents are clean.
+ * @retval CH_FAILED    At least one extent could not be written back.
+ */
+bool_t tierFlush(TierBlockDevice *tdp);
+
+/**
+ * @brief   Persists the promotion map to the fast tier block device.
+ *
+ * @return              The operation status.
+ * @retval CH_SUCCESS   The map has been saved.
+ * @retval CH_FAILED    The fast tier is in RAM or the write failed.
+ */
+bool_t tierSaveMap(TierBlockDevice *tdp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLK_TIER_H_ */
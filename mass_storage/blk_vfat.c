@@ -0,0 +1,516 @@
+#include "blk_vfat.h"
+
+#include <string.h>
+
+/* Volume layout */
+#define VFAT_RESERVED_SECTORS 1
+#define VFAT_FAT_COUNT        2
+#define VFAT_ROOT_SECTORS     ((VFAT_ROOT_ENTRIES * 32) / VFAT_BLOCK_SIZE)
+#define VFAT_ENTRIES_PER_FAT  (VFAT_BLOCK_SIZE / 2)
+#define VFAT_ENTRIES_PER_DIR  (VFAT_BLOCK_SIZE / 32)
+
+/* FAT16 cluster count limits */
+#define VFAT_MIN_CLUSTERS 4085
+#define VFAT_MAX_CLUSTERS 65524
+
+/* FAT16 special entries */
+#define VFAT_FAT_MEDIA 0xFFF8
+#define VFAT_FAT_EOC   0xFFFF
+
+/* Directory entry attributes */
+#define VFAT_ATTR_READ_ONLY 0x01
+#define VFAT_ATTR_VOLUME_ID 0x08
+#define VFAT_ATTR_DIRECTORY 0x10
+#define VFAT_ATTR_ARCHIVE   0x20
+#define VFAT_ATTR_LFN       0x0F
+
+/**
+ * @brief Stores a 16 bits little-endian value
+ */
+static inline void vfat_put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+/**
+ * @brief Stores a 32 bits little-endian value
+ */
+static inline void vfat_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/**
+ * @brief Loads a 16 bits little-endian value
+ */
+static inline uint16_t vfat_get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/**
+ * @brief Loads a 32 bits little-endian value
+ */
+static inline uint32_t vfat_get32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief Number of clusters used by a file
+ */
+static inline uint32_t vfat_file_clusters(VFatBlockDevice *vfatp, const VFatFile *file) {
+    return (file->size + vfatp->cluster_size - 1) / vfatp->cluster_size;
+}
+
+/**
+ * @brief Finds the file owning a cluster
+ *
+ * @param[out] first    first cluster of the file
+ * @return              The file, or NULL if the cluster is not allocated to
+ *                      a registered file.
+ */
+static const VFatFile *vfat_find_file(VFatBlockDevice *vfatp, uint32_t cluster, uint32_t *first) {
+
+    const VFatConfig *config = vfatp->config;
+    uint32_t start = 2;
+    uint32_t i;
+
+    for (i = 0; i < config->file_count; i++) {
+        uint32_t n = vfat_file_clusters(vfatp, &config->files[i]);
+        if (cluster >= start && cluster < start + n) {
+            *first = start;
+            return &config->files[i];
+        }
+        start += n;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Returns the metadata buffer slot holding a block, or NULL
+ */
+static uint8_t *vfat_find_meta(VFatBlockDevice *vfatp, uint32_t blk) {
+
+    uint32_t i;
+
+    for (i = 0; i < vfatp->meta_used; i++)
+        if (vfatp->config->meta_blocks[i] == blk)
+            return vfatp->config->meta_buffer + i * VFAT_BLOCK_SIZE;
+
+    return NULL;
+}
+
+/**
+ * @brief Generates the boot sector
+ */
+static void vfat_build_boot_sector(VFatBlockDevice *vfatp, uint8_t *buffer) {
+
+    const VFatConfig *config = vfatp->config;
+
+    buffer[0] = 0xEB;
+    buffer[1] = 0x3C;
+    buffer[2] = 0x90;
+    memcpy(&buffer[3], "MSWIN4.1", 8);
+    vfat_put16(&buffer[11], VFAT_BLOCK_SIZE);
+    buffer[13] = (uint8_t)vfatp->sectors_per_cluster;
+    vfat_put16(&buffer[14], VFAT_RESERVED_SECTORS);
+    buffer[16] = VFAT_FAT_COUNT;
+    vfat_put16(&buffer[17], VFAT_ROOT_ENTRIES);
+    vfat_put16(&buffer[19], (config->blk_num < 0x10000) ? (uint16_t)config->blk_num : 0);
+    buffer[21] = 0xF8;                              /* fixed media        */
+    vfat_put16(&buffer[22], (uint16_t)vfatp->fat_sectors);
+    vfat_put16(&buffer[24], 63);                    /* sectors per track  */
+    vfat_put16(&buffer[26], 255);                   /* number of heads    */
+    vfat_put32(&buffer[28], 0);                     /* hidden sectors     */
+    vfat_put32(&buffer[32], (config->blk_num < 0x10000) ? 0 : config->blk_num);
+    buffer[36] = 0x80;                              /* drive number       */
+    buffer[38] = 0x29;                              /* extended signature */
+    vfat_put32(&buffer[39], config->volume_serial);
+    memcpy(&buffer[43], config->volume_label, 11);
+    memcpy(&buffer[54], "FAT16   ", 8);
+    buffer[510] = 0x55;
+    buffer[511] = 0xAA;
+}
+
+/**
+ * @brief Generates a FAT sector
+ * @note  The registered files are contiguous, so each file is a single run
+ *        of chained clusters.
+ */
+static void vfat_build_fat_sector(VFatBlockDevice *vfatp, uint32_t sector, uint8_t *buffer) {
+
+    const VFatConfig *config = vfatp->config;
+    uint32_t e0 = sector * VFAT_ENTRIES_PER_FAT;
+    uint32_t e1 = e0 + VFAT_ENTRIES_PER_FAT;
+    uint32_t start = 2;
+    uint32_t i, c;
+
+    if (e0 == 0) {
+        vfat_put16(&buffer[0], VFAT_FAT_MEDIA);
+        vfat_put16(&buffer[2], VFAT_FAT_EOC);
+    }
+
+    for (i = 0; i < config->file_count && start < e1; i++) {
+        uint32_t n = vfat_file_clusters(vfatp, &config->files[i]);
+        uint32_t last = start + n - 1;
+
+        for (c = (start > e0) ? start : e0; n > 0 && c <= last && c < e1; c++)
+            vfat_put16(&buffer[(c - e0) * 2], (c == last) ? VFAT_FAT_EOC : (uint16_t)(c + 1));
+
+        start += n;
+    }
+}
+
+/**
+ * @brief Generates a root directory sector
+ */
+static void vfat_build_root_sector(VFatBlockDevice *vfatp, uint32_t sector, uint8_t *buffer) {
+
+    const VFatConfig *config = vfatp->config;
+    uint32_t e0 = sector * VFAT_ENTRIES_PER_DIR;
+    uint32_t start = 2;
+    uint32_t i;
+
+    /* the first entry is the volume label */
+    if (e0 == 0) {
+        memcpy(&buffer[0], config->volume_label, 11);
+        buffer[11] = VFAT_ATTR_VOLUME_ID;
+        vfat_put16(&buffer[22], config->time);
+        vfat_put16(&buffer[24], config->date);
+    }
+
+    for (i = 0; i < config->file_count; i++) {
+        const VFatFile *file = &config->files[i];
+        uint32_t n = vfat_file_clusters(vfatp, file);
+        uint32_t e = i + 1;
+
+        if (e >= e0 && e < e0 + VFAT_ENTRIES_PER_DIR) {
+            uint8_t *entry = &buffer[(e - e0) * 32];
+            memcpy(&entry[0], file->name, 11);
+            entry[11] = (file->write_cb != NULL) ? VFAT_ATTR_ARCHIVE : VFAT_ATTR_READ_ONLY;
+            vfat_put16(&entry[14], config->time);
+            vfat_put16(&entry[16], config->date);
+            vfat_put16(&entry[18], config->date);
+            vfat_put16(&entry[22], config->time);
+            vfat_put16(&entry[24], config->date);
+            vfat_put16(&entry[26], (n > 0) ? (uint16_t)start : 0);
+            vfat_put32(&entry[28], file->size);
+        }
+
+        start += n;
+    }
+}
+
+/**
+ * @brief Generates a data sector
+ */
+static bool_t vfat_read_data_sector(VFatBlockDevice *vfatp, uint32_t blk, uint8_t *buffer) {
+
+    uint32_t cluster = 2 + (blk - vfatp->data_start) / vfatp->sectors_per_cluster;
+    uint32_t first;
+    const VFatFile *file = vfat_find_file(vfatp, cluster, &first);
+
+    if (file == NULL)
+        return CH_SUCCESS;
+
+    uint32_t offset = (blk - vfatp->data_start - (first - 2) * vfatp->sectors_per_cluster) * VFAT_BLOCK_SIZE;
+
+    /* slack of the last cluster, past the end of the file */
+    if (offset >= file->size)
+        return CH_SUCCESS;
+
+    uint32_t len = file->size - offset;
+    if (len > VFAT_BLOCK_SIZE)
+        len = VFAT_BLOCK_SIZE;
+
+    if (file->data != NULL) {
+        memcpy(buffer, file->data + offset, len);
+        return CH_SUCCESS;
+    }
+    if (file->read_cb != NULL)
+        return file->read_cb(file->param, offset, buffer, len);
+
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Generates any block of the volume
+ */
+static bool_t vfat_read_block(VFatBlockDevice *vfatp, uint32_t blk, uint8_t *buffer) {
+
+    memset(buffer, 0, VFAT_BLOCK_SIZE);
+
+    if (blk >= vfatp->data_start)
+        return vfat_read_data_sector(vfatp, blk, buffer);
+
+    /* metadata overwritten by the host takes precedence */
+    uint8_t *meta = vfat_find_meta(vfatp, blk);
+    if (meta != NULL) {
+        memcpy(buffer, meta, VFAT_BLOCK_SIZE);
+        return CH_SUCCESS;
+    }
+
+    if (blk == 0)
+        vfat_build_boot_sector(vfatp, buffer);
+    else if (blk < vfatp->root_start)
+        vfat_build_fat_sector(vfatp, (blk - VFAT_RESERVED_SECTORS) % vfatp->fat_sectors, buffer);
+    else
+        vfat_build_root_sector(vfatp, blk - vfatp->root_start, buffer);
+
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Reports the root directory entries created or updated by the host
+ */
+static void vfat_parse_root_write(VFatBlockDevice *vfatp, uint32_t blk, const uint8_t *buffer) {
+
+    const VFatConfig *config = vfatp->config;
+    uint32_t e, i;
+
+    if (config->new_file_cb == NULL)
+        return;
+
+    /* previous content of the sector */
+    vfat_read_block(vfatp, blk, vfatp->scratch);
+
+    for (e = 0; e < VFAT_ENTRIES_PER_DIR; e++) {
+        const uint8_t *entry = &buffer[e * 32];
+
+        if (entry[0] == 0x00)
+            break;
+        if ((entry[0] == 0xE5) || (entry[11] == VFAT_ATTR_LFN) ||
+            (entry[11] & (VFAT_ATTR_VOLUME_ID | VFAT_ATTR_DIRECTORY)))
+            continue;
+        if (memcmp(entry, &vfatp->scratch[e * 32], 32) == 0)
+            continue;
+
+        /* skip the registered files */
+        for (i = 0; i < config->file_count; i++)
+            if (memcmp(entry, config->files[i].name, 11) == 0)
+                break;
+        if (i < config->file_count)
+            continue;
+
+        config->new_file_cb(config->param, entry, vfat_get16(&entry[26]), vfat_get32(&entry[28]));
+    }
+}
+
+/**
+ * @brief Stores a metadata block written by the host
+ */
+static bool_t vfat_write_meta(VFatBlockDevice *vfatp, uint32_t blk, const uint8_t *buffer) {
+
+    const VFatConfig *config = vfatp->config;
+    uint8_t *meta = vfat_find_meta(vfatp, blk);
+
+    if (blk >= vfatp->root_start)
+        vfat_parse_root_write(vfatp, blk, buffer);
+
+    if (meta == NULL) {
+        if (vfatp->meta_used >= config->meta_count)
+            return CH_FAILED;
+        config->meta_blocks[vfatp->meta_used] = blk;
+        meta = config->meta_buffer + vfatp->meta_used * VFAT_BLOCK_SIZE;
+        vfatp->meta_used++;
+    }
+
+    memcpy(meta, buffer, VFAT_BLOCK_SIZE);
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Forwards a data block written by the host to the owner callback
+ */
+static bool_t vfat_write_data(VFatBlockDevice *vfatp, uint32_t blk, const uint8_t *buffer) {
+
+    const VFatConfig *config = vfatp->config;
+    uint32_t cluster = 2 + (blk - vfatp->data_start) / vfatp->sectors_per_cluster;
+    uint32_t first;
+    const VFatFile *file = vfat_find_file(vfatp, cluster, &first);
+
+    if (file != NULL) {
+        uint32_t offset = (blk - vfatp->data_start - (first - 2) * vfatp->sectors_per_cluster) * VFAT_BLOCK_SIZE;
+
+        /* slack of the last cluster, past the end of the file */
+        if (offset >= file->size)
+            return CH_SUCCESS;
+
+        if (file->write_cb == NULL)
+            return CH_FAILED;
+
+        uint32_t len = file->size - offset;
+        if (len > VFAT_BLOCK_SIZE)
+            len = VFAT_BLOCK_SIZE;
+        return file->write_cb(file->param, offset, buffer, len);
+    }
+
+    if (config->stream_write_cb == NULL)
+        return CH_FAILED;
+
+    return config->stream_write_cb(config->param, (blk - vfatp->data_start) * VFAT_BLOCK_SIZE,
+                                   buffer, VFAT_BLOCK_SIZE);
+}
+
+static bool_t vfat_is_inserted(void *instance) {
+
+    (void)instance;
+    return TRUE;
+}
+
+static bool_t vfat_is_protected(void *instance) {
+
+    (void)instance;
+    return FALSE;
+}
+
+static bool_t vfat_connect(void *instance) {
+
+    VFatBlockDevice *vfatp = (VFatBlockDevice *)instance;
+    return (vfatp->state == BLK_READY) ? CH_SUCCESS : CH_FAILED;
+}
+
+static bool_t vfat_disconnect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t vfat_read(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    VFatBlockDevice *vfatp = (VFatBlockDevice *)instance;
+    bool_t result = CH_SUCCESS;
+
+    if (startblk + n > vfatp->config->blk_num)
+        return CH_FAILED;
+
+    chMtxLock(&vfatp->mtx);
+    for (; n > 0 && result == CH_SUCCESS; n--, startblk++, buffer += VFAT_BLOCK_SIZE)
+        result = vfat_read_block(vfatp, startblk, buffer);
+    chMtxUnlock();
+
+    return result;
+}
+
+static bool_t vfat_write(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n) {
+
+    VFatBlockDevice *vfatp = (VFatBlockDevice *)instance;
+    bool_t result = CH_SUCCESS;
+
+    if (startblk + n > vfatp->config->blk_num)
+        return CH_FAILED;
+
+    chMtxLock(&vfatp->mtx);
+    for (; n > 0 && result == CH_SUCCESS; n--, startblk++, buffer += VFAT_BLOCK_SIZE) {
+        if (startblk >= vfatp->data_start)
+            result = vfat_write_data(vfatp, startblk, buffer);
+        else
+            result = vfat_write_meta(vfatp, startblk, buffer);
+    }
+    chMtxUnlock();
+
+    return result;
+}
+
+static bool_t vfat_sync(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t vfat_get_info(void *instance, BlockDeviceInfo *bdip) {
+
+    VFatBlockDevice *vfatp = (VFatBlockDevice *)instance;
+
+    if (vfatp->state != BLK_READY)
+        return CH_FAILED;
+
+    bdip->blk_size = VFAT_BLOCK_SIZE;
+    bdip->blk_num = vfatp->config->blk_num;
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Virtual methods table
+ */
+static const struct VFatBlockDeviceVMT vfat_vmt = {
+    vfat_is_inserted,
+    vfat_is_protected,
+    vfat_connect,
+    vfat_disconnect,
+    vfat_read,
+    vfat_write,
+    vfat_sync,
+    vfat_get_info
+};
+
+/**
+ * @brief Initializes a virtual FAT block device
+ */
+void vfatInit(VFatBlockDevice *vfatp) {
+
+    chDbgCheck(vfatp != NULL, "vfatInit");
+
+    vfatp->vmt = &vfat_vmt;
+    vfatp->state = BLK_STOP;
+    vfatp->config = NULL;
+    vfatp->meta_used = 0;
+    chMtxInit(&vfatp->mtx);
+}
+
+/**
+ * @brief Starts a virtual FAT block device
+ */
+void vfatStart(VFatBlockDevice *vfatp, const VFatConfig *config) {
+
+    chDbgCheck(vfatp != NULL, "vfatStart");
+    chDbgCheck(config != NULL, "vfatStart");
+    chDbgCheck((config->meta_count == 0) ||
+               ((config->meta_buffer != NULL) && (config->meta_blocks != NULL)), "vfatStart");
+
+    vfatp->config = config;
+    vfatp->meta_used = 0;
+
+    /* smallest cluster size keeping the cluster count within FAT16 limits */
+    vfatp->sectors_per_cluster = 1;
+    while ((vfatp->sectors_per_cluster < 128) &&
+           (config->blk_num / vfatp->sectors_per_cluster > VFAT_MAX_CLUSTERS))
+        vfatp->sectors_per_cluster <<= 1;
+    vfatp->cluster_size = vfatp->sectors_per_cluster * VFAT_BLOCK_SIZE;
+
+    /* size the FATs for an upper bound of the cluster count */
+    uint32_t max_clusters = (config->blk_num - VFAT_RESERVED_SECTORS - VFAT_ROOT_SECTORS) / vfatp->sectors_per_cluster;
+    vfatp->fat_sectors = ((max_clusters + 2) * 2 + VFAT_BLOCK_SIZE - 1) / VFAT_BLOCK_SIZE;
+    vfatp->root_start = VFAT_RESERVED_SECTORS + VFAT_FAT_COUNT * vfatp->fat_sectors;
+    vfatp->data_start = vfatp->root_start + VFAT_ROOT_SECTORS;
+    vfatp->cluster_count = (config->blk_num - vfatp->data_start) / vfatp->sectors_per_cluster;
+
+    chDbgCheck((vfatp->cluster_count >= VFAT_MIN_CLUSTERS) &&
+               (vfatp->cluster_count <= VFAT_MAX_CLUSTERS), "vfatStart");
+    chDbgCheck(config->file_count < VFAT_ROOT_ENTRIES, "vfatStart");
+
+    /* lay the files out from the first cluster */
+    uint32_t i;
+    vfatp->first_free_cluster = 2;
+    for (i = 0; i < config->file_count; i++)
+        vfatp->first_free_cluster += vfat_file_clusters(vfatp, &config->files[i]);
+
+    chDbgCheck(vfatp->first_free_cluster - 2 <= vfatp->cluster_count, "vfatStart");
+
+    vfatp->state = BLK_READY;
+}
+
+/**
+ * @brief Stops a virtual FAT block device
+ */
+void vfatStop(VFatBlockDevice *vfatp) {
+
+    chDbgCheck(vfatp != NULL, "vfatStop");
+
+    chMtxLock(&vfatp->mtx);
+    vfatp->state = BLK_STOP;
+    vfatp->meta_used = 0;
+    chMtxUnlock();
+}
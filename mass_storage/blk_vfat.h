@@ -0,0 +1,188 @@
+/**
+ * @file    blk_vfat.h
+ * @brief   Virtual FAT16 block device
+ * @details Exposes a FAT16 volume whose boot sector, FATs, root directory and
+ *          file data are generated on the fly from a registry of application
+ *          files. No volume image is stored, RAM usage only depends on the
+ *          configured metadata buffer.
+ */
+
+#ifndef _BLK_VFAT_H_
+#define _BLK_VFAT_H_
+
+#include "ch.h"
+#include "hal.h"
+
+/**
+ * @brief Block size of the virtual volume
+ */
+#define VFAT_BLOCK_SIZE 512
+
+/**
+ * @brief Number of root directory entries
+ */
+#define VFAT_ROOT_ENTRIES 512
+
+/**
+ * @brief Structure describing a file exported on the virtual volume
+ */
+typedef struct {
+    /**
+    * @brief 8.3 file name, space padded and without the dot (e.g. "FIRMWAREBIN")
+    */
+    uint8_t name[11];
+
+    /**
+    * @brief Size of the file in bytes
+    */
+    uint32_t size;
+
+    /**
+    * @brief Pointer to the file content, or NULL to use @p read_cb
+    */
+    const uint8_t *data;
+
+    /**
+    * @brief Optional callback reading @p len bytes at @p offset of the file
+    */
+    bool_t (*read_cb)(void *param, uint32_t offset, uint8_t *buffer, uint32_t len);
+
+    /**
+    * @brief Optional callback receiving host writes to the file content
+    * @note  The file is exported read-only when NULL.
+    */
+    bool_t (*write_cb)(void *param, uint32_t offset, const uint8_t *buffer, uint32_t len);
+
+    /**
+    * @brief Parameter passed to the callbacks
+    */
+    void *param;
+
+} VFatFile;
+
+/**
+ * @brief Virtual FAT block device configuration structure
+ */
+typedef struct {
+    /**
+    * @brief Registry of exported files
+    */
+    const VFatFile *files;
+
+    /**
+    * @brief Number of exported files
+    */
+    uint32_t file_count;
+
+    /**
+    * @brief Volume size in blocks (at least 4200 blocks, so that FAT16 is used)
+    */
+    uint32_t blk_num;
+
+    /**
+    * @brief Volume label, space padded
+    */
+    uint8_t volume_label[11];
+
+    /**
+    * @brief Volume serial number
+    */
+    uint32_t volume_serial;
+
+    /**
+    * @brief Date and time of the files, in FAT format
+    */
+    uint16_t date, time;
+
+    /**
+    * @brief Buffer holding the FAT and root directory blocks written by the host
+    * @note  Must hold @p meta_count blocks, host metadata writes fail once it
+    *        is full.
+    */
+    uint8_t *meta_buffer;
+
+    /**
+    * @brief Block addresses of the buffered metadata blocks
+    */
+    uint32_t *meta_blocks;
+
+    /**
+    * @brief Number of metadata blocks that can be buffered
+    */
+    uint32_t meta_count;
+
+    /**
+    * @brief Optional callback called whenever the host creates or updates a
+    *        root directory entry that is not part of the registry
+    */
+    void (*new_file_cb)(void *param, const uint8_t name[11], uint32_t first_cluster, uint32_t size);
+
+    /**
+    * @brief Optional callback receiving the host writes to unallocated clusters
+    * @note  @p offset is relative to the data area start, cluster N begins at
+    *        offset (N - 2) * @p VFatBlockDevice.cluster_size.
+    */
+    bool_t (*stream_write_cb)(void *param, uint32_t offset, const uint8_t *buffer, uint32_t len);
+
+    /**
+    * @brief Parameter passed to the volume callbacks
+    */
+    void *param;
+
+} VFatConfig;
+
+/**
+ * @brief @p VFatBlockDevice virtual methods table
+ */
+struct VFatBlockDeviceVMT {
+    _base_block_device_methods
+};
+
+/**
+ * @brief   Virtual FAT block device structure.
+ * @details This structure holds all the states and members of a virtual FAT
+ *          block device.
+ */
+typedef struct {
+    const struct VFatBlockDeviceVMT *vmt;
+    _base_block_device_data
+    const VFatConfig *config;
+    Mutex mtx;
+    uint32_t sectors_per_cluster;
+    uint32_t cluster_size;
+    uint32_t fat_sectors;
+    uint32_t root_start;
+    uint32_t data_start;
+    uint32_t cluster_count;
+    uint32_t first_free_cluster;
+    uint32_t meta_used;
+    uint8_t scratch[VFAT_BLOCK_SIZE];
+} VFatBlockDevice;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Initializes a virtual FAT block device.
+ */
+void vfatInit(VFatBlockDevice *vfatp);
+
+/**
+ * @brief   Starts a virtual FAT block device.
+ * @details Computes the volume geometry and lays the registered files out
+ *          contiguously from the first cluster.
+ */
+void vfatStart(VFatBlockDevice *vfatp, const VFatConfig *config);
+
+/**
+ * @brief   Stops a virtual FAT block device.
+ * @details The metadata written by the host is dropped.
+ */
+void vfatStop(VFatBlockDevice *vfatp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLK_VFAT_H_ */
@@ -0,0 +1,45 @@
+/**
+ * @file    templates/usbmsdconf.h
+ * @brief   USB mass storage driver configuration header.
+ * @details Copy this file into the application and define the settings to
+ *          change, any setting left undefined takes the default value
+ *          documented in usb_msd.h.
+ */
+
+#ifndef _USBMSDCONF_H_
+#define _USBMSDCONF_H_
+
+/*
+ * Media and transfers:
+ *   USB_MSD_BLOCK_SIZE, USB_MSD_MAX_BLOCK_SIZE, USB_MSD_BUFFER_BLOCKS,
+ *   USB_MSD_ATTACH_POLL_INTERVAL
+ *
+ * Optional SCSI commands and INQUIRY pages:
+ *   USB_MSD_USE_CMD_MODE_SENSE_6, USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES,
+ *   USB_MSD_USE_CMD_SEND_DIAGNOSTIC, USB_MSD_USE_CMD_START_STOP_UNIT,
+ *   USB_MSD_USE_CMD_SYNCHRONIZE_CACHE_10, USB_MSD_USE_CMD_LOG_SENSE,
+ *   USB_MSD_USE_VPD
+ *
+ * Threads:
+ *   USB_MSD_THREAD_WA_SIZE, USB_MSD_USE_SERVICE_THREAD, USB_MSD_MAX_INSTANCES,
+ *   USB_MSD_SERVICE_THREAD_WA_SIZE, USB_MSD_SERVICE_THREAD_PRIO
+ *
+ * Statistics, profiling and trace:
+ *   USB_MSD_STATS_LEVEL, USB_MSD_LATENCY_BUCKETS, USB_MSD_USE_PROFILER,
+ *   USB_MSD_PROFILER_BUCKETS, USB_MSD_PROFILER_SIZE_BUCKETS,
+ *   USB_MSD_PROFILER_ALIGNMENTS, USB_MSD_USE_CYCLE_PROFILE,
+ *   USB_MSD_CYCLE_OPCODES, USB_MSD_TRACE_LEVEL, USB_MSD_TRACE_RECORDS
+ *
+ * Other features:
+ *   USB_MSD_USE_QOS, USB_MSD_QOS_BURST, USB_MSD_QOS_MAX_DEFER,
+ *   USB_MSD_USE_WATCHDOG, USB_MSD_MEDIA_THREAD_WA_SIZE,
+ *   USB_MSD_USE_METADATA_CACHE, USB_MSD_METADATA_CACHE_BLOCKS,
+ *   USB_MSD_METADATA_FLUSH_DELAY, USB_MSD_USE_WARMUP, USB_MSD_WARMUP_FAT_BLOCKS
+ */
+
+/* e.g. a fixed block size and larger transfers:
+#define USB_MSD_BLOCK_SIZE                      512
+#define USB_MSD_BUFFER_BLOCKS                   8
+*/
+
+#endif /* _USBMSDCONF_H_ */
@@ -0,0 +1,116 @@
+/**
+ * @file    test/host/ch.h
+ * @brief   Host build of the ChibiOS/RT kernel API used by the driver
+ * @details Single threaded: the threads are never run, the test harness
+ *          steps the driver itself, and waiting never blocks.
+ */
+
+#ifndef _CH_H_
+#define _CH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int bool_t;
+typedef int32_t msg_t;
+typedef uint32_t systime_t;
+typedef uint32_t tprio_t;
+typedef uint32_t eventmask_t;
+typedef uint64_t stkalign_t;
+
+#define TRUE 1
+#define FALSE 0
+#define CH_SUCCESS FALSE
+#define CH_FAILED TRUE
+
+#define RDY_OK 0
+#define RDY_TIMEOUT -1
+#define RDY_RESET -2
+
+#define TIME_IMMEDIATE ((systime_t)0)
+#define TIME_INFINITE ((systime_t)-1)
+#define CH_FREQUENCY 1000
+#define MS2ST(msec) ((systime_t)(msec))
+#define S2ST(sec) ((systime_t)((sec) * 1000))
+
+#define NORMALPRIO 64
+#define LOWPRIO 2
+#define HIGHPRIO 127
+
+#define EVENT_MASK(eid) ((eventmask_t)(1 << (eid)))
+#define ALL_EVENTS ((eventmask_t)-1)
+
+#define PACK_STRUCT_BEGIN
+#define PACK_STRUCT_STRUCT __attribute__((packed))
+#define PACK_STRUCT_END
+
+#define THD_WA_SIZE(n) ((n) + 256)
+#define WORKING_AREA(s, n) stkalign_t s[THD_WA_SIZE(n) / sizeof(stkalign_t)]
+
+void chDbgPanic(const char *msg);
+#define chDbgCheck(c, func) do { if (!(c)) chDbgPanic(func); } while (0)
+#define chDbgAssert(c, msg, remark) do { if (!(c)) chDbgPanic(msg); } while (0)
+
+typedef msg_t (*tfunc_t)(void *);
+
+typedef struct {
+    bool_t terminate;
+    bool_t terminated;
+    eventmask_t events;
+} Thread;
+
+#define chThdTerminated(tp) ((tp)->terminated)
+
+typedef struct {
+    bool_t taken;
+} BinarySemaphore;
+
+typedef struct {
+    int locked;
+} Mutex;
+
+#define MUTEX_DECL(name) Mutex name = {0}
+
+typedef struct {
+    int listeners;
+} EventSource;
+
+void chSysLock(void);
+void chSysUnlock(void);
+void chSysLockFromIsr(void);
+void chSysUnlockFromIsr(void);
+void chSchRescheduleS(void);
+
+void chBSemInit(BinarySemaphore *bsp, bool_t taken);
+msg_t chBSemWait(BinarySemaphore *bsp);
+msg_t chBSemWaitTimeoutS(BinarySemaphore *bsp, systime_t time);
+void chBSemSignal(BinarySemaphore *bsp);
+void chBSemSignalI(BinarySemaphore *bsp);
+void chBSemResetI(BinarySemaphore *bsp, bool_t taken);
+bool_t chBSemGetStateI(BinarySemaphore *bsp);
+
+void chMtxInit(Mutex *mp);
+void chMtxLock(Mutex *mp);
+bool_t chMtxTryLock(Mutex *mp);
+Mutex *chMtxUnlock(void);
+
+void chEvtInit(EventSource *esp);
+void chEvtBroadcast(EventSource *esp);
+void chEvtBroadcastI(EventSource *esp);
+void chEvtSignal(Thread *tp, eventmask_t mask);
+void chEvtSignalI(Thread *tp, eventmask_t mask);
+eventmask_t chEvtWaitAnyTimeout(eventmask_t mask, systime_t time);
+eventmask_t chEvtGetAndClearEvents(eventmask_t mask);
+
+Thread *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg);
+Thread *chThdSelf(void);
+void chThdTerminate(Thread *tp);
+bool_t chThdShouldTerminate(void);
+msg_t chThdWait(Thread *tp);
+void chThdSleep(systime_t time);
+void chThdYield(void);
+void chRegSetThreadName(const char *name);
+
+systime_t chTimeNow(void);
+
+#endif /* _CH_H_ */
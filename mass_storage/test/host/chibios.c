@@ -0,0 +1,363 @@
+#include "hal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*===========================================================================*/
+/* Kernel.                                                                   */
+/*===========================================================================*/
+
+/**
+ * @brief Returns the monotonic clock in nanoseconds
+ */
+static uint64_t host_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void chDbgPanic(const char *msg) {
+
+    fprintf(stderr, "panic: %s\n", msg);
+    abort();
+}
+
+void chSysLock(void) {
+}
+
+void chSysUnlock(void) {
+}
+
+void chSysLockFromIsr(void) {
+}
+
+void chSysUnlockFromIsr(void) {
+}
+
+void chSchRescheduleS(void) {
+}
+
+void chBSemInit(BinarySemaphore *bsp, bool_t taken) {
+
+    bsp->taken = taken;
+}
+
+msg_t chBSemWait(BinarySemaphore *bsp) {
+
+    bsp->taken = TRUE;
+    return RDY_OK;
+}
+
+msg_t chBSemWaitTimeoutS(BinarySemaphore *bsp, systime_t time) {
+
+    (void)time;
+
+    if (bsp->taken)
+        return RDY_TIMEOUT;
+
+    bsp->taken = TRUE;
+    return RDY_OK;
+}
+
+void chBSemSignal(BinarySemaphore *bsp) {
+
+    bsp->taken = FALSE;
+}
+
+void chBSemSignalI(BinarySemaphore *bsp) {
+
+    bsp->taken = FALSE;
+}
+
+void chBSemResetI(BinarySemaphore *bsp, bool_t taken) {
+
+    bsp->taken = taken;
+}
+
+bool_t chBSemGetStateI(BinarySemaphore *bsp) {
+
+    return bsp->taken;
+}
+
+void chMtxInit(Mutex *mp) {
+
+    mp->locked = 0;
+}
+
+void chMtxLock(Mutex *mp) {
+
+    mp->locked++;
+}
+
+bool_t chMtxTryLock(Mutex *mp) {
+
+    mp->locked++;
+    return TRUE;
+}
+
+Mutex *chMtxUnlock(void) {
+
+    return NULL;
+}
+
+void chEvtInit(EventSource *esp) {
+
+    esp->listeners = 0;
+}
+
+void chEvtBroadcast(EventSource *esp) {
+
+    (void)esp;
+}
+
+void chEvtBroadcastI(EventSource *esp) {
+
+    (void)esp;
+}
+
+void chEvtSignal(Thread *tp, eventmask_t mask) {
+
+    tp->events |= mask;
+}
+
+void chEvtSignalI(Thread *tp, eventmask_t mask) {
+
+    tp->events |= mask;
+}
+
+eventmask_t chEvtWaitAnyTimeout(eventmask_t mask, systime_t time) {
+
+    (void)mask;
+    (void)time;
+    return 0;
+}
+
+eventmask_t chEvtGetAndClearEvents(eventmask_t mask) {
+
+    Thread *tp = chThdSelf();
+    eventmask_t events = tp->events & mask;
+
+    tp->events &= ~mask;
+    return events;
+}
+
+/**
+ * @brief The threads are created but never run
+ */
+static Thread host_threads[4];
+static uint32_t host_thread_count;
+
+Thread *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg) {
+
+    (void)wsp;
+    (void)size;
+    (void)prio;
+    (void)pf;
+    (void)arg;
+
+    chDbgCheck(host_thread_count < sizeof(host_threads) / sizeof(host_threads[0]), "chThdCreateStatic");
+    return &host_threads[host_thread_count++];
+}
+
+Thread *chThdSelf(void) {
+
+    return &host_threads[0];
+}
+
+void chThdTerminate(Thread *tp) {
+
+    tp->terminate = TRUE;
+}
+
+bool_t chThdShouldTerminate(void) {
+
+    return FALSE;
+}
+
+msg_t chThdWait(Thread *tp) {
+
+    tp->terminated = TRUE;
+    return 0;
+}
+
+void chThdSleep(systime_t time) {
+
+    (void)time;
+}
+
+void chThdYield(void) {
+}
+
+void chRegSetThreadName(const char *name) {
+
+    (void)name;
+}
+
+systime_t chTimeNow(void) {
+
+    return (systime_t)(host_ns() / (1000000000 / CH_FREQUENCY));
+}
+
+halrtcnt_t halGetCounterValue(void) {
+
+    return (halrtcnt_t)(host_ns() / 1000);
+}
+
+halrtcnt_t halGetCounterFrequency(void) {
+
+    return 1000000;
+}
+
+/*===========================================================================*/
+/* RAM disk.                                                                 */
+/*===========================================================================*/
+
+static bool_t ramdisk_is_inserted(void *instance) {
+
+    (void)instance;
+    return TRUE;
+}
+
+static bool_t ramdisk_is_protected(void *instance) {
+
+    (void)instance;
+    return FALSE;
+}
+
+static bool_t ramdisk_connect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t ramdisk_disconnect(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t ramdisk_read(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n) {
+
+    RamDisk *rdp = (RamDisk *)instance;
+
+    if ((startblk >= rdp->info.blk_num) || (n > rdp->info.blk_num - startblk))
+        return CH_FAILED;
+
+    memcpy(buffer, rdp->data + startblk * rdp->info.blk_size, n * rdp->info.blk_size);
+    rdp->reads++;
+    return CH_SUCCESS;
+}
+
+static bool_t ramdisk_write(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n) {
+
+    RamDisk *rdp = (RamDisk *)instance;
+
+    if ((startblk >= rdp->info.blk_num) || (n > rdp->info.blk_num - startblk))
+        return CH_FAILED;
+
+    memcpy(rdp->data + startblk * rdp->info.blk_size, buffer, n * rdp->info.blk_size);
+    rdp->writes++;
+    return CH_SUCCESS;
+}
+
+static bool_t ramdisk_sync(void *instance) {
+
+    (void)instance;
+    return CH_SUCCESS;
+}
+
+static bool_t ramdisk_get_info(void *instance, BlockDeviceInfo *bdip) {
+
+    *bdip = ((RamDisk *)instance)->info;
+    return CH_SUCCESS;
+}
+
+static const struct BaseBlockDeviceVMT ramdisk_vmt = {
+    ramdisk_is_inserted,
+    ramdisk_is_protected,
+    ramdisk_connect,
+    ramdisk_disconnect,
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_sync,
+    ramdisk_get_info
+};
+
+void ramdiskStart(RamDisk *rdp, uint8_t *data, uint32_t blk_size, uint32_t blk_num) {
+
+    rdp->vmt = &ramdisk_vmt;
+    rdp->state = BLK_READY;
+    rdp->data = data;
+    rdp->info.blk_size = blk_size;
+    rdp->info.blk_num = blk_num;
+    rdp->reads = 0;
+    rdp->writes = 0;
+}
+
+/*===========================================================================*/
+/* USB driver.                                                               */
+/*===========================================================================*/
+
+void usbInitEndpointI(USBDriver *usbp, usbep_t ep, const USBEndpointConfig *epcp) {
+
+    usbp->epc[ep] = epcp;
+    usbp->in[ep].pending = FALSE;
+    usbp->out[ep].pending = FALSE;
+    usbp->in_stalled[ep] = FALSE;
+    usbp->out_stalled[ep] = FALSE;
+}
+
+void usbPrepareTransmit(USBDriver *usbp, usbep_t ep, const uint8_t *buf, size_t n) {
+
+    usbp->in[ep].buffer = (uint8_t *)buf;
+    usbp->in[ep].size = n;
+}
+
+void usbPrepareReceive(USBDriver *usbp, usbep_t ep, uint8_t *buf, size_t n) {
+
+    usbp->out[ep].buffer = buf;
+    usbp->out[ep].size = n;
+}
+
+bool_t usbStartTransmitI(USBDriver *usbp, usbep_t ep) {
+
+    chDbgCheck(!usbp->in[ep].pending, "usbStartTransmitI");
+    usbp->in[ep].pending = TRUE;
+    return FALSE;
+}
+
+bool_t usbStartReceiveI(USBDriver *usbp, usbep_t ep) {
+
+    chDbgCheck(!usbp->out[ep].pending, "usbStartReceiveI");
+    usbp->out[ep].pending = TRUE;
+    return FALSE;
+}
+
+bool_t usbStallTransmitI(USBDriver *usbp, usbep_t ep) {
+
+    usbp->in_stalled[ep] = TRUE;
+    return FALSE;
+}
+
+bool_t usbStallReceiveI(USBDriver *usbp, usbep_t ep) {
+
+    usbp->out_stalled[ep] = TRUE;
+    return FALSE;
+}
+
+void usbSetupTransfer(USBDriver *usbp, uint8_t *buf, size_t n, usbcallback_t endcb) {
+
+    (void)usbp;
+    (void)buf;
+    (void)n;
+    (void)endcb;
+}
+
+void usbStop(USBDriver *usbp) {
+
+    usbp->state = USB_STOP;
+}
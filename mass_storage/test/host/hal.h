@@ -0,0 +1,170 @@
+/**
+ * @file    test/host/hal.h
+ * @brief   Host build of the ChibiOS/HAL API used by the driver
+ * @details The USB driver records the transfers the driver starts and the
+ *          stalls, the test harness completing them in place of the host.
+ *          A RAM disk serves as block device.
+ */
+
+#ifndef _HAL_H_
+#define _HAL_H_
+
+#include "ch.h"
+
+typedef uint32_t halrtcnt_t;
+
+halrtcnt_t halGetCounterValue(void);
+halrtcnt_t halGetCounterFrequency(void);
+
+/*===========================================================================*/
+/* Block devices.                                                            */
+/*===========================================================================*/
+
+typedef enum {
+    BLK_UNINIT = 0,
+    BLK_STOP = 1,
+    BLK_ACTIVE = 2,
+    BLK_CONNECTING = 3,
+    BLK_DISCONNECTING = 4,
+    BLK_READY = 5,
+    BLK_READING = 6,
+    BLK_WRITING = 7,
+    BLK_SYNCING = 8
+} blkstate_t;
+
+typedef struct {
+    uint32_t blk_size;
+    uint32_t blk_num;
+} BlockDeviceInfo;
+
+#define _base_block_device_methods                                          \
+    bool_t (*is_inserted)(void *instance);                                  \
+    bool_t (*is_protected)(void *instance);                                 \
+    bool_t (*connect)(void *instance);                                      \
+    bool_t (*disconnect)(void *instance);                                   \
+    bool_t (*read)(void *instance, uint32_t startblk, uint8_t *buffer, uint32_t n); \
+    bool_t (*write)(void *instance, uint32_t startblk, const uint8_t *buffer, uint32_t n); \
+    bool_t (*sync)(void *instance);                                         \
+    bool_t (*get_info)(void *instance, BlockDeviceInfo *bdip);
+
+#define _base_block_device_data                                             \
+    blkstate_t state;
+
+struct BaseBlockDeviceVMT {
+    _base_block_device_methods
+};
+
+typedef struct {
+    const struct BaseBlockDeviceVMT *vmt;
+    _base_block_device_data
+} BaseBlockDevice;
+
+#define blkGetDriverState(ip) ((ip)->state)
+#define blkIsInserted(ip) ((ip)->vmt->is_inserted(ip))
+#define blkIsWriteProtected(ip) ((ip)->vmt->is_protected(ip))
+#define blkRead(ip, startblk, buffer, n) ((ip)->vmt->read(ip, startblk, buffer, n))
+#define blkWrite(ip, startblk, buffer, n) ((ip)->vmt->write(ip, startblk, buffer, n))
+#define blkSync(ip) ((ip)->vmt->sync(ip))
+#define blkGetInfo(ip, bdip) ((ip)->vmt->get_info(ip, bdip))
+
+/**
+ * @brief RAM disk, instant block device
+ */
+typedef struct {
+    const struct BaseBlockDeviceVMT *vmt;
+    _base_block_device_data
+    uint8_t *data;
+    BlockDeviceInfo info;
+    uint32_t reads;
+    uint32_t writes;
+} RamDisk;
+
+void ramdiskStart(RamDisk *rdp, uint8_t *data, uint32_t blk_size, uint32_t blk_num);
+
+/*===========================================================================*/
+/* USB driver.                                                               */
+/*===========================================================================*/
+
+#define USB_MAX_ENDPOINTS 5
+
+#define USB_EP_MODE_TYPE_BULK 0x0002
+#define USB_RTYPE_TYPE_MASK 0x60
+#define USB_RTYPE_TYPE_CLASS 0x20
+#define USB_RTYPE_RECIPIENT_MASK 0x1F
+#define USB_RTYPE_RECIPIENT_INTERFACE 0x01
+#define USB_RTYPE_DIR_MASK 0x80
+#define USB_RTYPE_DIR_HOST2DEV 0x00
+#define USB_RTYPE_DIR_DEV2HOST 0x80
+
+typedef uint8_t usbep_t;
+
+typedef enum {
+    USB_UNINIT = 0,
+    USB_STOP = 1,
+    USB_READY = 2,
+    USB_SELECTED = 3,
+    USB_ACTIVE = 4
+} usbstate_t;
+
+typedef struct USBDriver USBDriver;
+
+typedef void (*usbcallback_t)(USBDriver *usbp);
+typedef void (*usbepcallback_t)(USBDriver *usbp, usbep_t ep);
+
+typedef struct {
+    int unused;
+} USBInEndpointState;
+
+typedef struct {
+    int unused;
+} USBOutEndpointState;
+
+typedef struct {
+    uint32_t ep_mode;
+    usbepcallback_t setup_cb;
+    usbepcallback_t in_cb;
+    usbepcallback_t out_cb;
+    uint16_t in_maxsize;
+    uint16_t out_maxsize;
+    USBInEndpointState *in_state;
+    USBOutEndpointState *out_state;
+    uint16_t ep_buffers;
+    uint8_t *setup_buf;
+} USBEndpointConfig;
+
+/**
+ * @brief Transfer started by the driver, not yet completed by the host
+ */
+typedef struct {
+    bool_t pending;
+    uint8_t *buffer;
+    size_t size;
+} usb_host_transfer_t;
+
+struct USBDriver {
+    usbstate_t state;
+    const USBEndpointConfig *epc[USB_MAX_ENDPOINTS + 1];
+    void *in_params[USB_MAX_ENDPOINTS];
+    void *out_params[USB_MAX_ENDPOINTS];
+    uint8_t setup[8];
+    usb_host_transfer_t in[USB_MAX_ENDPOINTS];
+    usb_host_transfer_t out[USB_MAX_ENDPOINTS];
+    bool_t in_stalled[USB_MAX_ENDPOINTS];
+    bool_t out_stalled[USB_MAX_ENDPOINTS];
+};
+
+#define usbGetDriverStateI(usbp) ((usbp)->state)
+#define usbConnectBus(usbp) ((void)(usbp))
+#define usbDisconnectBus(usbp) ((void)(usbp))
+
+void usbInitEndpointI(USBDriver *usbp, usbep_t ep, const USBEndpointConfig *epcp);
+void usbPrepareTransmit(USBDriver *usbp, usbep_t ep, const uint8_t *buf, size_t n);
+void usbPrepareReceive(USBDriver *usbp, usbep_t ep, uint8_t *buf, size_t n);
+bool_t usbStartTransmitI(USBDriver *usbp, usbep_t ep);
+bool_t usbStartReceiveI(USBDriver *usbp, usbep_t ep);
+bool_t usbStallTransmitI(USBDriver *usbp, usbep_t ep);
+bool_t usbStallReceiveI(USBDriver *usbp, usbep_t ep);
+void usbSetupTransfer(USBDriver *usbp, uint8_t *buf, size_t n, usbcallback_t endcb);
+void usbStop(USBDriver *usbp);
+
+#endif /* _HAL_H_ */
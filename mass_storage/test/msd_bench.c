@@ -0,0 +1,131 @@
+/*
+ * Host microbenchmark of the command handlers: each command is run against
+ * the mock USB driver and the RAM disk, and its cost is reported in
+ * nanoseconds per command, for the whole exchange as seen by the host and,
+ * from the driver's cycle profile, for the command processing alone.
+ */
+
+#include "msd_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !USB_MSD_USE_CYCLE_PROFILE
+#error "the benchmark needs USB_MSD_USE_CYCLE_PROFILE"
+#endif
+
+/**
+ * @brief Commands run per opcode
+ */
+#define BENCH_COMMANDS 20000
+
+/**
+ * @brief A benchmarked command
+ */
+typedef struct {
+    const char *name;
+    uint8_t cdb[10];
+    uint8_t cdb_len;
+    uint32_t data_len;
+    bool_t in;
+} bench_command_t;
+
+static const bench_command_t bench_commands[] = {
+    {"TEST UNIT READY", {0x00, 0, 0, 0, 0, 0}, 6, 0, FALSE},
+    {"INQUIRY", {0x12, 0, 0, 0, 36, 0}, 6, 36, TRUE},
+    {"REQUEST SENSE", {0x03, 0, 0, 0, 18, 0}, 6, 18, TRUE},
+    {"READ CAPACITY 10", {0x25, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 10, 8, TRUE},
+    {"READ 10", {0x28, 0, 0, 0, 0, 3, 0, 0, 1, 0}, 10, 512, TRUE},
+    {"WRITE 10", {0x2A, 0, 0, 0, 0, 3, 0, 0, 1, 0}, 10, 512, FALSE},
+#if USB_MSD_USE_CMD_MODE_SENSE_6
+    {"MODE SENSE 6", {0x1A, 0, 0x3F, 0, 192, 0}, 6, 192, TRUE},
+#endif
+#if USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES
+    {"READ FORMAT CAP", {0x23, 0, 0, 0, 0, 0, 0, 0, 252, 0}, 10, 252, TRUE},
+#endif
+#if USB_MSD_USE_CMD_START_STOP_UNIT
+    {"START STOP UNIT", {0x1B, 0, 0, 0, 0x01, 0}, 6, 0, FALSE},
+#endif
+#if USB_MSD_USE_CMD_SYNCHRONIZE_CACHE_10
+    {"SYNCHRONIZE CACHE", {0x35, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 10, 0, FALSE},
+#endif
+#if USB_MSD_USE_CMD_LOG_SENSE
+    {"LOG SENSE", {0x4D, 0, 0x40, 0, 0, 0, 0, 0x01, 0x00, 0}, 10, 256, TRUE},
+#endif
+};
+
+static msd_host_result_t result;
+static uint8_t block[512];
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Runs a command, stopping the benchmark if the device hangs
+ */
+static void run_command(const bench_command_t *c) {
+
+    if (msdHostCommand(c->cdb, c->cdb_len, c->data_len, c->in, c->in ? NULL : block, &result) != CH_SUCCESS ||
+        !result.csw_received) {
+        printf("%s: no status\n", c->name);
+        exit(1);
+    }
+}
+
+/**
+ * @brief Benchmarks a command, with the opcode table of the driver cleared
+ */
+static void bench_command(const bench_command_t *c) {
+
+    msd_cycle_profile_t profile;
+    const msd_opcode_cost_t *slot = NULL;
+    uint64_t start, elapsed;
+    uint32_t i;
+
+    /* warm the caches and the sense data up */
+    for (i = 0; i < BENCH_COMMANDS / 100; i++)
+        run_command(c);
+
+    msdResetCycleProfile(&UMSD1);
+    start = now_ns();
+    for (i = 0; i < BENCH_COMMANDS; i++)
+        run_command(c);
+    elapsed = now_ns() - start;
+    msdGetCycleProfile(&UMSD1, &profile);
+
+    for (i = 0; i < USB_MSD_CYCLE_OPCODES; i++) {
+        if ((profile.opcodes[i].cost.count > 0) && (profile.opcodes[i].opcode == c->cdb[0])) {
+            slot = &profile.opcodes[i];
+            break;
+        }
+    }
+
+    printf("%-18s 0x%02X status %u %9u %9u %9u\n", c->name, c->cdb[0], result.csw.status,
+           (unsigned)(elapsed / BENCH_COMMANDS),
+           slot ? (unsigned)(slot->cost.cycles / slot->cost.count) : 0,
+           slot ? (unsigned)slot->cost.max : 0);
+}
+
+int main(void) {
+
+    size_t i;
+
+    for (i = 0; i < sizeof(block); i++)
+        block[i] = (uint8_t)i;
+
+    msdHostStart();
+
+    printf("%u commands each, ns per command\n", BENCH_COMMANDS);
+    printf("%-18s %-4s %-8s %9s %9s %9s\n", "command", "op", "", "exchange", "driver", "max");
+    for (i = 0; i < sizeof(bench_commands) / sizeof(bench_commands[0]); i++)
+        bench_command(&bench_commands[i]);
+
+    return 0;
+}
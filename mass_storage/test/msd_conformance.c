@@ -0,0 +1,156 @@
+/*
+ * Bulk-Only Transport conformance of the driver: the thirteen cases of the
+ * host expectation (Hn, Hi, Ho) against the device intent (Dn, Di, Do), each
+ * checked for the status, residue, data moved and stalls, and timed.
+ */
+
+#include "msd_host.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define PASSED      0x00
+#define FAILED      0x01
+#define PHASE_ERROR 0x02
+
+static const uint8_t cdb_test_unit_ready[6] = {0x00, 0, 0, 0, 0, 0};
+static const uint8_t cdb_inquiry[6] = {0x12, 0, 0, 0, 36, 0};
+static const uint8_t cdb_request_sense[6] = {0x03, 0, 0, 0, 18, 0};
+static const uint8_t cdb_read_1[10] = {0x28, 0, 0, 0, 0, 3, 0, 0, 1, 0};
+static const uint8_t cdb_write_1[10] = {0x2A, 0, 0, 0, 0, 3, 0, 0, 1, 0};
+static const uint8_t cdb_write_2[10] = {0x2A, 0, 0, 0, 0, 3, 0, 0, 2, 0};
+
+/**
+ * @brief A Bulk-Only Transport case and its expected outcome
+ */
+typedef struct {
+    const char *name;
+    const uint8_t *cdb;
+    uint8_t cdb_len;
+    uint32_t data_len;
+    bool_t in;
+    uint8_t status;
+    uint32_t residue;
+    size_t moved;
+    bool_t in_stalled;
+    bool_t out_stalled;
+} bot_case_t;
+
+static const bot_case_t bot_cases[] = {
+    {"1  Hn = Dn", cdb_test_unit_ready, 6, 0, FALSE, PASSED, 0, 0, FALSE, FALSE},
+    {"2  Hn < Di", cdb_inquiry, 6, 0, FALSE, PHASE_ERROR, 0, 0, FALSE, FALSE},
+    {"3  Hn < Do", cdb_write_1, 10, 0, FALSE, PHASE_ERROR, 0, 0, FALSE, FALSE},
+    {"4  Hi > Dn", cdb_test_unit_ready, 6, 36, TRUE, PASSED, 36, 0, TRUE, FALSE},
+    {"5  Hi > Di", cdb_inquiry, 6, 64, TRUE, PASSED, 28, 36, FALSE, FALSE},
+    {"6  Hi = Di", cdb_inquiry, 6, 36, TRUE, PASSED, 0, 36, FALSE, FALSE},
+    {"7  Hi < Di", cdb_read_1, 10, 256, TRUE, PHASE_ERROR, 256, 0, TRUE, FALSE},
+    {"8  Hi <> Do", cdb_write_1, 10, 512, TRUE, PHASE_ERROR, 512, 0, TRUE, FALSE},
+    {"9  Ho > Dn", cdb_test_unit_ready, 6, 512, FALSE, PASSED, 512, 0, FALSE, TRUE},
+    {"10 Ho <> Di", cdb_inquiry, 6, 36, FALSE, PHASE_ERROR, 36, 0, FALSE, TRUE},
+    {"11 Ho > Do", cdb_write_1, 10, 1024, FALSE, PASSED, 512, 512, FALSE, TRUE},
+    {"12 Ho = Do", cdb_write_1, 10, 512, FALSE, PASSED, 0, 512, FALSE, FALSE},
+    {"13 Ho < Do", cdb_write_2, 10, 512, FALSE, PHASE_ERROR, 512, 0, FALSE, TRUE},
+};
+
+static msd_host_result_t result;
+static uint8_t pattern[1024];
+static int failures;
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void check(bool_t ok, const char *name, const char *what) {
+
+    if (!ok) {
+        printf("FAIL %s: %s\n", name, what);
+        failures++;
+    }
+}
+
+/**
+ * @brief Checks the status wrapper of the last command
+ */
+static void check_csw(const char *name, uint8_t status, uint32_t residue) {
+
+    check(result.csw_received, name, "no status");
+    check(result.csw.signature == 0x53425355, name, "status signature");
+    check(result.csw.tag == UMSD1.cbw.tag, name, "status tag");
+    check(result.csw.status == status, name, "status");
+    check(result.csw.data_residue == residue, name, "residue");
+}
+
+static void run_case(const bot_case_t *c) {
+
+    uint64_t start = now_ns();
+    bool_t done = msdHostCommand(c->cdb, c->cdb_len, c->data_len, c->in, c->in ? NULL : pattern, &result);
+    uint64_t elapsed = now_ns() - start;
+
+    check(done == CH_SUCCESS, c->name, "the device did not wait for the next command");
+    check_csw(c->name, c->status, c->residue);
+    check((c->in ? result.in_len : result.out_len) == c->moved, c->name, "data moved");
+    check(c->in ? (result.out_len == 0) : (result.in_len == 0), c->name, "data in the wrong direction");
+    check(result.in_stalled == c->in_stalled, c->name, "IN stall");
+    check(result.out_stalled == c->out_stalled, c->name, "OUT stall");
+
+    printf("%-12s status %u residue %4u moved %4u stall %-3s %-3s %6u ns\n", c->name,
+           result.csw.status, (unsigned)result.csw.data_residue,
+           (unsigned)(c->in ? result.in_len : result.out_len),
+           result.in_stalled ? "IN" : "-", result.out_stalled ? "OUT" : "-", (unsigned)elapsed);
+}
+
+int main(void) {
+
+    size_t i;
+
+    for (i = 0; i < sizeof(pattern); i++)
+        pattern[i] = (uint8_t)(i * 7 + 1);
+
+    msdHostStart();
+
+    for (i = 0; i < sizeof(bot_cases) / sizeof(bot_cases[0]); i++)
+        run_case(&bot_cases[i]);
+
+    /* the written block reads back */
+    check(msdHostCommand(cdb_read_1, 10, 512, TRUE, NULL, &result) == CH_SUCCESS, "read back", "no command");
+    check_csw("read back", PASSED, 0);
+    check((result.in_len == 512) && (memcmp(result.in, pattern, 512) == 0), "read back", "data");
+
+    /* the sense data of a failed command */
+    static const uint8_t cdb_unknown[6] = {0xFF, 0, 0, 0, 0, 0};
+    msdHostCommand(cdb_unknown, 6, 0, FALSE, NULL, &result);
+    check_csw("unknown command", FAILED, 0);
+    msdHostCommand(cdb_request_sense, 6, 18, TRUE, NULL, &result);
+    check_csw("request sense", PASSED, 0);
+    check((result.in_len == 18) && ((result.in[2] & 0x0F) == 0x05) && (result.in[12] == 0x20),
+          "request sense", "illegal request, invalid command");
+
+    /* a short allocation length truncates the response */
+    static const uint8_t cdb_inquiry_short[6] = {0x12, 0, 0, 0, 5, 0};
+    msdHostCommand(cdb_inquiry_short, 6, 36, TRUE, NULL, &result);
+    check_csw("inquiry allocation length", PASSED, 31);
+    check(result.in_len == 5, "inquiry allocation length", "data moved");
+
+    /* a restart on the configured bus waits for a command block again */
+    check(msdHostRestart() == CH_SUCCESS, "restart", "stop");
+    check(msdHostCommand(cdb_test_unit_ready, 6, 0, FALSE, NULL, &result) == CH_SUCCESS, "restart", "no command");
+    check_csw("restart", PASSED, 0);
+
+    /* an invalid command block stalls both end-points without status */
+    check(msdHostInvalidCommand(&result) == CH_SUCCESS, "invalid command block", "no command");
+    check(!result.csw_received, "invalid command block", "status sent");
+    check(result.in_stalled && result.out_stalled, "invalid command block", "stalls");
+
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("all cases passed\n");
+    return 0;
+}
@@ -0,0 +1,202 @@
+/* the driver is built in this unit to step its state machine */
+#include "usb_msd.c"
+#include "msd_host.h"
+
+/**
+ * @brief Bulk end-point of the driver
+ */
+#define MSD_HOST_EP 1
+
+/**
+ * @brief Longest exchange of a command, in transfers
+ */
+#define MSD_HOST_MAX_TRANSFERS 1024
+
+USBMassStorageDriver UMSD1;
+RamDisk RAMDISK1;
+uint8_t msd_host_media[MSD_HOST_BLOCKS * 512];
+
+static USBDriver USBD1;
+static uint32_t msd_host_tag;
+
+static const USBMassStorageConfig msd_host_config = {
+    .usbp = &USBD1,
+    .bbdp = (BaseBlockDevice *)&RAMDISK1,
+    .bulk_ep = MSD_HOST_EP,
+    .short_vendor_id = "Host",
+    .short_product_id = "RAM disk",
+    .short_product_version = "0.1",
+    .thread_prio = NORMALPRIO
+};
+
+/**
+ * @brief Takes the wake-up of the driver thread, if it has been signaled
+ */
+static bool_t msd_host_wakeup(void) {
+
+#if !USB_MSD_USE_SERVICE_THREAD
+    if (UMSD1.bsem.taken)
+        return FALSE;
+    UMSD1.bsem.taken = TRUE;
+#else
+    if (!(UMSD1.thread->events & EVENT_MASK(UMSD1.index)))
+        return FALSE;
+    UMSD1.thread->events &= ~EVENT_MASK(UMSD1.index);
+#endif
+    return TRUE;
+}
+
+/**
+ * @brief Completes a transfer, then runs the driver as its thread would
+ */
+static void msd_host_complete(bool_t in) {
+
+    if (in) {
+        USBD1.in[MSD_HOST_EP].pending = FALSE;
+        USBD1.epc[MSD_HOST_EP]->in_cb(&USBD1, MSD_HOST_EP);
+    } else {
+        USBD1.out[MSD_HOST_EP].pending = FALSE;
+        USBD1.epc[MSD_HOST_EP]->out_cb(&USBD1, MSD_HOST_EP);
+    }
+
+    if (msd_host_wakeup())
+        msd_step(&UMSD1);
+}
+
+/**
+ * @brief Sends a command block and plays the rest of the exchange
+ */
+static bool_t msd_host_run(const msd_cbw_t *cbw, const uint8_t *out, msd_host_result_t *result) {
+
+    usb_host_transfer_t *rx = &USBD1.out[MSD_HOST_EP];
+    usb_host_transfer_t *tx = &USBD1.in[MSD_HOST_EP];
+    uint32_t i;
+
+    memset(result, 0, sizeof(*result));
+
+    /* the host clears the halts before each command */
+    USBD1.in_stalled[MSD_HOST_EP] = FALSE;
+    USBD1.out_stalled[MSD_HOST_EP] = FALSE;
+
+    if (!rx->pending || (rx->buffer != (uint8_t *)&UMSD1.cbw))
+        return CH_FAILED;
+
+    memcpy(rx->buffer, cbw, sizeof(*cbw));
+    msd_host_complete(FALSE);
+
+    for (i = 0; i < MSD_HOST_MAX_TRANSFERS; i++) {
+        if (tx->pending) {
+            if (tx->buffer == (uint8_t *)&UMSD1.csw) {
+                memcpy(&result->csw, tx->buffer, sizeof(result->csw));
+                result->csw_received = TRUE;
+            } else {
+                size_t n = tx->size;
+                if (n > sizeof(result->in) - result->in_len)
+                    n = sizeof(result->in) - result->in_len;
+                memcpy(result->in + result->in_len, tx->buffer, n);
+                result->in_len += n;
+            }
+            msd_host_complete(TRUE);
+        } else if (rx->pending) {
+            if (rx->buffer == (uint8_t *)&UMSD1.cbw) {
+                /* the device waits for the next command */
+                result->in_stalled = USBD1.in_stalled[MSD_HOST_EP];
+                result->out_stalled = USBD1.out_stalled[MSD_HOST_EP];
+                return CH_SUCCESS;
+            }
+
+            if ((out != NULL) && (result->out_len + rx->size <= cbw->data_len))
+                memcpy(rx->buffer, out + result->out_len, rx->size);
+            else
+                memset(rx->buffer, 0, rx->size);
+            result->out_len += rx->size;
+            msd_host_complete(FALSE);
+        } else {
+            /* nothing to complete, the device would hang */
+            return CH_FAILED;
+        }
+    }
+
+    return CH_FAILED;
+}
+
+/**
+ * @brief Starts the driver on a zeroed RAM disk
+ */
+void msdHostStart(void) {
+
+    memset(msd_host_media, 0, sizeof(msd_host_media));
+    ramdiskStart(&RAMDISK1, msd_host_media, 512, MSD_HOST_BLOCKS);
+
+    USBD1.state = USB_STOP;
+    msdInit(&UMSD1);
+    msdStart(&UMSD1, &msd_host_config);
+
+    /* the host configures the device */
+    USBD1.state = USB_ACTIVE;
+    msdConfigureHookI(&UMSD1);
+
+    /* what the thread does first, then wait for a command block */
+    msd_attach_media(&UMSD1);
+    if (msd_host_wakeup())
+        msd_step(&UMSD1);
+}
+
+/**
+ * @brief Stops and starts the driver again, the device staying configured
+ */
+bool_t msdHostRestart(void) {
+
+    if (msdStop(&UMSD1) == CH_FAILED)
+        return CH_FAILED;
+
+    /* the ending thread took the wake-ups left */
+#if !USB_MSD_USE_SERVICE_THREAD
+    UMSD1.bsem.taken = TRUE;
+#else
+    msd_service_thread->events &= ~EVENT_MASK(UMSD1.index);
+#endif
+    msdStart(&UMSD1, &msd_host_config);
+
+    /* what the new thread does, it must be woken up to wait for a command */
+    msd_attach_media(&UMSD1);
+    if (!msd_host_wakeup())
+        return CH_FAILED;
+    msd_step(&UMSD1);
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Runs a command
+ */
+bool_t msdHostCommand(const uint8_t *cdb, uint8_t cdb_len, uint32_t data_len, bool_t in,
+                      const uint8_t *out, msd_host_result_t *result) {
+
+    msd_cbw_t cbw;
+
+    memset(&cbw, 0, sizeof(cbw));
+    cbw.signature = MSD_CBW_SIGNATURE;
+    cbw.tag = ++msd_host_tag;
+    cbw.data_len = data_len;
+    cbw.flags = in ? 0x80 : 0x00;
+    cbw.lun = 0;
+    cbw.scsi_cmd_len = cdb_len;
+    memcpy(cbw.scsi_cmd_data, cdb, cdb_len);
+
+    return msd_host_run(&cbw, out, result);
+}
+
+/**
+ * @brief Sends a malformed command block
+ */
+bool_t msdHostInvalidCommand(msd_host_result_t *result) {
+
+    msd_cbw_t cbw;
+
+    memset(&cbw, 0, sizeof(cbw));
+    cbw.signature = 0x12345678;
+    cbw.tag = ++msd_host_tag;
+    cbw.scsi_cmd_len = 6;
+
+    return msd_host_run(&cbw, NULL, result);
+}
@@ -0,0 +1,96 @@
+/**
+ * @file    test/msd_host.h
+ * @brief   Host side of the Bulk-Only Transport for the driver tests
+ * @details Runs the driver against the host USB driver and a RAM disk,
+ *          playing the USB host: each command block is sent, the data phase
+ *          is completed and the status is read back.
+ */
+
+#ifndef _MSD_HOST_H_
+#define _MSD_HOST_H_
+
+#include "usb_msd.h"
+
+/**
+ * @brief Blocks of the RAM disk
+ */
+#define MSD_HOST_BLOCKS 64
+
+/**
+ * @brief Largest data phase
+ */
+#define MSD_HOST_MAX_DATA 8192
+
+/**
+ * @brief Host side result of a command
+ */
+typedef struct {
+    /**
+    * @brief Data received from the device
+    */
+    uint8_t in[MSD_HOST_MAX_DATA];
+    size_t in_len;
+
+    /**
+    * @brief Data taken by the device from the host
+    */
+    size_t out_len;
+
+    /**
+    * @brief Whether the device sent a status, and the status
+    */
+    bool_t csw_received;
+    msd_csw_t csw;
+
+    /**
+    * @brief End-points stalled by the device
+    */
+    bool_t in_stalled;
+    bool_t out_stalled;
+} msd_host_result_t;
+
+extern USBMassStorageDriver UMSD1;
+extern RamDisk RAMDISK1;
+extern uint8_t msd_host_media[MSD_HOST_BLOCKS * 512];
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Starts the driver on a zeroed RAM disk, as configured by the host.
+ */
+void msdHostStart(void);
+
+/**
+ * @brief   Stops and starts the driver again, the device staying configured.
+ */
+bool_t msdHostRestart(void);
+
+/**
+ * @brief   Runs a command.
+ *
+ * @param[in] cdb       command descriptor block
+ * @param[in] cdb_len   size of @p cdb
+ * @param[in] data_len  data transfer length of the command block
+ * @param[in] in        TRUE when the host expects data from the device
+ * @param[in] out       data sent to the device, @p data_len bytes, or NULL
+ * @param[out] result   what the host received
+ *
+ * @return              The operation status.
+ * @retval CH_SUCCESS   The device is waiting for the next command block.
+ * @retval CH_FAILED    The device stopped without waiting for a transfer.
+ */
+bool_t msdHostCommand(const uint8_t *cdb, uint8_t cdb_len, uint32_t data_len, bool_t in,
+                      const uint8_t *out, msd_host_result_t *result);
+
+/**
+ * @brief   Sends a malformed command block.
+ */
+bool_t msdHostInvalidCommand(msd_host_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MSD_HOST_H_ */
@@ -0,0 +1,311 @@
+/**
+ * @file    msdtrace.c
+ * @brief   Host decoder of the USB mass storage driver trace
+ * @details Reads the records streamed on the trace interface of the device,
+ *          or a raw capture of them, and prints them as a timeline.
+ *
+ *          Build: cc -O2 -o msdtrace msdtrace.c -lusb-1.0
+ *
+ *          Usage: msdtrace [-d vid:pid] [-e endpoint] [-w capture]
+ *                 msdtrace -r capture
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libusb-1.0/libusb.h>
+
+/* record types, see msd_trace_record_t in usb_msd.h */
+#define MSD_TRACE_START     0x01
+#define MSD_TRACE_DROPPED   0x02
+#define MSD_TRACE_CBW       0x10
+#define MSD_TRACE_CSW       0x11
+#define MSD_TRACE_RESET     0x12
+#define MSD_TRACE_XFER      0x20
+#define MSD_TRACE_XFER_DONE 0x21
+#define MSD_TRACE_MEDIA     0x22
+
+#define RECORD_SIZE 16
+
+/* decoder state */
+typedef struct {
+    double frequency;
+    uint32_t last_time;
+    uint64_t time;
+    uint64_t cbw_time;
+    uint64_t xfer_time;
+    uint8_t opcode;
+    unsigned long records;
+    unsigned long dropped;
+} decoder_t;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+
+    (void)sig;
+    stop = 1;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const char *opcode_name(uint8_t opcode) {
+
+    switch (opcode) {
+    case 0x00: return "TEST_UNIT_READY";
+    case 0x03: return "REQUEST_SENSE";
+    case 0x12: return "INQUIRY";
+    case 0x1A: return "MODE_SENSE_6";
+    case 0x1B: return "START_STOP_UNIT";
+    case 0x1D: return "SEND_DIAGNOSTIC";
+    case 0x1E: return "PREVENT_ALLOW";
+    case 0x23: return "READ_FORMAT_CAP";
+    case 0x25: return "READ_CAPACITY_10";
+    case 0x28: return "READ_10";
+    case 0x2A: return "WRITE_10";
+    case 0x2F: return "VERIFY_10";
+    case 0x35: return "SYNC_CACHE_10";
+    case 0x4C: return "LOG_SELECT";
+    case 0x4D: return "LOG_SENSE";
+    default:   return "?";
+    }
+}
+
+/* converts counter cycles to microseconds */
+static double to_us(const decoder_t *dp, uint64_t cycles) {
+
+    return (dp->frequency > 0) ? cycles * 1e6 / dp->frequency : (double)cycles;
+}
+
+/* prints one record */
+static void decode_record(decoder_t *dp, const uint8_t *rec) {
+
+    uint8_t type = rec[0];
+    uint8_t code = rec[1];
+    uint16_t count = get_u16(&rec[2]);
+    uint32_t time = get_u32(&rec[4]);
+    uint32_t arg0 = get_u32(&rec[8]);
+    uint32_t arg1 = get_u32(&rec[12]);
+
+    /* the counter wraps, records are assumed closer than a wrap period */
+    if (type == MSD_TRACE_START) {
+        dp->frequency = arg0;
+        dp->time = 0;
+    } else if (dp->records > 0) {
+        dp->time += (uint32_t)(time - dp->last_time);
+    }
+    dp->last_time = time;
+    dp->records++;
+
+    printf("%14.3f  ", to_us(dp, dp->time));
+
+    switch (type) {
+    case MSD_TRACE_START:
+        printf("START    counter %lu Hz, system time %lu\n", (unsigned long)arg0, (unsigned long)arg1);
+        break;
+    case MSD_TRACE_DROPPED:
+        dp->dropped += arg0;
+        printf("DROPPED  %lu records\n", (unsigned long)arg0);
+        break;
+    case MSD_TRACE_CBW:
+        dp->cbw_time = dp->time;
+        dp->opcode = code;
+        if ((code == 0x28) || (code == 0x2A))
+            printf("CBW      %s lba %lu blocks %u, %lu bytes\n", opcode_name(code),
+                   (unsigned long)arg0, count, (unsigned long)arg1);
+        else
+            printf("CBW      %s (%02Xh), %lu bytes\n", opcode_name(code), code, (unsigned long)arg1);
+        break;
+    case MSD_TRACE_CSW:
+        printf("CSW      %s %s, residue %lu, tag %08lX, %.1f us\n", opcode_name(dp->opcode),
+               (code == 0) ? "passed" : (code == 1) ? "failed" : "phase error",
+               (unsigned long)arg0, (unsigned long)arg1, to_us(dp, dp->time - dp->cbw_time));
+        break;
+    case MSD_TRACE_RESET:
+        printf("RESET\n");
+        break;
+    case MSD_TRACE_XFER:
+        dp->xfer_time = dp->time;
+        printf("  USB    %s %lu bytes\n", code ? "IN " : "OUT", (unsigned long)arg0);
+        break;
+    case MSD_TRACE_XFER_DONE:
+        printf("  USB    done, %.1f us\n", to_us(dp, dp->time - dp->xfer_time));
+        break;
+    case MSD_TRACE_MEDIA:
+        printf("  MEDIA  %s lba %lu blocks %u, %.1f us%s\n", (code & 0x01) ? "write" : "read",
+               (unsigned long)arg0, count, to_us(dp, arg1), (code & 0x80) ? ", FAILED" : "");
+        break;
+    default:
+        printf("unknown record type %02Xh\n", type);
+        break;
+    }
+}
+
+/* decodes a buffer, keeping a partial record for the next one */
+static void decode(decoder_t *dp, uint8_t *pending, size_t *pending_len, const uint8_t *data, size_t len) {
+
+    while (len > 0) {
+        size_t n = RECORD_SIZE - *pending_len;
+        if (n > len)
+            n = len;
+
+        memcpy(pending + *pending_len, data, n);
+        *pending_len += n;
+        data += n;
+        len -= n;
+
+        if (*pending_len == RECORD_SIZE) {
+            decode_record(dp, pending);
+            *pending_len = 0;
+        }
+    }
+}
+
+static int read_capture(const char *path) {
+
+    decoder_t decoder;
+    uint8_t pending[RECORD_SIZE];
+    size_t pending_len = 0;
+    uint8_t buffer[4096];
+    size_t len;
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    memset(&decoder, 0, sizeof(decoder));
+    while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        decode(&decoder, pending, &pending_len, buffer, len);
+
+    fclose(f);
+    printf("%lu records, %lu dropped\n", decoder.records, decoder.dropped);
+    return 0;
+}
+
+static int capture(uint16_t vid, uint16_t pid, int interface, uint8_t endpoint, const char *path) {
+
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    decoder_t decoder;
+    uint8_t pending[RECORD_SIZE];
+    size_t pending_len = 0;
+    uint8_t buffer[4096];
+    FILE *out = NULL;
+    int result = 0;
+
+    if (libusb_init(&ctx) != 0) {
+        fprintf(stderr, "libusb initialization failed\n");
+        return 1;
+    }
+
+    handle = libusb_open_device_with_vid_pid(ctx, vid, pid);
+    if (handle == NULL) {
+        fprintf(stderr, "device %04x:%04x not found\n", vid, pid);
+        libusb_exit(ctx);
+        return 1;
+    }
+
+    /* only the trace interface is claimed, the mass storage one is left to the kernel */
+    if (libusb_claim_interface(handle, interface) != 0) {
+        fprintf(stderr, "can't claim interface %d\n", interface);
+        libusb_close(handle);
+        libusb_exit(ctx);
+        return 1;
+    }
+
+    if ((path != NULL) && ((out = fopen(path, "wb")) == NULL)) {
+        perror(path);
+        result = 1;
+    }
+
+    memset(&decoder, 0, sizeof(decoder));
+    signal(SIGINT, on_signal);
+
+    while (!stop && (result == 0)) {
+        int transferred = 0;
+        int r = libusb_bulk_transfer(handle, endpoint | LIBUSB_ENDPOINT_IN, buffer, sizeof(buffer),
+                                     &transferred, 100);
+
+        /* a timeout still returns the data received so far */
+        if ((r != 0) && (r != LIBUSB_ERROR_TIMEOUT)) {
+            fprintf(stderr, "transfer failed: %s\n", libusb_error_name(r));
+            result = 1;
+        }
+
+        if (transferred > 0) {
+            if (out != NULL)
+                fwrite(buffer, 1, transferred, out);
+            decode(&decoder, pending, &pending_len, buffer, transferred);
+            fflush(stdout);
+        }
+    }
+
+    printf("%lu records, %lu dropped\n", decoder.records, decoder.dropped);
+
+    if (out != NULL)
+        fclose(out);
+    libusb_release_interface(handle, interface);
+    libusb_close(handle);
+    libusb_exit(ctx);
+    return result;
+}
+
+static void usage(void) {
+
+    fprintf(stderr,
+            "usage: msdtrace [-d vid:pid] [-i interface] [-e endpoint] [-w capture]\n"
+            "       msdtrace -r capture\n");
+}
+
+int main(int argc, char **argv) {
+
+    unsigned int vid = 0x0483, pid = 0x5740;
+    int interface = 1;
+    int endpoint = 2;
+    const char *read_path = NULL, *write_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:i:e:r:w:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'i':
+            interface = atoi(optarg);
+            break;
+        case 'e':
+            endpoint = atoi(optarg);
+            break;
+        case 'r':
+            read_path = optarg;
+            break;
+        case 'w':
+            write_path = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (read_path != NULL)
+        return read_capture(read_path);
+
+    return capture((uint16_t)vid, (uint16_t)pid, interface, (uint8_t)endpoint, write_path);
+}
@@ -1,5 +1,7 @@
 #include "usb_msd.h"
 
+#include <string.h>
+
 /* Request types */
 #define MSD_REQ_RESET   0xFF
 #define MSD_GET_MAX_LUN 0xFE
@@ -19,6 +21,11 @@
 #define MSD_COMMAND_FAILED      0x01
 #define MSD_COMMAND_PHASE_ERROR 0x02
 
+/* Media requests of the firmware */
+#define MSD_MEDIA_REQUEST_NONE   0
+#define MSD_MEDIA_REQUEST_EJECT  1
+#define MSD_MEDIA_REQUEST_INSERT 2
+
 /* SCSI commands */
 #define SCSI_CMD_TEST_UNIT_READY              0x00
 #define SCSI_CMD_REQUEST_SENSE                0x03
@@ -33,6 +40,9 @@
 #define SCSI_CMD_READ_10                      0x28
 #define SCSI_CMD_WRITE_10                     0x2A
 #define SCSI_CMD_VERIFY_10                    0x2F
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10         0x35
+#define SCSI_CMD_LOG_SELECT                   0x4C
+#define SCSI_CMD_LOG_SENSE                    0x4D
 
 /* SCSI sense keys */
 #define SCSI_SENSE_KEY_GOOD                            0x00
@@ -57,8 +67,10 @@
 #define SCSI_ASENSE_INVALID_COMMAND                    0x20
 #define SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE 0x21
 #define SCSI_ASENSE_INVALID_FIELD_IN_CDB               0x24
+#define SCSI_ASENSE_SAVING_PARAMETERS_NOT_SUPPORTED    0x39
 #define SCSI_ASENSE_WRITE_PROTECTED                    0x27
 #define SCSI_ASENSE_NOT_READY_TO_READY_CHANGE          0x28
+#define SCSI_ASENSE_COMMAND_TIMEOUT                    0x2E
 #define SCSI_ASENSE_FORMAT_ERROR                       0x31
 #define SCSI_ASENSE_MEDIUM_NOT_PRESENT                 0x3A
 
@@ -66,29 +78,110 @@
 #define SCSI_ASENSEQ_FORMAT_COMMAND_FAILED             0x01
 #define SCSI_ASENSEQ_INITIALIZING_COMMAND_REQUIRED     0x02
 #define SCSI_ASENSEQ_OPERATION_IN_PROGRESS             0x07
+#define SCSI_ASENSEQ_TIMEOUT_DURING_PROCESSING         0x02
+
+/**
+ * @brief Block size of the media, a constant when it is fixed at compile time
+ */
+#if USB_MSD_BLOCK_SIZE != 0
+#define MSD_BLOCK_SIZE(msdp) ((uint32_t)USB_MSD_BLOCK_SIZE)
+#else
+#define MSD_BLOCK_SIZE(msdp) ((msdp)->block_dev_info.blk_size)
+#endif
+
+#if USB_MSD_USE_CYCLE_PROFILE
+/**
+ * @brief Cycle counter of the cost table
+ * @details The DWT cycle counter on Cortex-M, the monotonic clock in
+ *          nanoseconds otherwise, e.g. in a simulator build.
+ */
+#if !defined(USB_MSD_CYCLES)
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define MSD_CYCLES_USE_DWT TRUE
+#define USB_MSD_CYCLES() ((uint32_t)DWT->CYCCNT)
+#else
+#include <time.h>
+
+static uint32_t msd_monotonic_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+#define USB_MSD_CYCLES() msd_monotonic_ns()
+#endif
+#endif /* !defined(USB_MSD_CYCLES) */
+
+/**
+ * @brief Instrumentation points, accounting the cycles since @p start
+ */
+#define MSD_CYCLES_BEGIN(start) uint32_t start = USB_MSD_CYCLES()
+#define MSD_CYCLES_END(msdp, phase, start) msd_cycles_account((msdp), (phase), USB_MSD_CYCLES() - (start))
 
 /**
- * @brief Response to a READ_CAPACITY_10 SCSI command
+ * @brief Accounts the cost of a phase
+ * @note  Called from the thread driving the instance, and from the ISR for
+ *        @p MSD_PHASE_ISR.
  */
-PACK_STRUCT_BEGIN typedef struct {
-    uint32_t last_block_addr;
-    uint32_t block_size;
-} PACK_STRUCT_STRUCT msd_scsi_read_capacity_10_response_t PACK_STRUCT_END;
+static void msd_cycles_account(USBMassStorageDriver *msdp, msd_phase_t phase, uint32_t cycles) {
+
+    msd_phase_cost_t *cost = &msdp->cycles.phases[phase];
+
+    cost->count++;
+    cost->cycles += cycles;
+    if (cycles > cost->max)
+        cost->max = cycles;
+}
+
+/**
+ * @brief Accounts the cost of a command
+ */
+static void msd_cycles_account_command(USBMassStorageDriver *msdp, uint8_t opcode, uint32_t cycles) {
+
+    msd_opcode_cost_t *slot = msdp->cycles.opcodes;
+    uint32_t i;
+
+    for (i = 0; i < USB_MSD_CYCLE_OPCODES; i++, slot++) {
+        if (slot->cost.count == 0)
+            slot->opcode = opcode;
+        if (slot->opcode != opcode)
+            continue;
+
+        slot->cost.count++;
+        slot->cost.cycles += cycles;
+        if (cycles > slot->cost.max)
+            slot->cost.max = cycles;
+        return;
+    }
+}
+#else
+#define MSD_CYCLES_BEGIN(start)
+#define MSD_CYCLES_END(msdp, phase, start)
+#endif /* USB_MSD_USE_CYCLE_PROFILE */
 
 /**
- * @brief Response to a READ_FORMAT_CAPACITIES SCSI command
+ * @brief Tells whether the media can be accessed, which is not the case while
+ *        an access abandoned by the watchdog has not returned
  */
-PACK_STRUCT_BEGIN typedef struct {
-    uint8_t reserved[3];
-    uint8_t capacity_list_length;
-    uint32_t block_count;
-    uint32_t desc_and_block_length;
-} PACK_STRUCT_STRUCT msd_scsi_read_format_capacities_response_t PACK_STRUCT_END;
+#if USB_MSD_USE_WATCHDOG
+#define msd_media_available(msdp) (!(msdp)->media_busy)
+#else
+#define msd_media_available(msdp) TRUE
+#endif
 
 /**
- * @brief   Read-write buffers (TODO: need a way of specifying the size of this)
+ * @brief Compile-time check, fails to build when the condition is false
  */
-static uint8_t rw_buf[2][512];
+#define MSD_STATIC_ASSERT(cond, name) typedef char msd_static_assert_##name[(cond) ? 1 : -1]
+
+/* the wrappers and responses go on the wire as they are laid out in memory */
+MSD_STATIC_ASSERT(sizeof(msd_cbw_t) == 31, cbw_size);
+MSD_STATIC_ASSERT(sizeof(msd_csw_t) == 13, csw_size);
+MSD_STATIC_ASSERT(sizeof(msd_scsi_inquiry_response_t) == 36, inquiry_size);
+MSD_STATIC_ASSERT(sizeof(msd_scsi_read_capacity_10_response_t) == 8, read_capacity_10_size);
+MSD_STATIC_ASSERT(sizeof(msd_scsi_read_format_capacities_response_t) == 12, read_format_capacities_size);
 
 /**
  * @brief Byte-swap a 32 bits unsigned integer
@@ -107,17 +200,8 @@ static uint8_t rw_buf[2][512];
 static void msd_handle_end_point_notification(USBDriver *usbp, usbep_t ep);
 
 /**
- * @brief IN end-point 1 state
- */
-static USBInEndpointState ep1_in_state;
-
-/**
- * @brief OUT end-point 1 state
- */
-static USBOutEndpointState ep1_out_state;
-
-/**
- * @brief End-point 1 initialization structure
+ * @brief Data end-point initialization structure
+ * @note  Each driver copies it and points it to its own end-point states.
  */
 static const USBEndpointConfig ep_data_config = {
     USB_EP_MODE_TYPE_BULK,
@@ -126,11 +210,151 @@ static const USBEndpointConfig ep_data_config = {
     msd_handle_end_point_notification,
     64,
     64,
-    &ep1_in_state,
-    &ep1_out_state,
+    NULL,
+    NULL,
+    1,
+    NULL
+};
+
+#if USB_MSD_TRACE_LEVEL >= 1
+static void msd_trace_notification(USBDriver *usbp, usbep_t ep);
+
+/**
+ * @brief Trace end-point initialization structure
+ */
+static const USBEndpointConfig ep_trace_config = {
+    USB_EP_MODE_TYPE_BULK,
+    NULL,
+    msd_trace_notification,
+    NULL,
+    64,
+    0,
+    NULL,
+    NULL,
     1,
     NULL
 };
+#endif
+
+#if USB_MSD_USE_SERVICE_THREAD
+/**
+ * @brief Event waking the service thread up when an instance is registered
+ */
+#define MSD_SERVICE_WAKEUP EVENT_MASK(USB_MSD_MAX_INSTANCES)
+
+/**
+ * @brief Service thread and the instances it drives
+ */
+static WORKING_AREA(msd_service_thread_wa, USB_MSD_SERVICE_THREAD_WA_SIZE);
+static Thread *msd_service_thread;
+static USBMassStorageDriver *msd_instances[USB_MSD_MAX_INSTANCES];
+static MUTEX_DECL(msd_instances_mtx);
+#endif
+
+/**
+ * @brief Wakes the thread driving an instance up
+ */
+static void msd_signal_i(USBMassStorageDriver *msdp) {
+
+#if USB_MSD_USE_SERVICE_THREAD
+    chEvtSignalI(msd_service_thread, EVENT_MASK(msdp->index));
+#else
+    chBSemSignalI(&msdp->bsem);
+#endif
+}
+
+#if USB_MSD_TRACE_LEVEL >= 1
+/**
+ * @brief Sends the pending trace records, unless a transfer is in progress
+ */
+static void msd_trace_flush_i(USBMassStorageDriver *msdp) {
+
+    USBDriver *usbp = msdp->config->usbp;
+    uint32_t tail = msdp->trace_tail & (USB_MSD_TRACE_RECORDS - 1);
+    uint32_t n = msdp->trace_head - msdp->trace_tail;
+
+    if ((n == 0) || (msdp->trace_sending != 0) || (usbGetDriverStateI(usbp) != USB_ACTIVE))
+        return;
+
+    /* the records up to the end of the ring, the rest goes next */
+    if (n > USB_MSD_TRACE_RECORDS - tail)
+        n = USB_MSD_TRACE_RECORDS - tail;
+
+    msdp->trace_sending = n;
+    usbPrepareTransmit(usbp, msdp->config->trace_ep, (const uint8_t *)&msdp->trace[tail],
+                       n * sizeof(msd_trace_record_t));
+    usbStartTransmitI(usbp, msdp->config->trace_ep);
+}
+
+/**
+ * @brief Appends a record to the trace
+ * @details The record is dropped when the ring is full, the number of dropped
+ *          records is reported once there is room again.
+ */
+static void msd_trace_i(USBMassStorageDriver *msdp, uint8_t type, uint8_t code, uint16_t count,
+                        uint32_t arg0, uint32_t arg1) {
+
+    uint32_t room = USB_MSD_TRACE_RECORDS - (msdp->trace_head - msdp->trace_tail);
+    msd_trace_record_t *rp;
+
+    if (msdp->config->trace_ep == 0)
+        return;
+
+    if ((room == 0) || ((msdp->trace_dropped > 0) && (room < 2))) {
+        msdp->trace_dropped++;
+        return;
+    }
+
+    if (msdp->trace_dropped > 0) {
+        rp = &msdp->trace[msdp->trace_head++ & (USB_MSD_TRACE_RECORDS - 1)];
+        rp->type = MSD_TRACE_DROPPED;
+        rp->code = 0;
+        rp->count = 0;
+        rp->time = halGetCounterValue();
+        rp->arg0 = msdp->trace_dropped;
+        rp->arg1 = 0;
+        msdp->trace_dropped = 0;
+    }
+
+    rp = &msdp->trace[msdp->trace_head++ & (USB_MSD_TRACE_RECORDS - 1)];
+    rp->type = type;
+    rp->code = code;
+    rp->count = count;
+    rp->time = halGetCounterValue();
+    rp->arg0 = arg0;
+    rp->arg1 = arg1;
+
+    msd_trace_flush_i(msdp);
+}
+
+/**
+ * @brief Appends a record to the trace from a thread
+ */
+static void msd_trace(USBMassStorageDriver *msdp, uint8_t type, uint8_t code, uint16_t count,
+                      uint32_t arg0, uint32_t arg1) {
+
+    chSysLock();
+    msd_trace_i(msdp, type, code, count, arg0, arg1);
+    chSysUnlock();
+}
+
+/**
+ * @brief Trace end-point callback, sends the next records
+ */
+static void msd_trace_notification(USBDriver *usbp, usbep_t ep) {
+
+    USBMassStorageDriver *msdp = (USBMassStorageDriver *)usbp->in_params[ep];
+
+    if (msdp == NULL)
+        return;
+
+    chSysLockFromIsr();
+    msdp->trace_tail += msdp->trace_sending;
+    msdp->trace_sending = 0;
+    msd_trace_flush_i(msdp);
+    chSysUnlockFromIsr();
+}
+#endif /* USB_MSD_TRACE_LEVEL >= 1 */
 
 /**
  * @brief   USB device configured handler.
@@ -141,11 +365,42 @@ static const USBEndpointConfig ep_data_config = {
  */
 void msdConfigureHookI(USBMassStorageDriver *msdp)
 {
-    usbInitEndpointI(msdp->config->usbp, msdp->config->bulk_ep, &ep_data_config);
-    chBSemSignalI(&msdp->bsem);
+    usbInitEndpointI(msdp->config->usbp, msdp->config->bulk_ep, &msdp->ep_config);
+#if USB_MSD_TRACE_LEVEL >= 1
+    if (msdp->config->trace_ep != 0) {
+        /* a transfer cut by the bus reset is sent again */
+        usbInitEndpointI(msdp->config->usbp, msdp->config->trace_ep, &msdp->trace_ep_config);
+        msdp->trace_sending = 0;
+        msd_trace_i(msdp, MSD_TRACE_START, 0, 0, halGetCounterFrequency(), chTimeNow());
+    }
+#endif
+#if USB_MSD_STATS_LEVEL >= 1
+    msdp->stats.configured_time = chTimeNow();
+    msdp->stats.mount_latency = 0;
+#endif
+    msd_signal_i(msdp);
     chEvtBroadcastI(&msdp->evt_connected);
 }
 
+/**
+ * @brief Returns the driver bound to a mass storage interface, or NULL
+ */
+static USBMassStorageDriver *msd_find_driver(USBDriver *usbp, uint16_t interface) {
+
+    usbep_t ep;
+
+    /* in_params has USB_MAX_ENDPOINTS entries, indexed by the end-point */
+    for (ep = 1; ep < USB_MAX_ENDPOINTS; ep++) {
+        USBMassStorageDriver *msdp = (USBMassStorageDriver *)usbp->in_params[ep];
+
+        if ((usbp->epc[ep] != NULL) && (usbp->epc[ep]->in_cb == msd_handle_end_point_notification) &&
+            (msdp != NULL) && (msdp->config->interface_number == interface))
+            return msdp;
+    }
+
+    return NULL;
+}
+
 /**
  * @brief   Default requests hook.
  *
@@ -156,12 +411,15 @@ void msdConfigureHookI(USBMassStorageDriver *msdp)
  */
 bool_t msdRequestsHook(USBDriver *usbp) {
 
+    USBMassStorageDriver *msdp;
+
     /* check that the request is of type Class / Interface */
     if (((usbp->setup[0] & USB_RTYPE_TYPE_MASK) == USB_RTYPE_TYPE_CLASS) &&
         ((usbp->setup[0] & USB_RTYPE_RECIPIENT_MASK) == USB_RTYPE_RECIPIENT_INTERFACE)) {
 
-        /* check that the request is for interface 0 */
-        if (MSD_SETUP_INDEX(usbp->setup) != 0)
+        /* check that the request is for a mass storage interface */
+        msdp = msd_find_driver(usbp, MSD_SETUP_INDEX(usbp->setup));
+        if (msdp == NULL)
             return FALSE;
 
         /* act depending on bRequest = setup[1] */
@@ -175,11 +433,16 @@ bool_t msdRequestsHook(USBDriver *usbp) {
                 return FALSE;
             }
 
-            /* reset all endpoints */
-            /* TODO!*/
-            /* The device shall NAK the status stage of the device request until
-             * the Bulk-Only Mass Storage Reset is complete.
-             */
+            /* abort the transfer in progress, the thread then waits for a
+               new command block; the host clears the halts afterwards */
+            chSysLockFromIsr();
+            usbInitEndpointI(usbp, msdp->config->bulk_ep, &msdp->ep_config);
+            msdp->reset_pending = TRUE;
+            msd_signal_i(msdp);
+            chSysUnlockFromIsr();
+
+            /* the endpoint is ready, complete the status stage now */
+            usbSetupTransfer(usbp, NULL, 0, NULL);
             return TRUE;
         case MSD_GET_MAX_LUN:
             /* check that it is a DEV2HOST request */
@@ -203,39 +466,50 @@ bool_t msdRequestsHook(USBDriver *usbp) {
     return FALSE;
 }
 
-/**
- * @brief Wait until the end-point interrupt handler has been called
- */
-static void msd_wait_for_isr(USBMassStorageDriver *msdp) {
-
-    /* sleep until it completes */
-    chSysLock();
-    chBSemWaitS(&msdp->bsem);
-    chSysUnlock();
-}
-
 /**
  * @brief Called when data can be read or written on the endpoint -- wakes the thread up
  */
 static void msd_handle_end_point_notification(USBDriver *usbp, usbep_t ep) {
 
-    (void)usbp;
-    (void)ep;
+    MSD_CYCLES_BEGIN(start);
+    USBMassStorageDriver *msdp = (USBMassStorageDriver *)usbp->in_params[ep];
+
+    /* the transfer may complete while the driver stops */
+    if (msdp == NULL)
+        return;
 
     chSysLockFromIsr();
-    chBSemSignalI(&((USBMassStorageDriver *)usbp->in_params[ep])->bsem);
+#if USB_MSD_TRACE_LEVEL >= 2
+    msd_trace_i(msdp, MSD_TRACE_XFER_DONE, 0, 0, 0, 0);
+#endif
+    msd_signal_i(msdp);
+#if USB_MSD_USE_CYCLE_PROFILE
+    msdp->cycles_signal = USB_MSD_CYCLES();
+    msdp->cycles_signaled = TRUE;
+#endif
+    MSD_CYCLES_END(msdp, MSD_PHASE_ISR, start);
     chSysUnlockFromIsr();
 }
 
 /**
  * @brief Starts sending data
+ * @note  Nothing is sent once a reset is pending, the thread has been woken
+ *        up by the reset.
  */
 static void msd_start_transmit(USBMassStorageDriver *msdp, const uint8_t* buffer, size_t size) {
 
+    MSD_CYCLES_BEGIN(start);
+
     usbPrepareTransmit(msdp->config->usbp, msdp->config->bulk_ep, buffer, size);
     chSysLock();
-    usbStartTransmitI(msdp->config->usbp, msdp->config->bulk_ep);
+#if USB_MSD_TRACE_LEVEL >= 2
+    msd_trace_i(msdp, MSD_TRACE_XFER, 1, 0, size, 0);
+#endif
+    if (!msdp->reset_pending)
+        usbStartTransmitI(msdp->config->usbp, msdp->config->bulk_ep);
     chSysUnlock();
+
+    MSD_CYCLES_END(msdp, MSD_PHASE_USB, start);
 }
 
 /**
@@ -243,10 +517,18 @@ static void msd_start_transmit(USBMassStorageDriver *msdp, const uint8_t* buffer
  */
 static void msd_start_receive(USBMassStorageDriver *msdp, uint8_t* buffer, size_t size) {
 
+    MSD_CYCLES_BEGIN(start);
+
     usbPrepareReceive(msdp->config->usbp, msdp->config->bulk_ep, buffer, size);
     chSysLock();
-    usbStartReceiveI(msdp->config->usbp, msdp->config->bulk_ep);
+#if USB_MSD_TRACE_LEVEL >= 2
+    msd_trace_i(msdp, MSD_TRACE_XFER, 0, 0, size, 0);
+#endif
+    if (!msdp->reset_pending)
+        usbStartReceiveI(msdp->config->usbp, msdp->config->bulk_ep);
     chSysUnlock();
+
+    MSD_CYCLES_END(msdp, MSD_PHASE_USB, start);
 }
 
 /**
@@ -258,45 +540,161 @@ static inline void msd_scsi_set_sense(USBMassStorageDriver *msdp, uint8_t key, u
     msdp->sense.byte[13] = aqual;
 }
 
+/**
+ * @brief Checks the data phase of the command against the one the host expects
+ * @details The Bulk-Only Transport cases where the host expects no data, data
+ *          in the other direction or less data than the device intends (Hn<Di,
+ *          Hn<Do, Hi<Di, Hi<>Do, Ho<>Di, Ho<Do) end the command with a phase
+ *          error and no data. The host expecting more data (Hi>Di, Ho>Do) is
+ *          handled by @p msd_send_status().
+ *
+ * @param[in] in        TRUE for a data phase to the host
+ * @param[in] length    number of bytes the device intends to transfer, not zero
+ * @return              TRUE if the data phase can proceed.
+ */
+static bool_t msd_check_data_phase(USBMassStorageDriver *msdp, bool_t in, uint32_t length) {
+
+    msd_cbw_t *cbw = &(msdp->cbw);
+    bool_t host_in = (cbw->flags & 0x80) != 0;
+
+    if ((cbw->data_len > 0) && (host_in == in) && (length <= cbw->data_len))
+        return TRUE;
+
+    msdp->phase_error = TRUE;
+    msdp->result = FALSE;
+    return FALSE;
+}
+
+/**
+ * @brief Sends a response to the host, truncated to the allocation length
+ * @details The response is sent straight from its buffer, which must stay
+ *          valid until the transfer completes.
+ *
+ * @return              TRUE if there is a data phase to wait for.
+ */
+static bool_t msd_scsi_transmit_response(USBMassStorageDriver *msdp, const uint8_t *data, size_t size, size_t alloc_len) {
+
+    if (size > alloc_len)
+        size = alloc_len;
+
+    msdp->result = TRUE;
+
+    if (size == 0) {
+        /* nothing to send, don't wait for ISR */
+        return FALSE;
+    }
+
+    if (!msd_check_data_phase(msdp, TRUE, size))
+        return FALSE;
+
+    msd_start_transmit(msdp, data, size);
+    msdp->data_moved = size;
+    msdp->state = MSD_SEND_STATUS;
+
+    /* wait for ISR */
+    return TRUE;
+}
+
+/**
+ * @brief Builds the responses that only depend on the media
+ * @details Called when the media is attached, so that the host probe commands
+ *          are served without any processing.
+ */
+static void msd_scsi_build_responses(USBMassStorageDriver *msdp) {
+
+    msd_scsi_responses_t *responses = &msdp->responses;
+
+    responses->read_capacity_10.block_size = swap_uint32(MSD_BLOCK_SIZE(msdp));
+    responses->read_capacity_10.last_block_addr = swap_uint32(msdp->block_dev_info.blk_num - 1);
+
+#if USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES
+    responses->read_format_capacities.reserved[0] = 0;
+    responses->read_format_capacities.reserved[1] = 0;
+    responses->read_format_capacities.reserved[2] = 0;
+    responses->read_format_capacities.capacity_list_length = 8;
+    responses->read_format_capacities.block_count = swap_uint32(msdp->block_dev_info.blk_num);
+    responses->read_format_capacities.desc_and_block_length = swap_uint32((0x02 << 24) | (MSD_BLOCK_SIZE(msdp) & 0x00FFFFFF));
+#endif
+
+#if USB_MSD_USE_CMD_MODE_SENSE_6
+    responses->mode_sense_6[0] = 0x03; /* number of bytes that follow */
+    responses->mode_sense_6[1] = 0x00; /* medium type is SBC          */
+    responses->mode_sense_6[2] = blkIsWriteProtected(msdp->config->bbdp) ? 0x80 : 0x00;
+    responses->mode_sense_6[3] = 0x00; /* no block descriptor         */
+#endif
+}
+
+#if USB_MSD_USE_VPD
+/**
+ * @brief Builds a vital product data page, NULL if it is not supported
+ */
+static const uint8_t *msd_scsi_vpd_page(USBMassStorageDriver *msdp, uint8_t page_code, size_t *size) {
+
+    const char *serial = msdp->config->serial_number;
+    uint8_t *page = msdp->responses.vpd_page;
+    uint8_t len = 0;
+
+    switch (page_code) {
+    case 0x00:
+        /* supported pages */
+        page[4 + len++] = 0x00;
+        if (serial != NULL)
+            page[4 + len++] = 0x80;
+        break;
+    case 0x80:
+        /* unit serial number */
+        if (serial == NULL)
+            return NULL;
+        while ((len < MSD_VPD_SERIAL_SIZE) && (serial[len] != '\0')) {
+            page[4 + len] = (uint8_t)serial[len];
+            len++;
+        }
+        break;
+    default:
+        return NULL;
+    }
+
+    page[0] = 0x00; /* direct access block device */
+    page[1] = page_code;
+    page[2] = 0x00;
+    page[3] = len;
+    *size = 4 + len;
+    return page;
+}
+#endif /* USB_MSD_USE_VPD */
+
 /**
  * @brief Processes an INQUIRY SCSI command
  */
 bool_t msd_scsi_process_inquiry(USBMassStorageDriver *msdp) {
 
     msd_cbw_t *cbw = &(msdp->cbw);
+    size_t alloc_len = (cbw->scsi_cmd_data[3] << 8) | cbw->scsi_cmd_data[4];
 
     /* check the EVPD bit (Vital Product Data) */
     if (cbw->scsi_cmd_data[1] & 0x01) {
 
+#if USB_MSD_USE_VPD
         /* check the Page Code byte to know the type of product data to reply */
-        switch (cbw->scsi_cmd_data[2]) {
-
-        /* unit serial number */
-        case 0x80: {
-            uint8_t response[] = {'0'}; /* TODO */
-            msd_start_transmit(msdp, response, sizeof(response));
-            msdp->result = TRUE;
+        size_t size;
+        const uint8_t *page = msd_scsi_vpd_page(msdp, cbw->scsi_cmd_data[2], &size);
 
-            /* wait for ISR */
-            return TRUE;
-        }
+        if (page != NULL)
+            return msd_scsi_transmit_response(msdp, page, size, alloc_len);
+#endif
 
         /* unhandled */
-        default:
-            msd_scsi_set_sense(msdp,
-                               SCSI_SENSE_KEY_ILLEGAL_REQUEST,
-                               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
-                               SCSI_ASENSEQ_NO_QUALIFIER);
-            return FALSE;
-        }
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                           SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->result = FALSE;
+        return FALSE;
     }
     else
     {
-        msd_start_transmit(msdp, (const uint8_t *)&msdp->inquiry, sizeof(msdp->inquiry));
-        msdp->result = TRUE;
-
-        /* wait for ISR */
-        return TRUE;
+        return msd_scsi_transmit_response(msdp, (const uint8_t *)&msdp->inquiry,
+                                          sizeof(msdp->inquiry), alloc_len);
     }
 }
 
@@ -305,14 +703,9 @@ bool_t msd_scsi_process_inquiry(USBMassStorageDriver *msdp) {
  */
 bool_t msd_scsi_process_request_sense(USBMassStorageDriver *msdp) {
 
-    msd_start_transmit(msdp, (const uint8_t *)&msdp->sense, sizeof(msdp->sense));
-    msdp->result = TRUE;
-
-    /* wait for ISR immediately, otherwise the caller may reset the sense bytes before they are sent to the host! */
-    msd_wait_for_isr(msdp);
-
-    /* ... don't wait for ISR, we just did it */
-    return FALSE;
+    /* the sense bytes are only reset in the status phase, once they are sent */
+    return msd_scsi_transmit_response(msdp, (const uint8_t *)&msdp->sense,
+                                      sizeof(msdp->sense), msdp->cbw.scsi_cmd_data[4]);
 }
 
 /**
@@ -320,18 +713,12 @@ bool_t msd_scsi_process_request_sense(USBMassStorageDriver *msdp) {
  */
 bool_t msd_scsi_process_read_capacity_10(USBMassStorageDriver *msdp) {
 
-    static msd_scsi_read_capacity_10_response_t response;
-
-    response.block_size = swap_uint32(msdp->block_dev_info.blk_size);
-    response.last_block_addr = swap_uint32(msdp->block_dev_info.blk_num-1);
-
-    msd_start_transmit(msdp, (const uint8_t *)&response, sizeof(response));
-    msdp->result = TRUE;
-
-    /* wait for ISR */
-    return TRUE;
+    return msd_scsi_transmit_response(msdp, (const uint8_t *)&msdp->responses.read_capacity_10,
+                                      sizeof(msdp->responses.read_capacity_10),
+                                      sizeof(msdp->responses.read_capacity_10));
 }
 
+#if USB_MSD_USE_CMD_SEND_DIAGNOSTIC
 /**
  * @brief Processes a SEND_DIAGNOSTIC SCSI command
  */
@@ -355,136 +742,1208 @@ bool_t msd_scsi_process_send_diagnostic(USBMassStorageDriver *msdp) {
     /* don't wait for ISR */
     return FALSE;
 }
+#endif /* USB_MSD_USE_CMD_SEND_DIAGNOSTIC */
 
+#if USB_MSD_USE_METADATA_CACHE
 /**
- * @brief Processes a READ_WRITE_10 SCSI command
+ * @brief Block address of a free cache slot
  */
-bool_t msd_scsi_process_start_read_write_10(USBMassStorageDriver *msdp) {
+#define MSD_CACHE_FREE 0xFFFFFFFF
 
-    msd_cbw_t *cbw = &(msdp->cbw);
+/**
+ * @brief Little-endian accessors for the on-disk structures
+ */
+#define msd_le16(p) ((uint16_t)((p)[0] | ((p)[1] << 8)))
+#define msd_le32(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
 
-    if ((cbw->scsi_cmd_data[0] == SCSI_CMD_WRITE_10) && blkIsWriteProtected(msdp->config->bbdp)) {
-        /* device is write protected and a write has been issued */
-        /* block address is invalid, update SENSE key and return command fail */
-        msd_scsi_set_sense(msdp,
-                           SCSI_SENSE_KEY_DATA_PROTECT,
-                           SCSI_ASENSE_WRITE_PROTECTED,
-                           SCSI_ASENSEQ_NO_QUALIFIER);
-        msdp->result = FALSE;
+/**
+ * @brief Checks if a block belongs to the volume metadata
+ */
+static bool_t msd_cache_is_metadata(USBMassStorageDriver *msdp, uint32_t blk) {
 
-        /* don't wait for ISR */
+    msd_metadata_cache_t *cache = &msdp->cache;
+
+    if (MSD_BLOCK_SIZE(msdp) != 512)
         return FALSE;
-    }
 
-    uint32_t rw_block_address = swap_uint32(*(uint32_t *)&cbw->scsi_cmd_data[2]);
-    uint16_t total = swap_uint16(*(uint16_t *)&cbw->scsi_cmd_data[7]);
-    uint16_t i = 0;
+    return (blk == 0) ||
+           (blk == cache->boot_blk) ||
+           ((blk >= cache->fat_start) && (blk < cache->fat_end)) ||
+           ((blk >= cache->root_start) && (blk < cache->root_end));
+}
 
-    if (rw_block_address >= msdp->block_dev_info.blk_num) {
-        /* block address is invalid, update SENSE key and return command fail */
-        msd_scsi_set_sense(msdp,
-                           SCSI_SENSE_KEY_ILLEGAL_REQUEST,
-                           SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
-                           SCSI_ASENSEQ_NO_QUALIFIER);
-        msdp->result = FALSE;
+/**
+ * @brief Locates the FAT and root directory of the exported volume
+ * @details Handles both partitioned media (MBR, first partition) and
+ *          unpartitioned ones. The cache stays disabled, with empty
+ *          regions, if no FAT volume is found.
+ */
+static void msd_cache_locate_metadata(USBMassStorageDriver *msdp, uint8_t *buffer) {
+
+    msd_metadata_cache_t *cache = &msdp->cache;
+    uint32_t i;
+
+    cache->boot_blk = 0;
+    cache->fat_start = cache->fat_end = 0;
+    cache->root_start = cache->root_end = 0;
+    cache->use_counter = 0;
+    cache->dirty_count = 0;
+    cache->warm_count = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    for (i = 0; i < USB_MSD_METADATA_CACHE_BLOCKS; i++) {
+        cache->slots[i].blk = MSD_CACHE_FREE;
+        cache->slots[i].dirty = FALSE;
+    }
 
-        /* don't wait for ISR */
-        return FALSE;
+    if ((MSD_BLOCK_SIZE(msdp) != 512) ||
+        (blkRead(msdp->config->bbdp, 0, buffer, 1) == CH_FAILED) ||
+        (buffer[510] != 0x55) || (buffer[511] != 0xAA))
+        return;
+
+    /* a boot sector starts with a jump instruction, a MBR doesn't */
+    if ((buffer[0] != 0xEB) && (buffer[0] != 0xE9)) {
+        cache->boot_blk = msd_le32(&buffer[0x1BE + 8]);
+        if ((buffer[0x1BE + 4] == 0) || (cache->boot_blk == 0) ||
+            (blkRead(msdp->config->bbdp, cache->boot_blk, buffer, 1) == CH_FAILED))
+            return;
     }
 
-    if (cbw->scsi_cmd_data[0] == SCSI_CMD_WRITE_10) {
-        /* process a write command */
+    /* parse the BIOS parameter block */
+    uint32_t bytes_per_sector = msd_le16(&buffer[11]);
+    uint32_t sectors_per_cluster = buffer[13];
+    uint32_t reserved = msd_le16(&buffer[14]);
+    uint32_t fat_count = buffer[16];
+    uint32_t root_entries = msd_le16(&buffer[17]);
+    uint32_t fat_size = msd_le16(&buffer[22]);
+    if (fat_size == 0)
+        fat_size = msd_le32(&buffer[36]);
+
+    if ((bytes_per_sector != 512) || (sectors_per_cluster == 0) || (fat_count == 0) || (fat_size == 0))
+        return;
+
+    cache->fat_start = cache->boot_blk + reserved;
+    cache->fat_end = cache->fat_start + fat_count * fat_size;
+
+    if (root_entries != 0) {
+        /* FAT12/16, fixed root directory after the FATs */
+        cache->root_start = cache->fat_end;
+        cache->root_end = cache->root_start + (root_entries * 32 + 511) / 512;
+    } else {
+        /* FAT32, first cluster of the root directory chain */
+        cache->root_start = cache->fat_end + (msd_le32(&buffer[44]) - 2) * sectors_per_cluster;
+        cache->root_end = cache->root_start + sectors_per_cluster;
+    }
+}
 
-        /* get the first packet */
-        msd_start_receive(msdp, rw_buf[i % 2], msdp->block_dev_info.blk_size);
-        msd_wait_for_isr(msdp);
+/**
+ * @brief Returns the cache slot holding a block, or -1
+ */
+static int32_t msd_cache_lookup(USBMassStorageDriver *msdp, uint32_t blk) {
 
-        /* loop over each block */
-        for (i = 0; i < total; i++) {
+    uint32_t i;
 
-            if (i < (total - 1)) {
-                /* there is at least one block of data left to be read over USB */
-                /* queue this read before issuing the blocking write */
-                msd_start_receive(msdp, rw_buf[(i + 1) % 2], msdp->block_dev_info.blk_size);
-            }
+    for (i = 0; i < USB_MSD_METADATA_CACHE_BLOCKS; i++)
+        if (msdp->cache.slots[i].blk == blk)
+            return (int32_t)i;
+
+    return -1;
+}
 
-            /* now write the block to the block device */
-            if (blkWrite(msdp->config->bbdp, rw_block_address++, rw_buf[i % 2], 1) == CH_FAILED) {
-                /* write failed */
-                msd_scsi_set_sense(msdp,
-                                   SCSI_SENSE_KEY_MEDIUM_ERROR,
-                                   SCSI_ASENSE_WRITE_FAULT,
-                                   SCSI_ASENSEQ_NO_QUALIFIER);
-                msdp->result = FALSE;
+/**
+ * @brief Allocates a cache slot for a block, evicting the least recently used one
+ */
+static int32_t msd_cache_allocate(USBMassStorageDriver *msdp, uint32_t blk) {
 
-                /* don't wait for ISR */
-                return FALSE;
-            }
+    msd_metadata_cache_t *cache = &msdp->cache;
+    uint32_t victim = 0;
+    uint32_t i;
 
-            if (i < (total - 1)) {
-                /* now wait for the USB event to complete */
-                msd_wait_for_isr(msdp);
-            }
+    for (i = 0; i < USB_MSD_METADATA_CACHE_BLOCKS; i++) {
+        if (cache->slots[i].blk == MSD_CACHE_FREE) {
+            victim = i;
+            break;
         }
-    } else {
-        /* process a read command */
+        if (cache->slots[i].last_use < cache->slots[victim].last_use)
+            victim = i;
+    }
 
-        i = 0;
+    msd_cache_slot_t *slot = &cache->slots[victim];
+#if USB_MSD_USE_WARMUP
+    if ((slot->blk != MSD_CACHE_FREE) && !msd_cache_is_metadata(msdp, slot->blk))
+        cache->warm_count--;
+#endif
+    if (slot->dirty) {
+        if (blkWrite(msdp->config->bbdp, slot->blk, cache->data[victim], 1) == CH_FAILED)
+            return -1;
+        slot->dirty = FALSE;
+        cache->dirty_count--;
+    }
 
-        /* read the first block from block device */
-        if (blkRead(msdp->config->bbdp, rw_block_address++, rw_buf[i % 2], 1) == CH_FAILED) {
-            /* read failed */
-            msd_scsi_set_sense(msdp,
-                               SCSI_SENSE_KEY_MEDIUM_ERROR,
-                               SCSI_ASENSE_READ_ERROR,
-                               SCSI_ASENSEQ_NO_QUALIFIER);
-            msdp->result = FALSE;
+    slot->blk = blk;
+    return (int32_t)victim;
+}
 
-            /* don't wait for ISR */
-            return FALSE;
-        }
+/**
+ * @brief Writes the dirty metadata blocks back to the block device
+ */
+static bool_t msd_cache_flush(USBMassStorageDriver *msdp) {
 
-        /* loop over each block */
-        for (i = 0; i < total; i++) {
-            /* transmit the block */
-            msd_start_transmit(msdp, rw_buf[i % 2], msdp->block_dev_info.blk_size);
-
-            if (i < (total - 1)) {
-                /* there is at least one more block to be read from device */
-                /* so read that whilst the USB transfer takes place */
-                if (blkRead(msdp->config->bbdp, rw_block_address++, rw_buf[(i + 1) % 2], 1) == CH_FAILED) {
-                    /* read failed */
-                    msd_scsi_set_sense(msdp,
-                                       SCSI_SENSE_KEY_MEDIUM_ERROR,
-                                       SCSI_ASENSE_READ_ERROR,
-                                       SCSI_ASENSEQ_NO_QUALIFIER);
-                    msdp->result = FALSE;
-
-                    /* wait for ISR (the previous transmission is still running) */
-                    return TRUE;
-                }
-            }
+    msd_metadata_cache_t *cache = &msdp->cache;
+    bool_t result = CH_SUCCESS;
+    uint32_t i;
 
-            /* wait for the USB event to complete */
-            msd_wait_for_isr(msdp);
+    if (cache->dirty_count == 0)
+        return CH_SUCCESS;
+
+    for (i = 0; i < USB_MSD_METADATA_CACHE_BLOCKS; i++) {
+        msd_cache_slot_t *slot = &cache->slots[i];
+        if (slot->dirty) {
+            if (blkWrite(msdp->config->bbdp, slot->blk, cache->data[i], 1) == CH_FAILED) {
+                result = CH_FAILED;
+                continue;
+            }
+            slot->dirty = FALSE;
+            cache->dirty_count--;
         }
     }
 
-    msdp->result = TRUE;
+    if (blkSync(msdp->config->bbdp) == CH_FAILED)
+        result = CH_FAILED;
 
-    /* don't wait for ISR */
+    return result;
+}
+
+/**
+ * @brief Checks if a range of blocks needs to go through the cache
+ */
+static bool_t msd_cache_intersects(USBMassStorageDriver *msdp, uint32_t blk, uint32_t n) {
+
+    msd_metadata_cache_t *cache = &msdp->cache;
+    uint32_t end = blk + n;
+
+    if (MSD_BLOCK_SIZE(msdp) != 512)
+        return FALSE;
+
+#if USB_MSD_USE_WARMUP
+    /* pre-loaded data blocks are within the configured ranges, the default
+       ones only hold metadata */
+    if ((cache->warm_count > 0) && (msdp->config->warmup_ranges != NULL)) {
+        const msd_block_range_t *range = msdp->config->warmup_ranges;
+        size_t i;
+
+        for (i = 0; i < msdp->config->warmup_range_count; i++, range++)
+            if ((blk < range->start + range->count) && (range->start < end))
+                return TRUE;
+    }
+#endif
+
+    return (blk == 0) ||
+           ((cache->boot_blk >= blk) && (cache->boot_blk < end)) ||
+           ((blk < cache->fat_end) && (cache->fat_start < end)) ||
+           ((blk < cache->root_end) && (cache->root_start < end));
+}
+
+/**
+ * @brief Reads a block from the media, through the cache
+ */
+static bool_t msd_media_read_block(USBMassStorageDriver *msdp, uint32_t blk, uint8_t *buffer) {
+
+#if USB_MSD_USE_WARMUP
+#if USB_MSD_STATS_LEVEL >= 1
+    /* the host mounts the volume when it reads the root directory */
+    if ((msdp->stats.mount_latency == 0) &&
+        (blk >= msdp->cache.root_start) && (blk < msdp->cache.root_end))
+        msdp->stats.mount_latency = chTimeNow() - msdp->stats.configured_time;
+#endif
+
+    if (msdp->cache.warm_count > 0 && !msd_cache_is_metadata(msdp, blk)) {
+        /* pre-loaded data block, served once and released */
+        int32_t i = msd_cache_lookup(msdp, blk);
+        if (i >= 0) {
+            memcpy(buffer, msdp->cache.data[i], 512);
+            msdp->cache.slots[i].blk = MSD_CACHE_FREE;
+            msdp->cache.warm_count--;
+            msdp->cache.hits++;
+            return CH_SUCCESS;
+        }
+    }
+#endif
+
+    if (msd_cache_is_metadata(msdp, blk)) {
+        msd_metadata_cache_t *cache = &msdp->cache;
+        int32_t i = msd_cache_lookup(msdp, blk);
+
+        if (i < 0) {
+            cache->misses++;
+            if ((i = msd_cache_allocate(msdp, blk)) < 0)
+                return CH_FAILED;
+            if (blkRead(msdp->config->bbdp, blk, cache->data[i], 1) == CH_FAILED) {
+                cache->slots[i].blk = MSD_CACHE_FREE;
+                return CH_FAILED;
+            }
+        } else {
+            cache->hits++;
+        }
+
+        cache->slots[i].last_use = ++cache->use_counter;
+        memcpy(buffer, cache->data[i], 512);
+        return CH_SUCCESS;
+    }
+
+    return blkRead(msdp->config->bbdp, blk, buffer, 1);
+}
+
+/**
+ * @brief Writes a block to the media, through the cache
+ */
+static bool_t msd_media_write_block(USBMassStorageDriver *msdp, uint32_t blk, const uint8_t *buffer) {
+
+#if USB_MSD_USE_WARMUP
+    if (msdp->cache.warm_count > 0 && !msd_cache_is_metadata(msdp, blk)) {
+        /* drop the stale pre-loaded copy */
+        int32_t i = msd_cache_lookup(msdp, blk);
+        if (i >= 0) {
+            msdp->cache.slots[i].blk = MSD_CACHE_FREE;
+            msdp->cache.warm_count--;
+        }
+    }
+#endif
+
+    if (msd_cache_is_metadata(msdp, blk)) {
+        msd_metadata_cache_t *cache = &msdp->cache;
+        int32_t i = msd_cache_lookup(msdp, blk);
+
+        if (i < 0) {
+            cache->misses++;
+            if ((i = msd_cache_allocate(msdp, blk)) < 0)
+                return CH_FAILED;
+        } else {
+            cache->hits++;
+        }
+
+        /* write-back, flushed when the host goes idle */
+        if (!cache->slots[i].dirty) {
+            cache->slots[i].dirty = TRUE;
+            cache->dirty_count++;
+        }
+        cache->slots[i].last_use = ++cache->use_counter;
+        memcpy(cache->data[i], buffer, 512);
+        return CH_SUCCESS;
+    }
+
+    return blkWrite(msdp->config->bbdp, blk, buffer, 1);
+}
+#endif /* USB_MSD_USE_METADATA_CACHE */
+
+/**
+ * @brief Reads a range of blocks from the media
+ */
+static bool_t msd_media_read_range(USBMassStorageDriver *msdp, uint32_t blk, uint8_t *buffer, uint32_t n) {
+
+#if USB_MSD_USE_METADATA_CACHE
+    if (msd_cache_intersects(msdp, blk, n)) {
+        /* go block by block, only when the cache is concerned */
+        for (; n > 0; n--, blk++, buffer += 512)
+            if (msd_media_read_block(msdp, blk, buffer) == CH_FAILED)
+                return CH_FAILED;
+        return CH_SUCCESS;
+    }
+#endif
+
+    return blkRead(msdp->config->bbdp, blk, buffer, n);
+}
+
+/**
+ * @brief Writes a range of blocks to the media
+ */
+static bool_t msd_media_write_range(USBMassStorageDriver *msdp, uint32_t blk, const uint8_t *buffer, uint32_t n) {
+
+#if USB_MSD_USE_METADATA_CACHE
+    if (msd_cache_intersects(msdp, blk, n)) {
+        for (; n > 0; n--, blk++, buffer += 512)
+            if (msd_media_write_block(msdp, blk, buffer) == CH_FAILED)
+                return CH_FAILED;
+        return CH_SUCCESS;
+    }
+#endif
+
+    return blkWrite(msdp->config->bbdp, blk, buffer, n);
+}
+
+#if USB_MSD_USE_WATCHDOG
+/**
+ * @brief Media worker thread, runs the block device accesses
+ */
+static msg_t msd_media_thread(void *arg) {
+
+    USBMassStorageDriver *msdp = (USBMassStorageDriver *)arg;
+    bool_t result;
+
+    chRegSetThreadName("USB-MSD media");
+
+    while (TRUE) {
+        chBSemWait(&msdp->media_start);
+        if (chThdShouldTerminate())
+            break;
+
+        if (msdp->media_write)
+            result = msd_media_write_range(msdp, msdp->media_blk, msdp->media_buffer, msdp->media_count);
+        else
+            result = msd_media_read_range(msdp, msdp->media_blk, msdp->media_buffer, msdp->media_count);
+
+        chSysLock();
+        msdp->media_result = result;
+        msdp->media_busy = FALSE;
+        chBSemSignalI(&msdp->media_done);
+        chSchRescheduleS();
+        chSysUnlock();
+    }
+
+    return 0;
+}
+#endif /* USB_MSD_USE_WATCHDOG */
+
+/**
+ * @brief Transfers a range of blocks, within the media time budget of the command
+ * @details Only the time spent in the media accesses of the command counts,
+ *          once the budget is spent the access is abandoned to the worker
+ *          thread and the command fails.
+ */
+static bool_t msd_media_access(USBMassStorageDriver *msdp, bool_t write, uint32_t blk, uint8_t *buffer, uint32_t n) {
+
+#if USB_MSD_USE_WATCHDOG
+    systime_t timeout = msdp->config->media_timeout;
+
+    if (timeout != 0) {
+        systime_t start = chTimeNow();
+
+        /* the previous access has not returned yet */
+        if (msdp->media_busy)
+            return CH_FAILED;
+
+        /* the budget is spent, don't start an access that can't be waited for */
+        if (msdp->media_time >= timeout) {
+            msdp->media_timed_out = TRUE;
+#if USB_MSD_STATS_LEVEL >= 1
+            msdp->stats.media_timeouts++;
+#endif
+            return CH_FAILED;
+        }
+
+        msdp->media_write = write;
+        msdp->media_blk = blk;
+        msdp->media_buffer = buffer;
+        msdp->media_count = n;
+
+        chSysLock();
+        msdp->media_busy = TRUE;
+        chBSemResetI(&msdp->media_done, TRUE);
+        chBSemSignalI(&msdp->media_start);
+        msg_t msg = chBSemWaitTimeoutS(&msdp->media_done, timeout - msdp->media_time);
+        chSysUnlock();
+
+        msdp->media_time += chTimeNow() - start;
+
+        /* abandoned on timeout, or because the driver stops */
+        if (msdp->media_busy) {
+            if (msg == RDY_TIMEOUT) {
+                msdp->media_timed_out = TRUE;
+#if USB_MSD_STATS_LEVEL >= 1
+                msdp->stats.media_timeouts++;
+#endif
+            }
+            return CH_FAILED;
+        }
+
+        return msdp->media_result;
+    }
+#endif
+
+    if (write)
+        return msd_media_write_range(msdp, blk, buffer, n);
+    return msd_media_read_range(msdp, blk, buffer, n);
+}
+
+/**
+ * @brief Accesses the media for a READ_10 or WRITE_10, tracing the access
+ */
+static bool_t msd_media_transfer(USBMassStorageDriver *msdp, bool_t write, uint32_t blk, uint8_t *buffer, uint32_t n) {
+
+    MSD_CYCLES_BEGIN(cycles);
+#if USB_MSD_TRACE_LEVEL >= 2
+    halrtcnt_t start = halGetCounterValue();
+#endif
+    bool_t result = msd_media_access(msdp, write, blk, buffer, n);
+
+    MSD_CYCLES_END(msdp, MSD_PHASE_MEDIA, cycles);
+#if USB_MSD_TRACE_LEVEL >= 2
+    msd_trace(msdp, MSD_TRACE_MEDIA, (write ? 0x01 : 0x00) | ((result == CH_FAILED) ? 0x80 : 0x00),
+              (uint16_t)n, blk, halGetCounterValue() - start);
+#endif
+    return result;
+}
+
+/**
+ * @brief Fails a READ_10 or WRITE_10 whose media access failed
+ * @details The sense is ABORTED COMMAND when the media watchdog fired.
+ */
+static void msd_scsi_media_error(USBMassStorageDriver *msdp, uint8_t acode) {
+
+#if USB_MSD_USE_WATCHDOG
+    if (msdp->media_timed_out) {
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_ABORTED_COMMAND,
+                           SCSI_ASENSE_COMMAND_TIMEOUT,
+                           SCSI_ASENSEQ_TIMEOUT_DURING_PROCESSING);
+        msdp->result = FALSE;
+        return;
+    }
+#endif
+
+    msd_scsi_set_sense(msdp,
+                       SCSI_SENSE_KEY_MEDIUM_ERROR,
+                       acode,
+                       SCSI_ASENSEQ_NO_QUALIFIER);
+    msdp->result = FALSE;
+#if USB_MSD_STATS_LEVEL >= 2
+    if (msdp->cbw.scsi_cmd_data[0] == SCSI_CMD_READ_10)
+        msdp->stats.read_errors++;
+    else
+        msdp->stats.write_errors++;
+#endif
+}
+
+/**
+ * @brief Preemption point of the data transfers
+ * @details Yields to the threads of the same priority, or sleeps one tick
+ *          once the command has used its time budget.
+ */
+static void msd_preempt(USBMassStorageDriver *msdp) {
+
+    const USBMassStorageConfig *config = msdp->config;
+
+    if ((config->command_budget != 0) && (chTimeNow() - msdp->command_start >= config->command_budget))
+        chThdSleep(1);
+    else if (config->yield_blocks != 0)
+        chThdYield();
+}
+
+/**
+ * @brief Returns the number of blocks to transfer before the next preemption point
+ */
+static uint32_t msd_preemption_count(USBMassStorageDriver *msdp, uint32_t n) {
+
+    uint32_t yield_blocks = msdp->config->yield_blocks;
+
+    return ((yield_blocks != 0) && (n > yield_blocks)) ? yield_blocks : n;
+}
+
+#if USB_MSD_USE_QOS
+/**
+ * @brief Takes tokens from a bucket, sleeping while it is in debt
+ */
+static void msd_qos_consume(USBMassStorageDriver *msdp, msd_token_bucket_t *bucket, uint32_t amount) {
+
+    uint32_t rate = bucket->rate;
+
+    if (rate == 0)
+        return;
+
+    /* refill with the tokens earned since the last time */
+    systime_t now = chTimeNow();
+    int64_t tokens = bucket->tokens + ((uint64_t)rate * (systime_t)(now - bucket->last_refill)) / CH_FREQUENCY;
+    int64_t burst = ((uint64_t)rate * USB_MSD_QOS_BURST) / CH_FREQUENCY;
+    if (tokens > burst)
+        tokens = burst;
+    tokens -= amount;
+
+    bucket->tokens = (int32_t)tokens;
+    bucket->last_refill = now;
+
+    if (tokens < 0) {
+        /* wait until the debt is paid back */
+        systime_t delay = (systime_t)((-tokens * CH_FREQUENCY + rate - 1) / rate);
+        chThdSleep(delay);
+        msdp->qos.throttled_time += delay;
+    }
+}
+
+/**
+ * @brief Defers the host I/O while the firmware accesses the media
+ */
+static void msd_qos_defer(USBMassStorageDriver *msdp) {
+
+    msd_qos_t *qos = &msdp->qos;
+    systime_t start = chTimeNow();
+
+    chSysLock();
+    while (qos->firmware_priority && (qos->firmware_io > 0)) {
+        systime_t elapsed = chTimeNow() - start;
+        if (elapsed >= USB_MSD_QOS_MAX_DEFER)
+            break;
+        chBSemWaitTimeoutS(&qos->firmware_idle, USB_MSD_QOS_MAX_DEFER - elapsed);
+    }
+    chSysUnlock();
+
+    qos->deferred_time += chTimeNow() - start;
+}
+#endif /* USB_MSD_USE_QOS */
+
+/**
+ * @brief Reads blocks from the media, with preemption points
+ */
+static bool_t msd_media_read(USBMassStorageDriver *msdp, uint32_t blk, uint8_t *buffer, uint32_t n) {
+
+    while (n > 0) {
+        uint32_t count = msd_preemption_count(msdp, n);
+
+        if (msdp->stopping)
+            return CH_FAILED;
+
+#if USB_MSD_USE_QOS
+        msd_qos_defer(msdp);
+        msd_qos_consume(msdp, &msdp->qos.bandwidth, count * MSD_BLOCK_SIZE(msdp));
+#endif
+
+        if (msd_media_transfer(msdp, FALSE, blk, buffer, count) == CH_FAILED)
+            return CH_FAILED;
+
+        blk += count;
+        buffer += count * MSD_BLOCK_SIZE(msdp);
+        n -= count;
+
+        msd_preempt(msdp);
+    }
+
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Writes blocks to the media, with preemption points
+ */
+static bool_t msd_media_write(USBMassStorageDriver *msdp, uint32_t blk, const uint8_t *buffer, uint32_t n) {
+
+    while (n > 0) {
+        uint32_t count = msd_preemption_count(msdp, n);
+
+        if (msdp->stopping)
+            return CH_FAILED;
+
+#if USB_MSD_USE_QOS
+        msd_qos_defer(msdp);
+        msd_qos_consume(msdp, &msdp->qos.bandwidth, count * MSD_BLOCK_SIZE(msdp));
+#endif
+
+        if (msd_media_transfer(msdp, TRUE, blk, (uint8_t *)buffer, count) == CH_FAILED)
+            return CH_FAILED;
+
+        blk += count;
+        buffer += count * MSD_BLOCK_SIZE(msdp);
+        n -= count;
+
+        msd_preempt(msdp);
+    }
+
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Transmits the current READ_10 chunk, reading the next one meanwhile
+ */
+static bool_t msd_scsi_continue_read_10(USBMassStorageDriver *msdp) {
+
+    uint32_t count = msdp->rw_count;
+
+    /* transmit the chunk */
+    msd_start_transmit(msdp, msdp->rw_buf[msdp->rw_index], count * MSD_BLOCK_SIZE(msdp));
+    msdp->data_moved += count * MSD_BLOCK_SIZE(msdp);
+
+    msdp->rw_block_address += count;
+    msdp->rw_total -= count;
+    msdp->rw_count = (msdp->rw_total < USB_MSD_BUFFER_BLOCKS) ? msdp->rw_total : USB_MSD_BUFFER_BLOCKS;
+    msdp->rw_index ^= 1;
+#if USB_MSD_STATS_LEVEL >= 2
+    msdp->stats.read_blocks += count;
+#endif
+
+    /* the status is sent once the transmission completes */
+    msdp->state = MSD_SEND_STATUS;
+
+    if (msdp->rw_count > 0) {
+        /* there is at least one more chunk to be read from device */
+        /* so read that whilst the USB transfer takes place */
+        if (msd_media_read(msdp, msdp->rw_block_address, msdp->rw_buf[msdp->rw_index], msdp->rw_count) == CH_FAILED) {
+            /* read failed */
+            msd_scsi_media_error(msdp, SCSI_ASENSE_READ_ERROR);
+
+            /* wait for ISR (the previous transmission is still running) */
+            return TRUE;
+        }
+
+        msdp->state = MSD_READ_10;
+    } else {
+        msdp->result = TRUE;
+#if USB_MSD_STATS_LEVEL >= 2
+        msdp->stats.read_time += chTimeNow() - msdp->command_start;
+#endif
+    }
+
+    /* wait for the USB event to complete */
+    return TRUE;
+}
+
+/**
+ * @brief Writes the WRITE_10 chunk just received, receiving the next one meanwhile
+ */
+static bool_t msd_scsi_continue_write_10(USBMassStorageDriver *msdp) {
+
+    uint32_t count = msdp->rw_count;
+    uint8_t *buffer = msdp->rw_buf[msdp->rw_index];
+    uint32_t next = msdp->rw_total - count;
+
+    if (next > USB_MSD_BUFFER_BLOCKS)
+        next = USB_MSD_BUFFER_BLOCKS;
+
+    /* the chunk has been received */
+    msdp->data_moved += count * MSD_BLOCK_SIZE(msdp);
+    msdp->rw_index ^= 1;
+
+    if (next > 0) {
+        /* there is at least one chunk of data left to be read over USB */
+        /* queue this read before issuing the blocking write */
+        msd_start_receive(msdp, msdp->rw_buf[msdp->rw_index], next * MSD_BLOCK_SIZE(msdp));
+    }
+
+    /* now write the chunk to the block device */
+    if (msd_media_write(msdp, msdp->rw_block_address, buffer, count) == CH_FAILED) {
+        /* write failed */
+        msd_scsi_media_error(msdp, SCSI_ASENSE_WRITE_FAULT);
+        msdp->state = MSD_SEND_STATUS;
+
+        /* wait for the queued chunk, if any, it is received too */
+        msdp->data_moved += next * MSD_BLOCK_SIZE(msdp);
+        return (next > 0);
+    }
+
+    msdp->rw_block_address += count;
+    msdp->rw_total -= count;
+    msdp->rw_count = next;
+#if USB_MSD_STATS_LEVEL >= 2
+    msdp->stats.write_blocks += count;
+#endif
+
+    if (next > 0) {
+        /* now wait for the USB event to complete */
+        msdp->state = MSD_WRITE_10;
+        return TRUE;
+    }
+
+    msdp->result = TRUE;
+    msdp->state = MSD_SEND_STATUS;
+#if USB_MSD_STATS_LEVEL >= 2
+    msdp->stats.write_time += chTimeNow() - msdp->command_start;
+#endif
+
+    /* don't wait for ISR */
     return FALSE;
 }
 
+#if USB_MSD_USE_PROFILER
+/**
+ * @brief Accounts a READ_10 or WRITE_10 in the I/O pattern profile
+ */
+static void msd_profile_command(USBMassStorageDriver *msdp, bool_t write, uint32_t blk, uint32_t n) {
+
+    msd_profile_t *profile = &msdp->profile;
+    uint32_t *heat = write ? profile->write_heat : profile->read_heat;
+    uint32_t bucket_blocks = (msdp->block_dev_info.blk_num + USB_MSD_PROFILER_BUCKETS - 1) / USB_MSD_PROFILER_BUCKETS;
+    uint32_t size = 0;
+    uint32_t i, end;
+
+    /* the heatmap is reset when a volume of another size is attached */
+    if (profile->bucket_blocks != bucket_blocks) {
+        memset(profile->read_heat, 0, sizeof(profile->read_heat));
+        memset(profile->write_heat, 0, sizeof(profile->write_heat));
+        profile->bucket_blocks = bucket_blocks;
+    }
+
+    /* blocks accessed in each bucket the transfer spans */
+    for (i = blk; i < blk + n; i = end) {
+        end = (i / bucket_blocks + 1) * bucket_blocks;
+        if (end > blk + n)
+            end = blk + n;
+        heat[i / bucket_blocks] += end - i;
+    }
+
+    for (i = n; (i > 1) && (size < USB_MSD_PROFILER_SIZE_BUCKETS - 1); i >>= 1)
+        size++;
+    profile->sizes[size]++;
+
+    if (write) {
+        profile->writes++;
+        profile->write_blocks += n;
+    } else {
+        profile->reads++;
+        profile->read_blocks += n;
+    }
+
+    if (blk == profile->next_block)
+        profile->sequential++;
+    profile->next_block = blk + n;
+
+    for (i = 0; i < USB_MSD_PROFILER_ALIGNMENTS; i++) {
+        uint32_t alignment = msdp->config->profile_alignment[i];
+        if ((alignment != 0) && ((blk % alignment) == 0) && ((n % alignment) == 0))
+            profile->aligned[i]++;
+    }
+}
+#endif /* USB_MSD_USE_PROFILER */
+
+/**
+ * @brief Processes a READ_WRITE_10 SCSI command
+ * @details The blocks are transferred by chunks of up to
+ *          @p USB_MSD_BUFFER_BLOCKS, the block device working on one buffer
+ *          while the USB transfer uses the other one. The transfer goes on in
+ *          the @p MSD_READ_10 or @p MSD_WRITE_10 state, one chunk per USB
+ *          event.
+ */
+bool_t msd_scsi_process_start_read_write_10(USBMassStorageDriver *msdp) {
+
+    MSD_CYCLES_BEGIN(start);
+    msd_cbw_t *cbw = &(msdp->cbw);
+
+    if ((cbw->scsi_cmd_data[0] == SCSI_CMD_WRITE_10) && blkIsWriteProtected(msdp->config->bbdp)) {
+        /* device is write protected and a write has been issued */
+        /* block address is invalid, update SENSE key and return command fail */
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_DATA_PROTECT,
+                           SCSI_ASENSE_WRITE_PROTECTED,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->result = FALSE;
+
+        /* don't wait for ISR */
+        return FALSE;
+    }
+
+    uint32_t rw_block_address = swap_uint32(*(uint32_t *)&cbw->scsi_cmd_data[2]);
+    uint32_t total = swap_uint16(*(uint16_t *)&cbw->scsi_cmd_data[7]);
+
+    if ((rw_block_address >= msdp->block_dev_info.blk_num) ||
+        (total > msdp->block_dev_info.blk_num - rw_block_address)) {
+        /* block address is invalid, update SENSE key and return command fail */
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                           SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->result = FALSE;
+
+        /* don't wait for ISR */
+        return FALSE;
+    }
+
+    if (total == 0) {
+        /* nothing to transfer */
+        msdp->result = TRUE;
+        return FALSE;
+    }
+
+    if (!msd_check_data_phase(msdp, cbw->scsi_cmd_data[0] == SCSI_CMD_READ_10, total * MSD_BLOCK_SIZE(msdp)))
+        return FALSE;
+
+#if USB_MSD_USE_QOS
+    msd_qos_consume(msdp, &msdp->qos.iops, 1);
+#endif
+
+#if USB_MSD_USE_PROFILER
+    msd_profile_command(msdp, cbw->scsi_cmd_data[0] == SCSI_CMD_WRITE_10, rw_block_address, total);
+#endif
+
+#if USB_MSD_USE_CYCLE_PROFILE
+    msdp->cycles.blocks += total;
+#endif
+    MSD_CYCLES_END(msdp, MSD_PHASE_RW_SETUP, start);
+
+    msdp->rw_block_address = rw_block_address;
+    msdp->rw_total = total;
+    msdp->rw_count = (total < USB_MSD_BUFFER_BLOCKS) ? total : USB_MSD_BUFFER_BLOCKS;
+    msdp->rw_index = 0;
+
+    if (cbw->scsi_cmd_data[0] == SCSI_CMD_WRITE_10) {
+        /* process a write command, get the first chunk */
+        msd_start_receive(msdp, msdp->rw_buf[0], msdp->rw_count * MSD_BLOCK_SIZE(msdp));
+        msdp->state = MSD_WRITE_10;
+
+        /* wait for ISR */
+        return TRUE;
+    }
+
+    /* process a read command, read the first chunk from block device */
+    if (msd_media_read(msdp, rw_block_address, msdp->rw_buf[0], msdp->rw_count) == CH_FAILED) {
+        /* read failed */
+        msd_scsi_media_error(msdp, SCSI_ASENSE_READ_ERROR);
+
+        /* don't wait for ISR */
+        return FALSE;
+    }
+
+    return msd_scsi_continue_read_10(msdp);
+}
+
+/**
+ * @brief Removes the medium, the device staying enumerated
+ * @details The host sees the medium missing, it is told about the change by
+ *          a UNIT ATTENTION once the medium is attached back.
+ */
+static void msd_detach_media(USBMassStorageDriver *msdp) {
+
+    if (!msdp->media_attached)
+        return;
+
+#if USB_MSD_USE_METADATA_CACHE
+    /* make sure the media is up to date before it is removed */
+    if (msd_media_available(msdp))
+        msd_cache_flush(msdp);
+#endif
+
+    msdp->media_attached = FALSE;
+    msdp->not_ready_reported = TRUE;
+}
+
+#if USB_MSD_USE_CMD_START_STOP_UNIT
+/**
+ * @brief Processes a START_STOP_UNIT SCSI command
+ */
+bool_t msd_scsi_process_start_stop_unit(USBMassStorageDriver *msdp) {
+
+    switch (msdp->cbw.scsi_cmd_data[4] & 0x03) {
+    case 0x02:
+        /* medium ejected, the device stays enumerated */
+        msd_detach_media(msdp);
+        msdp->host_ejected = TRUE;
+        chEvtBroadcast(&msdp->evt_ejected);
+        break;
+    case 0x03:
+        /* medium loaded, attached back by the background work */
+        msdp->host_ejected = FALSE;
+        break;
+    default:
+        break;
+    }
+
+    msdp->result = TRUE;
+
+    /* don't wait for ISR */
+    return FALSE;
+}
+#endif /* USB_MSD_USE_CMD_START_STOP_UNIT */
+
+#if USB_MSD_USE_CMD_MODE_SENSE_6
+/**
+ * @brief Processes a MODE_SENSE_6 SCSI command
+ */
+bool_t msd_scsi_process_mode_sense_6(USBMassStorageDriver *msdp) {
+
+    return msd_scsi_transmit_response(msdp, msdp->responses.mode_sense_6,
+                                      sizeof(msdp->responses.mode_sense_6),
+                                      msdp->cbw.scsi_cmd_data[4]);
+}
+#endif /* USB_MSD_USE_CMD_MODE_SENSE_6 */
+
+#if USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES
+/**
+ * @brief Processes a READ_FORMAT_CAPACITIES SCSI command
+ */
+bool_t msd_scsi_process_read_format_capacities(USBMassStorageDriver *msdp) {
+
+    return msd_scsi_transmit_response(msdp, (const uint8_t *)&msdp->responses.read_format_capacities,
+                                      sizeof(msdp->responses.read_format_capacities),
+                                      (msdp->cbw.scsi_cmd_data[7] << 8) | msdp->cbw.scsi_cmd_data[8]);
+}
+#endif /* USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES */
+
+#if USB_MSD_USE_CMD_SYNCHRONIZE_CACHE_10
+/**
+ * @brief Processes a SYNCHRONIZE_CACHE_10 SCSI command
+ */
+bool_t msd_scsi_process_synchronize_cache_10(USBMassStorageDriver *msdp) {
+
+#if USB_MSD_USE_METADATA_CACHE
+    if (msd_cache_flush(msdp) == CH_FAILED) {
+        msd_scsi_media_error(msdp, SCSI_ASENSE_WRITE_FAULT);
+        return FALSE;
+    }
+#else
+    blkSync(msdp->config->bbdp);
+#endif
+
+    msdp->result = TRUE;
+
+    /* don't wait for ISR */
+    return FALSE;
+}
+#endif /* USB_MSD_USE_CMD_SYNCHRONIZE_CACHE_10 */
+
+#if USB_MSD_STATS_LEVEL >= 2
+/**
+ * @brief Accounts a completed READ_10 or WRITE_10 and its latency
+ */
+static void msd_account_command(USBMassStorageDriver *msdp, uint32_t *commands) {
+
+    systime_t latency = chTimeNow() - msdp->command_start;
+    uint32_t bucket = 0;
+
+    while ((latency != 0) && (bucket < USB_MSD_LATENCY_BUCKETS - 1)) {
+        latency >>= 1;
+        bucket++;
+    }
+
+    (*commands)++;
+    msdp->stats.latency[bucket]++;
+}
+#endif
+
+#if USB_MSD_USE_CMD_LOG_SENSE
+/**
+ * @brief Log pages returned by LOG SENSE
+ */
+#define MSD_LOG_PAGE_SUPPORTED        0x00
+#define MSD_LOG_PAGE_WRITE_ERRORS     0x02
+#define MSD_LOG_PAGE_READ_ERRORS      0x03
+#define MSD_LOG_PAGE_GENERAL_STATS    0x19
+#define MSD_LOG_PAGE_VENDOR           0x30
+
+static const uint8_t msd_log_supported_pages[] = {
+    MSD_LOG_PAGE_SUPPORTED,
+    MSD_LOG_PAGE_WRITE_ERRORS,
+    MSD_LOG_PAGE_READ_ERRORS,
+    MSD_LOG_PAGE_GENERAL_STATS,
+    MSD_LOG_PAGE_VENDOR
+};
+
+/**
+ * @brief Stores a big endian value
+ */
+static uint8_t *msd_put_be(uint8_t *p, uint64_t value, uint8_t size) {
+
+    while (size-- > 0)
+        *p++ = (uint8_t)(value >> (size * 8));
+
+    return p;
+}
+
+/**
+ * @brief Appends a parameter header to a log page
+ */
+static uint8_t *msd_log_param(uint8_t *p, uint16_t code, uint8_t control, uint8_t size) {
+
+    p = msd_put_be(p, code, 2);
+    *p++ = control;
+    *p++ = size;
+    return p;
+}
+
+/**
+ * @brief Appends a counter parameter to a log page
+ * @details The parameters below the parameter pointer of the CDB are skipped.
+ */
+static uint8_t *msd_log_counter(USBMassStorageDriver *msdp, uint8_t *p, uint16_t code, uint64_t value, uint8_t size) {
+
+    uint16_t pointer = (msdp->cbw.scsi_cmd_data[5] << 8) | msdp->cbw.scsi_cmd_data[6];
+
+    if (code < pointer)
+        return p;
+
+    p = msd_log_param(p, code, 0x00, size);
+    return msd_put_be(p, value, size);
+}
+
+/**
+ * @brief Returns the upper bound, in microseconds, of a latency percentile
+ */
+static uint32_t msd_latency_percentile(USBMassStorageDriver *msdp, uint32_t percent) {
+
+    uint32_t total = msdp->stats.read_commands + msdp->stats.write_commands;
+    uint64_t count = 0;
+    uint32_t bucket;
+
+    if (total == 0)
+        return 0;
+
+    for (bucket = 0; bucket < USB_MSD_LATENCY_BUCKETS - 1; bucket++) {
+        count += msdp->stats.latency[bucket];
+        if (count * 100 >= (uint64_t)total * percent)
+            break;
+    }
+
+    return (uint32_t)(((uint64_t)1 << bucket) * 1000000 / CH_FREQUENCY);
+}
+
+/**
+ * @brief Builds the general access statistics and performance log page
+ * @details The processing intervals are counted in system ticks, the time
+ *          interval parameter giving their length.
+ */
+static uint8_t *msd_log_general_stats(USBMassStorageDriver *msdp, uint8_t *p) {
+
+    msd_stats_t *stats = &msdp->stats;
+    uint16_t pointer = (msdp->cbw.scsi_cmd_data[5] << 8) | msdp->cbw.scsi_cmd_data[6];
+
+    if (pointer <= 0x0001) {
+        p = msd_log_param(p, 0x0001, 0x03, 0x40);
+        p = msd_put_be(p, stats->read_commands, 8);
+        p = msd_put_be(p, stats->write_commands, 8);
+        p = msd_put_be(p, stats->write_blocks, 8);
+        p = msd_put_be(p, stats->read_blocks, 8);
+        p = msd_put_be(p, stats->read_time, 8);
+        p = msd_put_be(p, stats->write_time, 8);
+        p = msd_put_be(p, (uint64_t)stats->read_commands + stats->write_commands, 8);
+        p = msd_put_be(p, (uint64_t)stats->read_time + stats->write_time, 8);
+    }
+
+    if (pointer <= 0x0003) {
+        /* one tick is 10^-6 * (1000000 / CH_FREQUENCY) seconds */
+        p = msd_log_param(p, 0x0003, 0x03, 0x08);
+        p = msd_put_be(p, 6, 4);
+        p = msd_put_be(p, 1000000 / CH_FREQUENCY, 4);
+    }
+
+    return p;
+}
+
+/**
+ * @brief Builds the vendor specific log page
+ * @details Parameters 0000h to 001Fh hold the latency histogram buckets, 0100h
+ *          to 0102h the 50th, 90th and 99th latency percentiles in
+ *          microseconds, 0200h and 0201h the metadata cache hits and misses,
+ *          0300h and 0301h the resets and media timeouts.
+ */
+static uint8_t *msd_log_vendor(USBMassStorageDriver *msdp, uint8_t *p) {
+
+    uint32_t i;
+
+    for (i = 0; i < USB_MSD_LATENCY_BUCKETS; i++)
+        p = msd_log_counter(msdp, p, i, msdp->stats.latency[i], 4);
+
+    p = msd_log_counter(msdp, p, 0x0100, msd_latency_percentile(msdp, 50), 4);
+    p = msd_log_counter(msdp, p, 0x0101, msd_latency_percentile(msdp, 90), 4);
+    p = msd_log_counter(msdp, p, 0x0102, msd_latency_percentile(msdp, 99), 4);
+
+#if USB_MSD_USE_METADATA_CACHE
+    p = msd_log_counter(msdp, p, 0x0200, msdp->cache.hits, 4);
+    p = msd_log_counter(msdp, p, 0x0201, msdp->cache.misses, 4);
+#endif
+
+    p = msd_log_counter(msdp, p, 0x0300, msdp->stats.resets, 4);
+    p = msd_log_counter(msdp, p, 0x0301, msdp->stats.media_timeouts, 4);
+    return p;
+}
+
+/**
+ * @brief Processes a LOG_SENSE SCSI command
+ * @details Only the cumulative values are reported. The page has its own
+ *          buffer, the transfer buffers may still be in use by a media worker
+ *          abandoned after a timeout.
+ */
+bool_t msd_scsi_process_log_sense(USBMassStorageDriver *msdp) {
+
+    msd_cbw_t *cbw = &(msdp->cbw);
+    uint8_t page_code = cbw->scsi_cmd_data[2] & 0x3F;
+    size_t alloc_len = (cbw->scsi_cmd_data[7] << 8) | cbw->scsi_cmd_data[8];
+    uint8_t *page = msdp->responses.log_page;
+    uint8_t *p = page + 4;
+    uint64_t blk_size = MSD_BLOCK_SIZE(msdp);
+
+    /* cumulative values of the page, without subpage */
+    if (((cbw->scsi_cmd_data[2] & 0xC0) != 0x40) || (cbw->scsi_cmd_data[3] != 0)) {
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                           SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->result = FALSE;
+        return FALSE;
+    }
+
+    switch (page_code) {
+    case MSD_LOG_PAGE_SUPPORTED:
+        memcpy(p, msd_log_supported_pages, sizeof(msd_log_supported_pages));
+        p += sizeof(msd_log_supported_pages);
+        break;
+    case MSD_LOG_PAGE_WRITE_ERRORS:
+        /* total bytes processed and total uncorrected errors */
+        p = msd_log_counter(msdp, p, 0x0005, msdp->stats.write_blocks * blk_size, 8);
+        p = msd_log_counter(msdp, p, 0x0006, msdp->stats.write_errors, 4);
+        break;
+    case MSD_LOG_PAGE_READ_ERRORS:
+        p = msd_log_counter(msdp, p, 0x0005, msdp->stats.read_blocks * blk_size, 8);
+        p = msd_log_counter(msdp, p, 0x0006, msdp->stats.read_errors, 4);
+        break;
+    case MSD_LOG_PAGE_GENERAL_STATS:
+        p = msd_log_general_stats(msdp, p);
+        break;
+    case MSD_LOG_PAGE_VENDOR:
+        p = msd_log_vendor(msdp, p);
+        break;
+    default:
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                           SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->result = FALSE;
+        return FALSE;
+    }
+
+    page[0] = page_code;
+    page[1] = 0x00;
+    msd_put_be(&page[2], (uint32_t)(p - page - 4), 2);
+
+    return msd_scsi_transmit_response(msdp, page, p - page, alloc_len);
+}
+
 /**
- * @brief Processes a START_STOP_UNIT SCSI command
+ * @brief Processes a LOG_SELECT SCSI command
+ * @details The parameter code reset bit clears the counters reported by
+ *          LOG SENSE, the parameters themselves can't be set.
  */
-bool_t msd_scsi_process_start_stop_unit(USBMassStorageDriver *msdp) {
+bool_t msd_scsi_process_log_select(USBMassStorageDriver *msdp) {
 
-    if ((msdp->cbw.scsi_cmd_data[4] & 0x03) == 0x02) {
-        /* device has been ejected */
-        chEvtBroadcast(&msdp->evt_ejected);
-        msdp->state = MSD_EJECTED;
+    msd_cbw_t *cbw = &(msdp->cbw);
+    msd_stats_t *stats = &msdp->stats;
+
+    if (cbw->scsi_cmd_data[1] & 0x01) {
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                           SCSI_ASENSE_SAVING_PARAMETERS_NOT_SUPPORTED,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->result = FALSE;
+        return FALSE;
+    }
+
+    if ((cbw->scsi_cmd_data[7] != 0) || (cbw->scsi_cmd_data[8] != 0)) {
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                           SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->result = FALSE;
+        return FALSE;
+    }
+
+    if (cbw->scsi_cmd_data[1] & 0x02) {
+        stats->resets = 0;
+        stats->media_timeouts = 0;
+        stats->read_blocks = 0;
+        stats->read_time = 0;
+        stats->write_blocks = 0;
+        stats->write_time = 0;
+        stats->read_commands = 0;
+        stats->write_commands = 0;
+        stats->read_errors = 0;
+        stats->write_errors = 0;
+        memset(stats->latency, 0, sizeof(stats->latency));
+#if USB_MSD_USE_METADATA_CACHE
+        msdp->cache.hits = 0;
+        msdp->cache.misses = 0;
+#endif
     }
 
     msdp->result = TRUE;
@@ -492,245 +1951,699 @@ bool_t msd_scsi_process_start_stop_unit(USBMassStorageDriver *msdp) {
     /* don't wait for ISR */
     return FALSE;
 }
+#endif /* USB_MSD_USE_CMD_LOG_SENSE */
 
 /**
- * @brief Processes a MODE_SENSE_6 SCSI command
+ * @brief Checks that the media can serve the current command
+ * @details Fails the command with NOT READY until the media is attached, and
+ *          once with UNIT ATTENTION when it becomes ready after having been
+ *          reported not ready.
  */
-bool_t msd_scsi_process_mode_sense_6(USBMassStorageDriver *msdp) {
+static bool_t msd_scsi_check_ready(USBMassStorageDriver *msdp) {
+
+    /* these commands don't depend on the media */
+    switch (msdp->cbw.scsi_cmd_data[0]) {
+    case SCSI_CMD_INQUIRY:
+    case SCSI_CMD_REQUEST_SENSE:
+#if USB_MSD_USE_CMD_START_STOP_UNIT
+    case SCSI_CMD_START_STOP_UNIT:
+#endif
+#if USB_MSD_USE_CMD_LOG_SENSE
+    case SCSI_CMD_LOG_SENSE:
+    case SCSI_CMD_LOG_SELECT:
+#endif
+        return TRUE;
+    default:
+        break;
+    }
 
-    static uint8_t response[4] = {
-        0x03, /* number of bytes that follow                    */
-        0x00, /* medium type is SBC                             */
-        0x00, /* not write protected (TODO handle it correctly) */
-        0x00  /* no block descriptor                            */
-    };
+    if (!msdp->media_attached) {
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_NOT_READY,
+                           SCSI_ASENSE_MEDIUM_NOT_PRESENT,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->not_ready_reported = TRUE;
+        return FALSE;
+    }
 
-    msd_start_transmit(msdp, response, sizeof(response));
-    msdp->result = TRUE;
+    if (!msd_media_available(msdp)) {
+        /* the media is still busy with an abandoned access */
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_NOT_READY,
+                           SCSI_ASENSE_LOGICAL_UNIT_NOT_READY,
+                           SCSI_ASENSEQ_OPERATION_IN_PROGRESS);
+        return FALSE;
+    }
+
+    if (msdp->unit_attention) {
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_UNIT_ATTENTION,
+                           SCSI_ASENSE_NOT_READY_TO_READY_CHANGE,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->unit_attention = FALSE;
+        return FALSE;
+    }
 
-    /* wait for ISR */
     return TRUE;
 }
 
 /**
- * @brief Processes a READ_FORMAT_CAPACITIES SCSI command
+ * @brief Processes a TEST_UNIT_READY SCSI command
  */
-bool_t msd_scsi_process_read_format_capacities(USBMassStorageDriver *msdp) {
+bool_t msd_scsi_process_test_unit_ready(USBMassStorageDriver *msdp) {
+
+    if (blkIsInserted(msdp->config->bbdp)) {
+        /* device inserted and ready */
+        msdp->result = TRUE;
+    } else {
+        /* device not present or not ready */
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_NOT_READY,
+                           SCSI_ASENSE_MEDIUM_NOT_PRESENT,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+        msdp->result = FALSE;
+    }
+
+    /* don't wait for ISR */
+    return FALSE;
+}
+
+/**
+ * @brief Sends the status of the processed command
+ */
+static bool_t msd_send_status(USBMassStorageDriver *msdp) {
 
-    msd_scsi_read_format_capacities_response_t response;
-    response.capacity_list_length = 1;
-    response.block_count = swap_uint32(msdp->block_dev_info.blk_num);
-    response.desc_and_block_length = swap_uint32((0x02 << 24) | (msdp->block_dev_info.blk_size & 0x00FFFFFF));
+    MSD_CYCLES_BEGIN(start);
+    msd_cbw_t *cbw = &(msdp->cbw);
+    msd_csw_t *csw = &(msdp->csw);
 
-    msd_start_transmit(msdp, (const uint8_t*)&response, sizeof(response));
-    msdp->result = TRUE;
+    /* only the commands that passed the readiness checks started an activity */
+    if (msdp->rw_active) {
+        msdp->rw_active = FALSE;
+        if (msdp->config->rw_activity_callback) {
+            MSD_CYCLES_BEGIN(callback);
+            msdp->config->rw_activity_callback(FALSE);
+            MSD_CYCLES_END(msdp, MSD_PHASE_CALLBACK, callback);
+        }
+
+#if USB_MSD_STATS_LEVEL >= 2
+        if (cbw->scsi_cmd_data[0] == SCSI_CMD_READ_10)
+            msd_account_command(msdp, &msdp->stats.read_commands);
+        else
+            msd_account_command(msdp, &msdp->stats.write_commands);
+#endif
+    }
+
+    if (msdp->result) {
+        /* update sense with success status */
+        msd_scsi_set_sense(msdp,
+                           SCSI_SENSE_KEY_GOOD,
+                           SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+                           SCSI_ASENSEQ_NO_QUALIFIER);
+    }
+
+    if (cbw->data_len > msdp->data_moved) {
+        /* the host expects more data, stall the pipe of its direction only;
+           a short packet already ended a data phase to the host */
+        chSysLock();
+        if (!(cbw->flags & 0x80))
+            usbStallReceiveI(msdp->config->usbp, msdp->config->bulk_ep);
+        else if ((msdp->data_moved % msdp->ep_config.in_maxsize) == 0)
+            usbStallTransmitI(msdp->config->usbp, msdp->config->bulk_ep);
+        chSysUnlock();
+    }
+
+    /* update the command status wrapper and send it to the host */
+    if (msdp->phase_error)
+        csw->status = MSD_COMMAND_PHASE_ERROR;
+    else
+        csw->status = (msdp->result) ? MSD_COMMAND_PASSED : MSD_COMMAND_FAILED;
+    csw->signature = MSD_CSW_SIGNATURE;
+    csw->data_residue = (cbw->data_len > msdp->data_moved) ? cbw->data_len - msdp->data_moved : 0;
+    csw->tag = cbw->tag;
+
+#if USB_MSD_TRACE_LEVEL >= 1
+    msd_trace(msdp, MSD_TRACE_CSW, csw->status, 0, csw->data_residue, csw->tag);
+#endif
+
+    msd_start_transmit(msdp, (const uint8_t *)csw, sizeof(*csw));
+
+#if USB_MSD_USE_CYCLE_PROFILE
+    msd_cycles_account_command(msdp, cbw->scsi_cmd_data[0], msdp->cycles_command + (USB_MSD_CYCLES() - start));
+#endif
+
+    /* wait for ISR */
+    return TRUE;
+}
+
+/**
+ * @brief Waits for a new command block
+ */
+bool_t msd_wait_for_command_block(USBMassStorageDriver *msdp) {
+
+    msd_start_receive(msdp, (uint8_t *)&msdp->cbw, sizeof(msdp->cbw));
+    msdp->state = MSD_READ_COMMAND_BLOCK;
 
     /* wait for ISR */
     return TRUE;
 }
 
+#if USB_MSD_TRACE_LEVEL >= 1
+/**
+ * @brief Traces the command block just received
+ */
+static void msd_trace_command(USBMassStorageDriver *msdp) {
+
+    msd_cbw_t *cbw = &(msdp->cbw);
+    uint32_t lba = 0;
+    uint16_t count = 0;
+
+    if ((cbw->scsi_cmd_data[0] == SCSI_CMD_READ_10) || (cbw->scsi_cmd_data[0] == SCSI_CMD_WRITE_10)) {
+        lba = ((uint32_t)cbw->scsi_cmd_data[2] << 24) | ((uint32_t)cbw->scsi_cmd_data[3] << 16) |
+              ((uint32_t)cbw->scsi_cmd_data[4] << 8) | cbw->scsi_cmd_data[5];
+        count = (cbw->scsi_cmd_data[7] << 8) | cbw->scsi_cmd_data[8];
+    }
+
+    msd_trace(msdp, MSD_TRACE_CBW, cbw->scsi_cmd_data[0], count, lba, cbw->data_len);
+}
+#endif
+
+/**
+ * @brief Reads a newly received command block
+ */
+bool_t msd_read_command_block(USBMassStorageDriver *msdp) {
+
+    MSD_CYCLES_BEGIN(start);
+    msd_cbw_t *cbw = &(msdp->cbw);
+#if USB_MSD_USE_CYCLE_PROFILE
+    uint64_t media_cycles = msdp->cycles.phases[MSD_PHASE_MEDIA].cycles;
+#endif
+
+    /* by default transition back to the idle state */
+    msdp->state = MSD_IDLE;
+    msdp->phase_error = FALSE;
+    msdp->data_moved = 0;
+    msdp->rw_active = FALSE;
+
+    /* check the command */
+    if ((cbw->signature != MSD_CBW_SIGNATURE) ||
+        (cbw->lun > 0) ||
+        ((cbw->data_len > 0) && (cbw->flags & 0x1F)) ||
+        (cbw->scsi_cmd_len == 0) ||
+        (cbw->scsi_cmd_len > 16)) {
+
+        /* stall both IN and OUT endpoints */
+        chSysLock();
+        usbStallReceiveI(msdp->config->usbp, msdp->config->bulk_ep);
+        usbStallTransmitI(msdp->config->usbp, msdp->config->bulk_ep);
+        chSysUnlock();
+
+        /* don't wait for ISR */
+        return FALSE;
+    }
+
+    bool_t sleep = FALSE;
+
+    /* the time budget of the command starts now */
+    msdp->command_start = chTimeNow();
+#if USB_MSD_TRACE_LEVEL >= 1
+    msd_trace_command(msdp);
+#endif
+#if USB_MSD_USE_WATCHDOG
+    msdp->media_timed_out = FALSE;
+    msdp->media_time = 0;
+#endif
+
+    /* check the command */
+    bool_t ready = msd_scsi_check_ready(msdp);
+    MSD_CYCLES_END(msdp, MSD_PHASE_PARSE, start);
+
+    if (!ready) {
+        /* media not available, the sense data has been updated */
+        msdp->result = FALSE;
+    } else {
+        switch (cbw->scsi_cmd_data[0]) {
+        case SCSI_CMD_INQUIRY:
+            sleep = msd_scsi_process_inquiry(msdp);
+            break;
+        case SCSI_CMD_REQUEST_SENSE:
+            sleep = msd_scsi_process_request_sense(msdp);
+            break;
+        case SCSI_CMD_READ_CAPACITY_10:
+            sleep = msd_scsi_process_read_capacity_10(msdp);
+            break;
+        case SCSI_CMD_READ_10:
+        case SCSI_CMD_WRITE_10:
+            /* the activity ends when the status is sent */
+            msdp->rw_active = TRUE;
+            if (msdp->config->rw_activity_callback) {
+                MSD_CYCLES_BEGIN(callback);
+                msdp->config->rw_activity_callback(TRUE);
+                MSD_CYCLES_END(msdp, MSD_PHASE_CALLBACK, callback);
+            }
+            sleep = msd_scsi_process_start_read_write_10(msdp);
+            break;
+#if USB_MSD_USE_CMD_SEND_DIAGNOSTIC
+        case SCSI_CMD_SEND_DIAGNOSTIC:
+            sleep = msd_scsi_process_send_diagnostic(msdp);
+            break;
+#endif
+#if USB_MSD_USE_CMD_MODE_SENSE_6
+        case SCSI_CMD_MODE_SENSE_6:
+            sleep = msd_scsi_process_mode_sense_6(msdp);
+            break;
+#endif
+#if USB_MSD_USE_CMD_START_STOP_UNIT
+        case SCSI_CMD_START_STOP_UNIT:
+            sleep = msd_scsi_process_start_stop_unit(msdp);
+            break;
+#endif
+#if USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES
+        case SCSI_CMD_READ_FORMAT_CAPACITIES:
+            sleep = msd_scsi_process_read_format_capacities(msdp);
+            break;
+#endif
+        case SCSI_CMD_TEST_UNIT_READY:
+            sleep = msd_scsi_process_test_unit_ready(msdp);
+            break;
+#if USB_MSD_USE_CMD_SYNCHRONIZE_CACHE_10
+        case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+            sleep = msd_scsi_process_synchronize_cache_10(msdp);
+            break;
+#endif
+#if USB_MSD_USE_CMD_LOG_SENSE
+        case SCSI_CMD_LOG_SENSE:
+            sleep = msd_scsi_process_log_sense(msdp);
+            break;
+        case SCSI_CMD_LOG_SELECT:
+            sleep = msd_scsi_process_log_select(msdp);
+            break;
+#endif
+        case SCSI_CMD_FORMAT_UNIT:
+            /* don't handle */
+            msdp->result = TRUE;
+            break;
+        case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+            /* don't handle */
+            msdp->result = TRUE;
+            break;
+        case SCSI_CMD_VERIFY_10:
+            /* don't handle */
+            msdp->result = TRUE;
+            break;
+        default:
+            msd_scsi_set_sense(msdp,
+                               SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                               SCSI_ASENSE_INVALID_COMMAND,
+                               SCSI_ASENSEQ_NO_QUALIFIER);
+
+            /* the status stalls the data pipe if the host expects data */
+            msdp->result = FALSE;
+            break;
+        }
+    }
+
+#if USB_MSD_USE_CYCLE_PROFILE
+    /* the status adds its own cost */
+    msdp->cycles_command = (USB_MSD_CYCLES() - start) -
+                           (uint32_t)(msdp->cycles.phases[MSD_PHASE_MEDIA].cycles - media_cycles);
+#endif
+
+    /* the status is sent once the data phase completes */
+    if (sleep)
+        return TRUE;
+
+    return msd_send_status(msdp);
+}
+
+#if USB_MSD_USE_WARMUP
+/**
+ * @brief Loads a range of blocks into the cache
+ *
+ * @return              FALSE once the cache is full.
+ */
+static bool_t msd_warmup_range(USBMassStorageDriver *msdp, uint32_t start, uint32_t count, uint32_t *loaded) {
+
+    msd_metadata_cache_t *cache = &msdp->cache;
+
+    for (; count > 0; count--, start++) {
+        if (*loaded >= USB_MSD_METADATA_CACHE_BLOCKS)
+            return FALSE;
+        if ((start >= msdp->block_dev_info.blk_num) || (msd_cache_lookup(msdp, start) >= 0))
+            continue;
+
+        int32_t i = msd_cache_allocate(msdp, start);
+        if (i < 0)
+            return FALSE;
+        if (blkRead(msdp->config->bbdp, start, cache->data[i], 1) == CH_FAILED) {
+            cache->slots[i].blk = MSD_CACHE_FREE;
+            continue;
+        }
+
+        cache->slots[i].last_use = ++cache->use_counter;
+        if (!msd_cache_is_metadata(msdp, start))
+            cache->warm_count++;
+        (*loaded)++;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Pre-reads the configured block ranges into the cache
+ */
+static void msd_warmup(USBMassStorageDriver *msdp) {
+
+    const USBMassStorageConfig *config = msdp->config;
+    msd_metadata_cache_t *cache = &msdp->cache;
+    uint32_t loaded = 0;
+    size_t i;
+#if USB_MSD_STATS_LEVEL >= 1
+    systime_t start = chTimeNow();
+#endif
+
+    if (config->warmup_ranges != NULL) {
+        for (i = 0; i < config->warmup_range_count; i++)
+            if (!msd_warmup_range(msdp, config->warmup_ranges[i].start, config->warmup_ranges[i].count, &loaded))
+                break;
+    } else {
+        uint32_t fat_blocks = cache->fat_end - cache->fat_start;
+        if (fat_blocks > USB_MSD_WARMUP_FAT_BLOCKS)
+            fat_blocks = USB_MSD_WARMUP_FAT_BLOCKS;
+
+        if (msd_warmup_range(msdp, 0, 1, &loaded) &&
+            msd_warmup_range(msdp, cache->boot_blk, 1, &loaded) &&
+            msd_warmup_range(msdp, cache->fat_start, fat_blocks, &loaded))
+            msd_warmup_range(msdp, cache->root_start, cache->root_end - cache->root_start, &loaded);
+    }
+
+#if USB_MSD_STATS_LEVEL >= 1
+    msdp->stats.warmup_blocks = loaded;
+    msdp->stats.warmup_time = chTimeNow() - start;
+#endif
+}
+#endif /* USB_MSD_USE_WARMUP */
+
+/**
+ * @brief Attaches the media once the block device is ready
+ */
+static void msd_attach_media(USBMassStorageDriver *msdp) {
+
+    if (msdp->media_attached || msdp->host_ejected || msdp->firmware_ejected ||
+        msdp->media_unsupported || (blkGetDriverState(msdp->config->bbdp) != BLK_READY))
+        return;
+
+    /* an access abandoned by the watchdog still uses the block device and
+       the buffers, attach once it has returned */
+    if (!msd_media_available(msdp))
+        return;
+
+    /* get block device information */
+    blkGetInfo(msdp->config->bbdp, &msdp->block_dev_info);
+
+    /* the buffers are sized for the configured block size, another medium
+       is only tried on request */
+#if USB_MSD_BLOCK_SIZE != 0
+    if (msdp->block_dev_info.blk_size != USB_MSD_BLOCK_SIZE) {
+#else
+    if (msdp->block_dev_info.blk_size > USB_MSD_MAX_BLOCK_SIZE) {
+#endif
+        msdp->media_unsupported = TRUE;
+        return;
+    }
+
+    /* the probe command responses only depend on the media */
+    msd_scsi_build_responses(msdp);
+
+#if USB_MSD_USE_METADATA_CACHE
+    /* find the file system metadata to keep in cache */
+    msd_cache_locate_metadata(msdp, msdp->rw_buf[0]);
+#endif
+
+#if USB_MSD_USE_WARMUP
+    /* load the blocks every host reads first */
+    msd_warmup(msdp);
+#endif
+
+#if USB_MSD_STATS_LEVEL >= 1
+    msdp->stats.attach_latency = chTimeNow() - msdp->start_time;
+#endif
+    msdp->media_attached = TRUE;
+
+    /* tell the host about the change if it has seen the media missing */
+    if (msdp->not_ready_reported)
+        msdp->unit_attention = TRUE;
+}
+
+/**
+ * @brief Checks if the host is between two commands
+ */
+#define msd_is_idle(msdp) (((msdp)->state == MSD_IDLE) || ((msdp)->state == MSD_READ_COMMAND_BLOCK))
+
+/**
+ * @brief Serves the pending media request of the firmware
+ */
+static void msd_media_request(USBMassStorageDriver *msdp) {
+
+    switch (msdp->media_request) {
+    case MSD_MEDIA_REQUEST_EJECT:
+        msd_detach_media(msdp);
+        msdp->firmware_ejected = TRUE;
+        break;
+    case MSD_MEDIA_REQUEST_INSERT:
+        msdp->host_ejected = FALSE;
+        msdp->firmware_ejected = FALSE;
+        msdp->media_unsupported = FALSE;
+        msd_attach_media(msdp);
+        break;
+    default:
+        return;
+    }
+
+    msdp->media_request = MSD_MEDIA_REQUEST_NONE;
+    chBSemSignal(&msdp->media_ack);
+}
+
+/**
+ * @brief Returns the time after which the background work is due
+ */
+static systime_t msd_idle_timeout(USBMassStorageDriver *msdp) {
+
+    if ((msdp->media_request != MSD_MEDIA_REQUEST_NONE) && msd_is_idle(msdp))
+        return TIME_IMMEDIATE;
+
+    /* a removed or unsupported medium is only attached back on request */
+    if (msdp->host_ejected || msdp->firmware_ejected || msdp->media_unsupported)
+        return TIME_INFINITE;
+
+    if (!msdp->media_attached)
+        return USB_MSD_ATTACH_POLL_INTERVAL;
+
+#if USB_MSD_USE_METADATA_CACHE
+    if (msd_is_idle(msdp) && (msdp->cache.dirty_count > 0)) {
+        systime_t elapsed = chTimeNow() - msdp->last_activity;
+        return (elapsed < USB_MSD_METADATA_FLUSH_DELAY) ? USB_MSD_METADATA_FLUSH_DELAY - elapsed : TIME_IMMEDIATE;
+    }
+#endif
+
+    return TIME_INFINITE;
+}
+
 /**
- * @brief Processes a TEST_UNIT_READY SCSI command
+ * @brief Does the background work while the host is idle
+ * @details Polls the block device until the media is attached, and writes the
+ *          cached metadata back once the host has been idle for a while.
  */
-bool_t msd_scsi_process_test_unit_ready(USBMassStorageDriver *msdp) {
+static void msd_idle_work(USBMassStorageDriver *msdp) {
 
-    if (blkIsInserted(msdp->config->bbdp)) {
-        /* device inserted and ready */
-        msdp->result = TRUE;
-    } else {
-        /* device not present or not ready */
-        msd_scsi_set_sense(msdp,
-                           SCSI_SENSE_KEY_NOT_READY,
-                           SCSI_ASENSE_MEDIUM_NOT_PRESENT,
-                           SCSI_ASENSEQ_NO_QUALIFIER);
-        msdp->result = FALSE;
+    if (msd_is_idle(msdp))
+        msd_media_request(msdp);
+
+    if (!msdp->media_attached) {
+        msd_attach_media(msdp);
+        return;
     }
 
-    /* don't wait for ISR */
-    return FALSE;
+#if USB_MSD_USE_METADATA_CACHE
+    if (msd_is_idle(msdp) && msd_media_available(msdp) && (msdp->cache.dirty_count > 0) &&
+        (chTimeNow() - msdp->last_activity >= USB_MSD_METADATA_FLUSH_DELAY))
+        msd_cache_flush(msdp);
+#endif
 }
 
 /**
- * @brief Waits for a new command block
+ * @brief Drops the command aborted by a Bulk-Only Mass Storage Reset
+ * @details The wake-up of the reset is consumed along with the reset flag so
+ *          that the next one is the completion of the new command block.
  */
-bool_t msd_wait_for_command_block(USBMassStorageDriver *msdp) {
+static void msd_resync(USBMassStorageDriver *msdp) {
 
-    msd_start_receive(msdp, (uint8_t *)&msdp->cbw, sizeof(msdp->cbw));
-    msdp->state = MSD_READ_COMMAND_BLOCK;
+    if (msdp->rw_active && msdp->config->rw_activity_callback)
+        msdp->config->rw_activity_callback(FALSE);
+    msdp->rw_active = FALSE;
 
-    /* wait for ISR */
-    return TRUE;
+#if USB_MSD_USE_SERVICE_THREAD
+    chEvtGetAndClearEvents(EVENT_MASK(msdp->index));
+#endif
+
+    chSysLock();
+#if !USB_MSD_USE_SERVICE_THREAD
+    chBSemResetI(&msdp->bsem, TRUE);
+#endif
+    msdp->reset_pending = FALSE;
+#if USB_MSD_TRACE_LEVEL >= 1
+    msd_trace_i(msdp, MSD_TRACE_RESET, 0, 0, 0, 0);
+#endif
+    chSysUnlock();
+
+    /* cancel the data phase, the buffers are reused by the next command */
+    msdp->rw_total = 0;
+    msdp->rw_count = 0;
+    msdp->rw_index = 0;
+    msdp->cbw.data_len = 0;
+    msdp->data_moved = 0;
+    msdp->state = MSD_IDLE;
+#if USB_MSD_STATS_LEVEL >= 1
+    msdp->stats.resets++;
+#endif
 }
 
 /**
- * @brief Reads a newly received command block
+ * @brief Runs the state machine until it waits for a USB transfer
+ * @details Called each time the pending transfer completes, this function
+ *          never waits for the USB so that a thread can drive several
+ *          instances.
  */
-bool_t msd_read_command_block(USBMassStorageDriver *msdp) {
+static void msd_step(USBMassStorageDriver *msdp) {
 
-    msd_cbw_t *cbw = &(msdp->cbw);
-
-    /* by default transition back to the idle state */
-    msdp->state = MSD_IDLE;
+    bool_t wait_for_isr = FALSE;
 
-    /* check the command */
-    if ((cbw->signature != MSD_CBW_SIGNATURE) ||
-        (cbw->lun > 0) ||
-        ((cbw->data_len > 0) && (cbw->flags & 0x1F)) ||
-        (cbw->scsi_cmd_len == 0) ||
-        (cbw->scsi_cmd_len > 16)) {
+#if USB_MSD_USE_CYCLE_PROFILE
+    if (msdp->cycles_signaled) {
+        msdp->cycles_signaled = FALSE;
+        msd_cycles_account(msdp, MSD_PHASE_WAKEUP, USB_MSD_CYCLES() - msdp->cycles_signal);
+    }
+#endif
 
-        /* stall both IN and OUT endpoints */
-        chSysLock();
-        usbStallReceiveI(msdp->config->usbp, msdp->config->bulk_ep);
-        usbStallTransmitI(msdp->config->usbp, msdp->config->bulk_ep);
-        chSysUnlock();
+    while (!wait_for_isr) {
+        /* restart from the command block after a reset */
+        if (msdp->reset_pending)
+            msd_resync(msdp);
 
-        /* don't wait for ISR */
-        return FALSE;
+        switch (msdp->state) {
+        case MSD_IDLE:
+            wait_for_isr = msd_wait_for_command_block(msdp);
+            break;
+        case MSD_READ_COMMAND_BLOCK:
+            wait_for_isr = msd_read_command_block(msdp);
+            break;
+        case MSD_READ_10:
+            wait_for_isr = msd_scsi_continue_read_10(msdp);
+            break;
+        case MSD_WRITE_10:
+            wait_for_isr = msd_scsi_continue_write_10(msdp);
+            break;
+        case MSD_SEND_STATUS:
+            msdp->state = MSD_IDLE;
+            wait_for_isr = msd_send_status(msdp);
+            break;
+        }
     }
 
-    bool_t sleep = FALSE;
-
-    /* check the command */
-    switch (cbw->scsi_cmd_data[0]) {
-    case SCSI_CMD_INQUIRY:
-        sleep = msd_scsi_process_inquiry(msdp);
-        break;
-    case SCSI_CMD_REQUEST_SENSE:
-        sleep = msd_scsi_process_request_sense(msdp);
-        break;
-    case SCSI_CMD_READ_CAPACITY_10:
-        sleep = msd_scsi_process_read_capacity_10(msdp);
-        break;
-    case SCSI_CMD_READ_10:
-    case SCSI_CMD_WRITE_10:
-        if (msdp->config->rw_activity_callback)
-            msdp->config->rw_activity_callback(TRUE);
-        sleep = msd_scsi_process_start_read_write_10(msdp);
-        if (msdp->config->rw_activity_callback)
-            msdp->config->rw_activity_callback(FALSE);
-        break;
-    case SCSI_CMD_SEND_DIAGNOSTIC:
-        sleep = msd_scsi_process_send_diagnostic(msdp);
-        break;
-    case SCSI_CMD_MODE_SENSE_6:
-        sleep = msd_scsi_process_mode_sense_6(msdp);
-        break;
-    case SCSI_CMD_START_STOP_UNIT:
-        sleep = msd_scsi_process_start_stop_unit(msdp);
-        break;
-    case SCSI_CMD_READ_FORMAT_CAPACITIES:
-        sleep = msd_scsi_process_read_format_capacities(msdp);
-        break;
-    case SCSI_CMD_TEST_UNIT_READY:
-        sleep = msd_scsi_process_test_unit_ready(msdp);
-        break;
-    case SCSI_CMD_FORMAT_UNIT:
-        /* don't handle */
-        msdp->result = TRUE;
-        break;
-    case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
-        /* don't handle */
-        msdp->result = TRUE;
-        break;
-    case SCSI_CMD_VERIFY_10:
-        /* don't handle */
-        msdp->result = TRUE;
-        break;
-    default:
-        msd_scsi_set_sense(msdp,
-                           SCSI_SENSE_KEY_ILLEGAL_REQUEST,
-                           SCSI_ASENSE_INVALID_COMMAND,
-                           SCSI_ASENSEQ_NO_QUALIFIER);
+    msdp->last_activity = chTimeNow();
+}
 
-        /* stall IN endpoint */
-        chSysLock();
-        usbStallTransmitI(msdp->config->usbp, msdp->config->bulk_ep);
-        chSysUnlock();
+#if !USB_MSD_USE_SERVICE_THREAD
+/**
+ * @brief Mass storage thread that processes commands
+ */
+#if USB_MSD_THREAD_WA_SIZE > 0
+static WORKING_AREA(mass_storage_thread_wa, USB_MSD_THREAD_WA_SIZE);
 
-        return FALSE;
-    }
+/**
+ * @brief Instance whose thread runs in the static working area
+ */
+static USBMassStorageDriver *mass_storage_thread_wa_user;
+#endif
 
-    if (msdp->result) {
-        /* update sense with success status */
-        msd_scsi_set_sense(msdp,
-                           SCSI_SENSE_KEY_GOOD,
-                           SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
-                           SCSI_ASENSEQ_NO_QUALIFIER);
+static msg_t mass_storage_thread(void *arg) {
 
-        /* reset data length left */
-        cbw->data_len = 0;
-    }
+    USBMassStorageDriver *msdp = (USBMassStorageDriver *)arg;
 
-    /* wait for ISR if needed */
-    if (sleep)
-        msd_wait_for_isr(msdp);
+    chRegSetThreadName("USB-MSD");
 
-    msd_csw_t *csw = &(msdp->csw);
+    /* attach the media right away if it is ready, while the USB enumerates */
+    msd_attach_media(msdp);
 
-    if (!msdp->result && cbw->data_len) {
-        /* still bytes left to send, this is too early to send CSW? */
+    while (!chThdShouldTerminate()) {
+        /* wait until the ISR wakes thread, doing the background work meanwhile */
         chSysLock();
-        usbStallReceiveI(msdp->config->usbp, msdp->config->bulk_ep);
-        usbStallTransmitI(msdp->config->usbp, msdp->config->bulk_ep);
+        msg_t msg = chBSemWaitTimeoutS(&msdp->bsem, msd_idle_timeout(msdp));
         chSysUnlock();
 
-        /*return FALSE;*/
-    }
+        if (chThdShouldTerminate())
+            break;
 
-    /* update the command status wrapper and send it to the host */
-    csw->status = (msdp->result) ? MSD_COMMAND_PASSED : MSD_COMMAND_FAILED;
-    csw->signature = MSD_CSW_SIGNATURE;
-    csw->data_residue = cbw->data_len;
-    csw->tag = cbw->tag;
+        /* a reset of the semaphore is a wake-up for a media request */
+        if (msg == RDY_OK)
+            msd_step(msdp);
+        else
+            msd_idle_work(msdp);
+    }
 
-    msd_start_transmit(msdp, (const uint8_t *)csw, sizeof(*csw));
+#if USB_MSD_USE_METADATA_CACHE
+    if (msd_media_available(msdp))
+        msd_cache_flush(msdp);
+#endif
 
-    /* wait for ISR */
-    return TRUE;
+    return 0;
 }
-
+#else /* USB_MSD_USE_SERVICE_THREAD */
 /**
- * @brief Mass storage thread that processes commands
+ * @brief Service thread driving all the registered instances
  */
-static WORKING_AREA(mass_storage_thread_wa, 1024);
-static msg_t mass_storage_thread(void *arg) {
+static msg_t msd_service_thread_main(void *arg) {
 
-    USBMassStorageDriver *msdp = (USBMassStorageDriver *)arg;
+    uint32_t i;
 
+    (void)arg;
     chRegSetThreadName("USB-MSD");
 
-    bool_t wait_for_isr = FALSE;
+    while (TRUE) {
+        systime_t timeout = TIME_INFINITE;
 
-    /* wait for the usb to be initialised */
-    msd_wait_for_isr(msdp);
+        /* sleep until the earliest background work */
+        chMtxLock(&msd_instances_mtx);
+        for (i = 0; i < USB_MSD_MAX_INSTANCES; i++) {
+            if (msd_instances[i] != NULL) {
+                systime_t t = msd_idle_timeout(msd_instances[i]);
+                if (t < timeout)
+                    timeout = t;
+            }
+        }
+        chMtxUnlock();
 
-    while (!chThdShouldTerminate()) {
-        wait_for_isr = FALSE;
+        eventmask_t events = chEvtWaitAnyTimeout(ALL_EVENTS, timeout);
 
-        /* wait on data depending on the current state */
-        switch (msdp->state) {
-        case MSD_IDLE:
-            wait_for_isr = msd_wait_for_command_block(msdp);
-            break;
-        case MSD_READ_COMMAND_BLOCK:
-            wait_for_isr = msd_read_command_block(msdp);
-            break;
-        case MSD_EJECTED:
-            /* disconnect usb device */
-            usbDisconnectBus(msdp->config->usbp);
-            usbStop(msdp->config->usbp);
-            chThdExit(0);
-            return 0;
-        }
+        /* step the instances whose transfer completed */
+        chMtxLock(&msd_instances_mtx);
+        for (i = 0; i < USB_MSD_MAX_INSTANCES; i++) {
+            USBMassStorageDriver *msdp = msd_instances[i];
+            if (msdp == NULL)
+                continue;
 
-        /* wait until the ISR wakes thread */
-        if (wait_for_isr)
-            msd_wait_for_isr(msdp);
+            if (events & EVENT_MASK(i)) {
+                msd_step(msdp);
+            } else {
+                msd_idle_work(msdp);
+            }
+        }
+        chMtxUnlock();
     }
 
     return 0;
 }
+#endif /* USB_MSD_USE_SERVICE_THREAD */
 
 /**
  * @brief Initializse a USB mass storage driver
@@ -742,13 +2655,62 @@ void msdInit(USBMassStorageDriver *msdp) {
     msdp->config = NULL;
     msdp->thread = NULL;
     msdp->state = MSD_IDLE;
+    msdp->reset_pending = FALSE;
+    msdp->stopping = FALSE;
+    msdp->media_request = MSD_MEDIA_REQUEST_NONE;
+    chBSemInit(&msdp->media_ack, TRUE);
+
+#if USB_MSD_STATS_LEVEL >= 1
+    /* reset the statistics */
+    memset(&msdp->stats, 0, sizeof(msdp->stats));
+#endif
+
+#if USB_MSD_USE_PROFILER
+    memset(&msdp->profile, 0, sizeof(msdp->profile));
+#endif
+
+#if USB_MSD_USE_CYCLE_PROFILE
+    memset(&msdp->cycles, 0, sizeof(msdp->cycles));
+    msdp->cycles_command = 0;
+    msdp->cycles_signaled = FALSE;
+#if MSD_CYCLES_USE_DWT
+    /* start the cycle counter */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+#endif
+
+#if USB_MSD_USE_QOS
+    /* no limit by default */
+    memset(&msdp->qos, 0, sizeof(msdp->qos));
+    chBSemInit(&msdp->qos.firmware_idle, TRUE);
+#endif
+
+    /* the data end-point uses the driver's own states */
+    msdp->ep_config = ep_data_config;
+    msdp->ep_config.in_state = &msdp->ep_in_state;
+    msdp->ep_config.out_state = &msdp->ep_out_state;
+#if USB_MSD_TRACE_LEVEL >= 1
+    msdp->trace_ep_config = ep_trace_config;
+    msdp->trace_ep_config.in_state = &msdp->trace_in_state;
+#endif
 
     /* initialize the driver events */
     chEvtInit(&msdp->evt_connected);
     chEvtInit(&msdp->evt_ejected);
 
+#if !USB_MSD_USE_SERVICE_THREAD
     /* initialise the binary semaphore as taken */
     chBSemInit(&msdp->bsem, TRUE);
+#endif
+
+#if USB_MSD_USE_WATCHDOG
+    msdp->media_thread = NULL;
+    msdp->media_busy = FALSE;
+    msdp->media_timed_out = FALSE;
+    chBSemInit(&msdp->media_start, TRUE);
+    chBSemInit(&msdp->media_done, TRUE);
+#endif
 
     /* initialise the sense data structure */
     size_t i;
@@ -776,6 +2738,9 @@ void msdStart(USBMassStorageDriver *msdp, const USBMassStorageConfig *config) {
     chDbgCheck(msdp != NULL, "msdStart");
     chDbgCheck(config != NULL, "msdStart");
     chDbgCheck(msdp->thread == NULL, "msdStart");
+#if USB_MSD_USE_WATCHDOG
+    chDbgCheck(msdp->media_thread == NULL, "msdStart");
+#endif
 
     /* save the configuration */
     msdp->config = config;
@@ -789,42 +2754,356 @@ void msdStart(USBMassStorageDriver *msdp, const USBMassStorageConfig *config) {
     for (i = 0; i < sizeof(msdp->config->short_product_version); ++i)
         msdp->inquiry.product_rev[i] = config->short_product_version[i];
 
-    /* set the initial state */
+    /* set the initial state, the media is attached by the thread */
     msdp->state = MSD_IDLE;
-
-    /* make sure block device is working */
-    while (blkGetDriverState(config->bbdp) != BLK_READY) {
-        chThdSleepMilliseconds(50);
-    }
-
-    /* get block device information */
-    blkGetInfo(config->bbdp, &msdp->block_dev_info);
+    msdp->media_attached = FALSE;
+    msdp->not_ready_reported = FALSE;
+    msdp->unit_attention = FALSE;
+    msdp->reset_pending = FALSE;
+    msdp->stopping = FALSE;
+    msdp->host_ejected = FALSE;
+    msdp->firmware_ejected = FALSE;
+    msdp->media_unsupported = FALSE;
+    msdp->media_request = MSD_MEDIA_REQUEST_NONE;
+    msdp->start_time = chTimeNow();
+    msdp->last_activity = msdp->start_time;
 
     /* store the pointer to the mass storage driver into the user param
        of the USB driver, so that we can find it back in callbacks */
     config->usbp->in_params[config->bulk_ep] = (void *)msdp;
     config->usbp->out_params[config->bulk_ep] = (void *)msdp;
 
-    /* run the thread */
-    msdp->thread = chThdCreateStatic(mass_storage_thread_wa, sizeof(mass_storage_thread_wa), NORMALPRIO, mass_storage_thread, msdp);
+#if USB_MSD_TRACE_LEVEL >= 1
+    msdp->trace_head = 0;
+    msdp->trace_tail = 0;
+    msdp->trace_sending = 0;
+    msdp->trace_dropped = 0;
+    if (config->trace_ep != 0)
+        config->usbp->in_params[config->trace_ep] = (void *)msdp;
+#endif
+
+#if USB_MSD_USE_WATCHDOG
+    /* the media worker runs at the priority of the thread it serves */
+#if !USB_MSD_USE_SERVICE_THREAD
+    tprio_t media_prio = (config->thread_prio != 0) ? config->thread_prio : NORMALPRIO;
+#else
+    tprio_t media_prio = USB_MSD_SERVICE_THREAD_PRIO;
+#endif
+    msdp->media_busy = FALSE;
+    msdp->media_thread = chThdCreateStatic(msdp->media_wa, sizeof(msdp->media_wa), media_prio, msd_media_thread, msdp);
+#endif
+
+#if !USB_MSD_USE_SERVICE_THREAD
+    /* run the thread, in the configured working area if any */
+    void *wa = config->thread_wa;
+    size_t wa_size = config->thread_wa_size;
+    tprio_t prio = (config->thread_prio != 0) ? config->thread_prio : NORMALPRIO;
+#if USB_MSD_THREAD_WA_SIZE > 0
+    if (wa == NULL) {
+        /* the static working area holds one thread only */
+        chDbgCheck(mass_storage_thread_wa_user == NULL, "msdStart");
+        mass_storage_thread_wa_user = msdp;
+        wa = mass_storage_thread_wa;
+        wa_size = sizeof(mass_storage_thread_wa);
+    }
+#else
+    chDbgCheck(wa != NULL, "msdStart");
+#endif
+    msdp->thread = chThdCreateStatic(wa, wa_size, prio, mass_storage_thread, msdp);
+#else
+    chMtxLock(&msd_instances_mtx);
+
+    /* the service thread is started with the first instance and never stops */
+    if (msd_service_thread == NULL)
+        msd_service_thread = chThdCreateStatic(msd_service_thread_wa, sizeof(msd_service_thread_wa), USB_MSD_SERVICE_THREAD_PRIO, msd_service_thread_main, NULL);
+
+    /* register the instance, its index is its event flag */
+    for (i = 0; i < USB_MSD_MAX_INSTANCES; i++)
+        if (msd_instances[i] == NULL)
+            break;
+    chDbgCheck(i < USB_MSD_MAX_INSTANCES, "msdStart");
+
+    msdp->index = i;
+    msdp->thread = msd_service_thread;
+    msd_instances[i] = msdp;
+
+    chMtxUnlock();
+
+    /* let the service thread attach the media */
+    chEvtSignal(msd_service_thread, MSD_SERVICE_WAKEUP);
+#endif
+
+    /* restarted on a configured bus, the host won't configure it again */
+    chSysLock();
+    if (usbGetDriverStateI(config->usbp) == USB_ACTIVE)
+        msdConfigureHookI(msdp);
+    chSysUnlock();
 }
 
+#if !USB_MSD_USE_SERVICE_THREAD || USB_MSD_USE_WATCHDOG
 /**
- * @brief Stops a USB mass storage driver
+ * @brief Waits for a thread to end, until the stop deadline
  */
-void msdStop(USBMassStorageDriver *msdp) {
+static bool_t msd_wait_thread(Thread *tp, systime_t start, systime_t timeout) {
 
-    chDbgCheck(msdp->thread != NULL, "msdStop");
+    if (timeout == 0) {
+        chThdWait(tp);
+        return CH_SUCCESS;
+    }
 
-    /* notify the thread that it's over */
-    chThdTerminate(msdp->thread);
+    while (!chThdTerminated(tp)) {
+        if (chTimeNow() - start >= timeout)
+            return CH_FAILED;
+        chThdSleep(1);
+    }
 
-    /* wake the thread up and wait until it ends */
-    chBSemSignal(&msdp->bsem);
-    chThdWait(msdp->thread);
-    msdp->thread = NULL;
+    chThdWait(tp);
+    return CH_SUCCESS;
+}
+#endif
+
+/**
+ * @brief Stops a USB mass storage driver
+ */
+bool_t msdStop(USBMassStorageDriver *msdp) {
+
+    systime_t start = chTimeNow();
+    systime_t timeout;
+
+    chDbgCheck((msdp != NULL) && (msdp->config != NULL), "msdStop");
+    timeout = msdp->config->stop_timeout;
+
+    /* cancel the command in progress at its next preemption point */
+    msdp->stopping = TRUE;
+#if USB_MSD_USE_WATCHDOG
+    /* stop waiting for the media access in progress, if any */
+    chBSemSignal(&msdp->media_done);
+#endif
+
+#if !USB_MSD_USE_SERVICE_THREAD
+    if (msdp->thread != NULL) {
+        /* notify the thread that it's over */
+        chThdTerminate(msdp->thread);
+
+        /* wake the thread up and wait until it ends, the cache is written back */
+        chBSemSignal(&msdp->bsem);
+        if (msd_wait_thread(msdp->thread, start, timeout) == CH_FAILED)
+            return CH_FAILED;
+        msdp->thread = NULL;
+#if USB_MSD_THREAD_WA_SIZE > 0
+        if (mass_storage_thread_wa_user == msdp)
+            mass_storage_thread_wa_user = NULL;
+#endif
+    }
+#else
+    if (msdp->thread != NULL) {
+        /* unregister the instance, the service thread isn't stepping it */
+        if (timeout == 0) {
+            chMtxLock(&msd_instances_mtx);
+        } else {
+            while (!chMtxTryLock(&msd_instances_mtx)) {
+                if (chTimeNow() - start >= timeout)
+                    return CH_FAILED;
+                chThdSleep(1);
+            }
+        }
+
+        if (msd_instances[msdp->index] == msdp)
+            msd_instances[msdp->index] = NULL;
+#if USB_MSD_USE_METADATA_CACHE
+        if (msd_media_available(msdp))
+            msd_cache_flush(msdp);
+#endif
+        chMtxUnlock();
+        msdp->thread = NULL;
+    }
+#endif
+
+#if USB_MSD_USE_WATCHDOG
+    if (msdp->media_thread != NULL) {
+        /* stop the media worker once its access, if any, has returned */
+        chThdTerminate(msdp->media_thread);
+        chBSemSignal(&msdp->media_start);
+        if (msd_wait_thread(msdp->media_thread, start, timeout) == CH_FAILED)
+            return CH_FAILED;
+        msdp->media_thread = NULL;
+    }
+#endif
+
+    /* cancel the USB transfer in progress, if any */
+    chSysLock();
+    if (usbGetDriverStateI(msdp->config->usbp) == USB_ACTIVE) {
+        usbInitEndpointI(msdp->config->usbp, msdp->config->bulk_ep, &msdp->ep_config);
+#if USB_MSD_TRACE_LEVEL >= 1
+        if (msdp->config->trace_ep != 0)
+            usbInitEndpointI(msdp->config->usbp, msdp->config->trace_ep, &msdp->trace_ep_config);
+#endif
+    }
+    chSysUnlock();
 
     /* release the user params in the USB driver */
     msdp->config->usbp->in_params[msdp->config->bulk_ep] = NULL;
     msdp->config->usbp->out_params[msdp->config->bulk_ep] = NULL;
+#if USB_MSD_TRACE_LEVEL >= 1
+    if (msdp->config->trace_ep != 0)
+        msdp->config->usbp->in_params[msdp->config->trace_ep] = NULL;
+#endif
+
+    return CH_SUCCESS;
+}
+
+/**
+ * @brief Passes a media request to the thread driving an instance
+ * @details The request is served between two commands, this function returns
+ *          once it has been.
+ */
+static void msd_post_media_request(USBMassStorageDriver *msdp, uint8_t request) {
+
+    msdp->media_request = request;
+
+#if USB_MSD_USE_SERVICE_THREAD
+    chEvtSignal(msd_service_thread, MSD_SERVICE_WAKEUP);
+#else
+    /* a reset wakes the thread up without completing a transfer */
+    chSysLock();
+    if (chBSemGetStateI(&msdp->bsem))
+        chBSemResetI(&msdp->bsem, TRUE);
+    chSchRescheduleS();
+    chSysUnlock();
+#endif
+
+    chBSemWait(&msdp->media_ack);
+}
+
+/**
+ * @brief Removes the medium
+ */
+void msdEjectMedia(USBMassStorageDriver *msdp) {
+
+    chDbgCheck((msdp != NULL) && (msdp->thread != NULL), "msdEjectMedia");
+
+    msd_post_media_request(msdp, MSD_MEDIA_REQUEST_EJECT);
+}
+
+/**
+ * @brief Gives the medium back to the host
+ */
+void msdInsertMedia(USBMassStorageDriver *msdp) {
+
+    chDbgCheck((msdp != NULL) && (msdp->thread != NULL), "msdInsertMedia");
+
+    msd_post_media_request(msdp, MSD_MEDIA_REQUEST_INSERT);
+}
+
+#if USB_MSD_USE_PROFILER
+/**
+ * @brief Copies the I/O pattern profile
+ */
+void msdGetProfile(USBMassStorageDriver *msdp, msd_profile_t *profile) {
+
+    chDbgCheck((msdp != NULL) && (profile != NULL), "msdGetProfile");
+
+    chSysLock();
+    *profile = msdp->profile;
+    chSysUnlock();
+}
+
+/**
+ * @brief Clears the I/O pattern profile
+ */
+void msdResetProfile(USBMassStorageDriver *msdp) {
+
+    chDbgCheck(msdp != NULL, "msdResetProfile");
+
+    chSysLock();
+    memset(&msdp->profile, 0, sizeof(msdp->profile));
+    chSysUnlock();
+}
+#endif /* USB_MSD_USE_PROFILER */
+
+#if USB_MSD_USE_CYCLE_PROFILE
+/**
+ * @brief Copies the cost table of the command processing
+ */
+void msdGetCycleProfile(USBMassStorageDriver *msdp, msd_cycle_profile_t *profile) {
+
+    chDbgCheck((msdp != NULL) && (profile != NULL), "msdGetCycleProfile");
+
+    chSysLock();
+    *profile = msdp->cycles;
+    chSysUnlock();
+}
+
+/**
+ * @brief Clears the cost table of the command processing
+ */
+void msdResetCycleProfile(USBMassStorageDriver *msdp) {
+
+    chDbgCheck(msdp != NULL, "msdResetCycleProfile");
+
+    chSysLock();
+    memset(&msdp->cycles, 0, sizeof(msdp->cycles));
+    chSysUnlock();
+}
+#endif /* USB_MSD_USE_CYCLE_PROFILE */
+
+#if USB_MSD_USE_QOS
+/**
+ * @brief Limits the host bandwidth
+ */
+void msdSetBandwidthLimit(USBMassStorageDriver *msdp, uint32_t bytes_per_sec, uint32_t iops) {
+
+    chDbgCheck(msdp != NULL, "msdSetBandwidthLimit");
+
+    chSysLock();
+    msdp->qos.bandwidth.rate = bytes_per_sec;
+    msdp->qos.bandwidth.tokens = 0;
+    msdp->qos.bandwidth.last_refill = chTimeNow();
+    msdp->qos.iops.rate = iops;
+    msdp->qos.iops.tokens = 0;
+    msdp->qos.iops.last_refill = chTimeNow();
+    chSysUnlock();
+}
+
+/**
+ * @brief Gives the firmware I/O priority over the host I/O
+ */
+void msdSetFirmwarePriority(USBMassStorageDriver *msdp, bool_t enable) {
+
+    chDbgCheck(msdp != NULL, "msdSetFirmwarePriority");
+
+    chSysLock();
+    msdp->qos.firmware_priority = enable;
+    if (!enable)
+        chBSemSignalI(&msdp->qos.firmware_idle);
+    chSchRescheduleS();
+    chSysUnlock();
+}
+
+/**
+ * @brief Notifies the driver that the firmware starts accessing the media
+ */
+void msdFirmwareIOBegin(USBMassStorageDriver *msdp) {
+
+    chDbgCheck(msdp != NULL, "msdFirmwareIOBegin");
+
+    chSysLock();
+    if (msdp->qos.firmware_io++ == 0)
+        chBSemResetI(&msdp->qos.firmware_idle, TRUE);
+    chSysUnlock();
+}
+
+/**
+ * @brief Notifies the driver that the firmware is done with the media
+ */
+void msdFirmwareIOEnd(USBMassStorageDriver *msdp) {
+
+    chDbgCheck(msdp != NULL, "msdFirmwareIOEnd");
+
+    chSysLock();
+    if ((msdp->qos.firmware_io > 0) && (--msdp->qos.firmware_io == 0))
+        chBSemSignalI(&msdp->qos.firmware_idle);
+    chSchRescheduleS();
+    chSysUnlock();
 }
+#endif /* USB_MSD_USE_QOS */
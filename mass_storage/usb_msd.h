@@ -9,6 +9,243 @@
 #include "ch.h"
 #include "hal.h"
 
+/* optional application settings, see templates/usbmsdconf.h */
+#if defined(__has_include)
+#if __has_include("usbmsdconf.h")
+#include "usbmsdconf.h"
+#endif
+#elif defined(USB_MSD_USE_CONF)
+#include "usbmsdconf.h"
+#endif
+
+/**
+ * @brief   Fixed block size of the exported media, in bytes.
+ * @details When not zero, the transfers are sized at compile time and media
+ *          with another block size are not attached. Zero means that the
+ *          block size is read from the block device.
+ */
+#if !defined(USB_MSD_BLOCK_SIZE) || defined(__DOXYGEN__)
+#define USB_MSD_BLOCK_SIZE 0
+#endif
+
+/**
+ * @brief   Largest block size supported when it is read from the block device.
+ */
+#if !defined(USB_MSD_MAX_BLOCK_SIZE) || defined(__DOXYGEN__)
+#define USB_MSD_MAX_BLOCK_SIZE 512
+#endif
+
+/**
+ * @brief   Number of blocks in each of the two transfer buffers.
+ * @details Deeper buffers let READ_10 and WRITE_10 move several blocks per
+ *          block device and USB transfer.
+ */
+#if !defined(USB_MSD_BUFFER_BLOCKS) || defined(__DOXYGEN__)
+#define USB_MSD_BUFFER_BLOCKS 1
+#endif
+
+/**
+ * @brief   Statistics level.
+ * @details 0 disables the statistics, 1 records the attach, warm-up and mount
+ *          latencies, 2 also accounts the READ_10 and WRITE_10 transfers.
+ */
+#if !defined(USB_MSD_STATS_LEVEL) || defined(__DOXYGEN__)
+#define USB_MSD_STATS_LEVEL 1
+#endif
+
+/**
+ * @brief   Enables the I/O pattern profiler.
+ * @details READ_10 and WRITE_10 are accounted in an LBA heatmap, a transfer
+ *          size histogram and sequentiality and alignment counters, their
+ *          size being independent of the volume size.
+ */
+#if !defined(USB_MSD_USE_PROFILER) || defined(__DOXYGEN__)
+#define USB_MSD_USE_PROFILER FALSE
+#endif
+
+/**
+ * @brief   Number of buckets of the LBA heatmap, the volume is evenly split
+ *          between them.
+ */
+#if !defined(USB_MSD_PROFILER_BUCKETS) || defined(__DOXYGEN__)
+#define USB_MSD_PROFILER_BUCKETS 64
+#endif
+
+/**
+ * @brief   Number of buckets of the transfer size histogram.
+ * @details Bucket n counts the transfers of 2^n to 2^(n+1) - 1 blocks, the
+ *          last bucket also counts the larger transfers.
+ */
+#if !defined(USB_MSD_PROFILER_SIZE_BUCKETS) || defined(__DOXYGEN__)
+#define USB_MSD_PROFILER_SIZE_BUCKETS 8
+#endif
+
+/**
+ * @brief   Number of alignment boundaries checked by the profiler.
+ */
+#if !defined(USB_MSD_PROFILER_ALIGNMENTS) || defined(__DOXYGEN__)
+#define USB_MSD_PROFILER_ALIGNMENTS 3
+#endif
+
+/**
+ * @brief   Enables the hot path cycle profiling.
+ * @details The cycles spent in each phase of the command processing are
+ *          accumulated in a cost table, counted by the DWT cycle counter on
+ *          Cortex-M and in nanoseconds of the monotonic clock on a host build
+ *          (see @p USB_MSD_CYCLES).
+ */
+#if !defined(USB_MSD_USE_CYCLE_PROFILE) || defined(__DOXYGEN__)
+#define USB_MSD_USE_CYCLE_PROFILE FALSE
+#endif
+
+/**
+ * @brief   Number of opcodes whose command cost is profiled.
+ * @details The slots are taken by the opcodes in the order the host first
+ *          sends them, the commands of further opcodes are not accounted.
+ */
+#if !defined(USB_MSD_CYCLE_OPCODES) || defined(__DOXYGEN__)
+#define USB_MSD_CYCLE_OPCODES 16
+#endif
+
+/**
+ * @brief   Trace level.
+ * @details 0 disables the trace, 1 records the command and status blocks and
+ *          the resets, 2 also the USB transfers and the media accesses. The
+ *          records are streamed to the host on a vendor bulk IN end-point,
+ *          they are dropped while the host doesn't read them.
+ */
+#if !defined(USB_MSD_TRACE_LEVEL) || defined(__DOXYGEN__)
+#define USB_MSD_TRACE_LEVEL 0
+#endif
+
+/**
+ * @brief   Number of records in the trace ring buffer, a power of two.
+ */
+#if !defined(USB_MSD_TRACE_RECORDS) || defined(__DOXYGEN__)
+#define USB_MSD_TRACE_RECORDS 64
+#endif
+
+/**
+ * @brief   Enables the optional SCSI commands.
+ * @note    Disabled commands are rejected with ILLEGAL REQUEST. Most hosts
+ *          need MODE_SENSE_6, Windows also needs READ_FORMAT_CAPACITIES.
+ */
+#if !defined(USB_MSD_USE_CMD_MODE_SENSE_6) || defined(__DOXYGEN__)
+#define USB_MSD_USE_CMD_MODE_SENSE_6 TRUE
+#endif
+#if !defined(USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES) || defined(__DOXYGEN__)
+#define USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES TRUE
+#endif
+#if !defined(USB_MSD_USE_CMD_SEND_DIAGNOSTIC) || defined(__DOXYGEN__)
+#define USB_MSD_USE_CMD_SEND_DIAGNOSTIC TRUE
+#endif
+#if !defined(USB_MSD_USE_CMD_START_STOP_UNIT) || defined(__DOXYGEN__)
+#define USB_MSD_USE_CMD_START_STOP_UNIT TRUE
+#endif
+#if !defined(USB_MSD_USE_CMD_SYNCHRONIZE_CACHE_10) || defined(__DOXYGEN__)
+#define USB_MSD_USE_CMD_SYNCHRONIZE_CACHE_10 TRUE
+#endif
+
+/**
+ * @brief   Enables LOG SENSE and LOG SELECT.
+ * @details The statistics are reported in the standard error counter and
+ *          general statistics log pages, and in a vendor specific page with
+ *          the READ_10/WRITE_10 latency histogram. Requires
+ *          @p USB_MSD_STATS_LEVEL 2.
+ */
+#if !defined(USB_MSD_USE_CMD_LOG_SENSE) || defined(__DOXYGEN__)
+#define USB_MSD_USE_CMD_LOG_SENSE FALSE
+#endif
+
+/**
+ * @brief   Number of buckets of the READ_10/WRITE_10 latency histogram.
+ * @details Bucket 0 counts the commands completed within a system tick,
+ *          bucket n the ones that took 2^(n-1) to 2^n - 1 ticks. The last
+ *          bucket also counts the slower commands.
+ */
+#if !defined(USB_MSD_LATENCY_BUCKETS) || defined(__DOXYGEN__)
+#define USB_MSD_LATENCY_BUCKETS 16
+#endif
+
+/**
+ * @brief   Enables the vital product data pages of INQUIRY.
+ */
+#if !defined(USB_MSD_USE_VPD) || defined(__DOXYGEN__)
+#define USB_MSD_USE_VPD TRUE
+#endif
+
+/**
+ * @brief   Default working area size of the mass storage thread.
+ * @details The static working area is shared by the instances without a
+ *          @p thread_wa, one at a time. Zero leaves it out, @p thread_wa
+ *          being then required.
+ */
+#if !defined(USB_MSD_THREAD_WA_SIZE) || defined(__DOXYGEN__)
+#define USB_MSD_THREAD_WA_SIZE 1024
+#endif
+
+/**
+ * @brief   Drives all the driver instances from a single service thread.
+ * @details Instead of one thread per instance blocking on each USB transfer,
+ *          the instances are resumable state machines stepped by a shared
+ *          thread whenever one of their transfers completes.
+ */
+#if !defined(USB_MSD_USE_SERVICE_THREAD) || defined(__DOXYGEN__)
+#define USB_MSD_USE_SERVICE_THREAD FALSE
+#endif
+
+/**
+ * @brief   Maximum number of instances driven by the service thread.
+ */
+#if !defined(USB_MSD_MAX_INSTANCES) || defined(__DOXYGEN__)
+#define USB_MSD_MAX_INSTANCES 4
+#endif
+
+/**
+ * @brief   Working area size of the service thread.
+ */
+#if !defined(USB_MSD_SERVICE_THREAD_WA_SIZE) || defined(__DOXYGEN__)
+#define USB_MSD_SERVICE_THREAD_WA_SIZE 1024
+#endif
+
+/**
+ * @brief   Priority of the service thread.
+ */
+#if !defined(USB_MSD_SERVICE_THREAD_PRIO) || defined(__DOXYGEN__)
+#define USB_MSD_SERVICE_THREAD_PRIO NORMALPRIO
+#endif
+
+/**
+ * @brief   Interval at which the block device is polled until it is ready.
+ */
+#if !defined(USB_MSD_ATTACH_POLL_INTERVAL) || defined(__DOXYGEN__)
+#define USB_MSD_ATTACH_POLL_INTERVAL MS2ST(50)
+#endif
+
+/**
+ * @brief   Enables the file system metadata cache.
+ * @details The boot sector of the exported volume is parsed when the driver
+ *          starts, and the FAT and root directory blocks are kept in a
+ *          dedicated write-back cache that data transfers never evict.
+ */
+#if !defined(USB_MSD_USE_METADATA_CACHE) || defined(__DOXYGEN__)
+#define USB_MSD_USE_METADATA_CACHE FALSE
+#endif
+
+/**
+ * @brief   Number of 512 bytes blocks in the metadata cache.
+ */
+#if !defined(USB_MSD_METADATA_CACHE_BLOCKS) || defined(__DOXYGEN__)
+#define USB_MSD_METADATA_CACHE_BLOCKS 32
+#endif
+
+/**
+ * @brief   Idle time after which the dirty metadata blocks are written back.
+ */
+#if !defined(USB_MSD_METADATA_FLUSH_DELAY) || defined(__DOXYGEN__)
+#define USB_MSD_METADATA_FLUSH_DELAY MS2ST(500)
+#endif
+
 /**
  * @brief Command Block Wrapper structure
  */
@@ -57,13 +294,480 @@ PACK_STRUCT_BEGIN typedef struct
     uint8_t product_rev[4];
 } PACK_STRUCT_STRUCT msd_scsi_inquiry_response_t PACK_STRUCT_END;
 
+/**
+ * @brief   Enables the boot-time cache warm-up.
+ * @details The mass storage thread pre-reads a set of block ranges into the
+ *          metadata cache while waiting for the USB device to be configured.
+ *          By default the partition table, boot sector, head of the FAT and
+ *          root directory are loaded.
+ */
+#if !defined(USB_MSD_USE_WARMUP) || defined(__DOXYGEN__)
+#define USB_MSD_USE_WARMUP FALSE
+#endif
+
+/**
+ * @brief   Number of FAT blocks loaded by the default warm-up set.
+ */
+#if !defined(USB_MSD_WARMUP_FAT_BLOCKS) || defined(__DOXYGEN__)
+#define USB_MSD_WARMUP_FAT_BLOCKS 8
+#endif
+
+/**
+ * @brief   Enables the host bandwidth throttling.
+ * @details Token buckets limit the bandwidth and the number of READ_10 and
+ *          WRITE_10 commands per second of the host, and the host I/O can be
+ *          deferred while the firmware accesses the media.
+ * @note    Not available with @p USB_MSD_USE_SERVICE_THREAD.
+ */
+#if !defined(USB_MSD_USE_QOS) || defined(__DOXYGEN__)
+#define USB_MSD_USE_QOS FALSE
+#endif
+
+/**
+ * @brief   Burst allowed by the token buckets, as a duration at full rate.
+ */
+#if !defined(USB_MSD_QOS_BURST) || defined(__DOXYGEN__)
+#define USB_MSD_QOS_BURST MS2ST(100)
+#endif
+
+/**
+ * @brief   Longest time a host transfer is deferred for the firmware I/O.
+ * @note    The host is still served, one piece of transfer per period.
+ */
+#if !defined(USB_MSD_QOS_MAX_DEFER) || defined(__DOXYGEN__)
+#define USB_MSD_QOS_MAX_DEFER MS2ST(100)
+#endif
+
+/**
+ * @brief   Enables the media watchdog.
+ * @details The block device is accessed by a worker thread so that a READ_10
+ *          or WRITE_10 whose media access outlasts the @p media_timeout of the
+ *          configuration is failed right away, the driver reporting NOT READY
+ *          until the media access returns.
+ */
+#if !defined(USB_MSD_USE_WATCHDOG) || defined(__DOXYGEN__)
+#define USB_MSD_USE_WATCHDOG FALSE
+#endif
+
+/**
+ * @brief   Working area size of the media worker thread.
+ */
+#if !defined(USB_MSD_MEDIA_THREAD_WA_SIZE) || defined(__DOXYGEN__)
+#define USB_MSD_MEDIA_THREAD_WA_SIZE 512
+#endif
+
+#if USB_MSD_USE_WARMUP && !USB_MSD_USE_METADATA_CACHE
+#error "USB_MSD_USE_WARMUP requires USB_MSD_USE_METADATA_CACHE"
+#endif
+
+/* the throttling sleeps in the thread, which would stall all the instances */
+#if USB_MSD_USE_QOS && USB_MSD_USE_SERVICE_THREAD
+#error "USB_MSD_USE_QOS can't be used with USB_MSD_USE_SERVICE_THREAD"
+#endif
+
+#if (USB_MSD_BLOCK_SIZE != 0) && (USB_MSD_BLOCK_SIZE != 512) && \
+    (USB_MSD_BLOCK_SIZE != 1024) && (USB_MSD_BLOCK_SIZE != 2048) && \
+    (USB_MSD_BLOCK_SIZE != 4096)
+#error "USB_MSD_BLOCK_SIZE must be 0 or a power of two from 512 to 4096"
+#endif
+
+#if (USB_MSD_MAX_BLOCK_SIZE != 512) && (USB_MSD_MAX_BLOCK_SIZE != 1024) && \
+    (USB_MSD_MAX_BLOCK_SIZE != 2048) && (USB_MSD_MAX_BLOCK_SIZE != 4096)
+#error "USB_MSD_MAX_BLOCK_SIZE must be a power of two from 512 to 4096"
+#endif
+
+#if USB_MSD_BLOCK_SIZE > USB_MSD_MAX_BLOCK_SIZE
+#error "USB_MSD_BLOCK_SIZE is larger than USB_MSD_MAX_BLOCK_SIZE"
+#endif
+
+#if USB_MSD_USE_METADATA_CACHE && (USB_MSD_BLOCK_SIZE != 0) && (USB_MSD_BLOCK_SIZE != 512)
+#error "USB_MSD_USE_METADATA_CACHE requires 512 bytes blocks"
+#endif
+
+#if (USB_MSD_BUFFER_BLOCKS < 1) || (USB_MSD_BUFFER_BLOCKS > 64)
+#error "USB_MSD_BUFFER_BLOCKS must be between 1 and 64"
+#endif
+
+#if (USB_MSD_STATS_LEVEL < 0) || (USB_MSD_STATS_LEVEL > 2)
+#error "USB_MSD_STATS_LEVEL must be 0, 1 or 2"
+#endif
+
+#if USB_MSD_USE_PROFILER && ((USB_MSD_PROFILER_BUCKETS < 1) || (USB_MSD_PROFILER_SIZE_BUCKETS < 1) || \
+                             (USB_MSD_PROFILER_SIZE_BUCKETS > 17) || (USB_MSD_PROFILER_ALIGNMENTS < 1))
+#error "invalid USB_MSD_PROFILER_xxx setting"
+#endif
+
+#if (USB_MSD_TRACE_LEVEL < 0) || (USB_MSD_TRACE_LEVEL > 2)
+#error "USB_MSD_TRACE_LEVEL must be 0, 1 or 2"
+#endif
+
+#if (USB_MSD_TRACE_RECORDS < 2) || (USB_MSD_TRACE_RECORDS & (USB_MSD_TRACE_RECORDS - 1))
+#error "USB_MSD_TRACE_RECORDS must be a power of two"
+#endif
+
+#if USB_MSD_USE_CMD_LOG_SENSE && (USB_MSD_STATS_LEVEL < 2)
+#error "USB_MSD_USE_CMD_LOG_SENSE requires USB_MSD_STATS_LEVEL 2"
+#endif
+
+#if (USB_MSD_LATENCY_BUCKETS < 1) || (USB_MSD_LATENCY_BUCKETS > 32)
+#error "USB_MSD_LATENCY_BUCKETS must be between 1 and 32"
+#endif
+
+#if USB_MSD_USE_SERVICE_THREAD && ((USB_MSD_MAX_INSTANCES < 1) || (USB_MSD_MAX_INSTANCES > 31))
+#error "USB_MSD_MAX_INSTANCES must be between 1 and 31"
+#endif
+
+/**
+ * @brief   Size of a block in the transfer buffers.
+ */
+#if USB_MSD_BLOCK_SIZE != 0
+#define USB_MSD_BUFFER_BLOCK_SIZE USB_MSD_BLOCK_SIZE
+#else
+#define USB_MSD_BUFFER_BLOCK_SIZE USB_MSD_MAX_BLOCK_SIZE
+#endif
+
+/**
+ * @brief Range of blocks
+ */
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} msd_block_range_t;
+
+/**
+ * @brief Driver statistics
+ */
+typedef struct {
+    /**
+    * @brief System time when the USB device got configured
+    */
+    systime_t configured_time;
+
+    /**
+    * @brief Time from the USB configuration to the first root directory
+    *        access by the host, zero until the volume is mounted
+    */
+    systime_t mount_latency;
+
+    /**
+    * @brief Time from the driver start to the media being attached
+    */
+    systime_t attach_latency;
+
+    /**
+    * @brief Number of blocks loaded by the warm-up and time it took
+    */
+    uint32_t warmup_blocks;
+    systime_t warmup_time;
+
+    /**
+    * @brief Number of Bulk-Only Mass Storage Resets received from the host
+    */
+    uint32_t resets;
+
+    /**
+    * @brief Number of commands failed by the media watchdog
+    */
+    uint32_t media_timeouts;
+
+#if (USB_MSD_STATS_LEVEL >= 2) || defined(__DOXYGEN__)
+    /**
+    * @brief Blocks transferred by READ_10 and WRITE_10 and time spent doing
+    *        it, the throughput is blocks * block size / time
+    */
+    uint32_t read_blocks;
+    systime_t read_time;
+    uint32_t write_blocks;
+    systime_t write_time;
+
+    /**
+    * @brief READ_10 and WRITE_10 commands, and those that failed on a media
+    *        error
+    */
+    uint32_t read_commands;
+    uint32_t write_commands;
+    uint32_t read_errors;
+    uint32_t write_errors;
+
+    /**
+    * @brief READ_10 and WRITE_10 latency histogram, see
+    *        @p USB_MSD_LATENCY_BUCKETS
+    */
+    uint32_t latency[USB_MSD_LATENCY_BUCKETS];
+#endif
+} msd_stats_t;
+
+#if USB_MSD_USE_PROFILER || defined(__DOXYGEN__)
+/**
+ * @brief I/O pattern profile
+ */
+typedef struct {
+    /**
+    * @brief Blocks per heatmap bucket, and blocks read and written in each
+    *        bucket
+    */
+    uint32_t bucket_blocks;
+    uint32_t read_heat[USB_MSD_PROFILER_BUCKETS];
+    uint32_t write_heat[USB_MSD_PROFILER_BUCKETS];
+
+    /**
+    * @brief Transfer size histogram, see @p USB_MSD_PROFILER_SIZE_BUCKETS
+    */
+    uint32_t sizes[USB_MSD_PROFILER_SIZE_BUCKETS];
+
+    /**
+    * @brief Commands and blocks per direction, the read/write ratio
+    */
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t read_blocks;
+    uint32_t write_blocks;
+
+    /**
+    * @brief Commands starting at the block following the previous command
+    */
+    uint32_t sequential;
+    uint32_t next_block;
+
+    /**
+    * @brief Commands starting and ending on each boundary of the
+    *        configuration @p profile_alignment
+    */
+    uint32_t aligned[USB_MSD_PROFILER_ALIGNMENTS];
+} msd_profile_t;
+#endif /* USB_MSD_USE_PROFILER */
+
+#if USB_MSD_USE_CYCLE_PROFILE || defined(__DOXYGEN__)
+/**
+ * @brief Phases of the command processing
+ */
+typedef enum {
+    MSD_PHASE_PARSE = 0,    /**< CBW checks and media readiness               */
+    MSD_PHASE_RW_SETUP = 1, /**< READ_10/WRITE_10 decoding and range checks   */
+    MSD_PHASE_USB = 2,      /**< USB transfer prepare and start calls         */
+    MSD_PHASE_MEDIA = 3,    /**< Block device reads and writes                */
+    MSD_PHASE_CALLBACK = 4, /**< Read/write activity callback                 */
+    MSD_PHASE_ISR = 5,      /**< End-point notification                       */
+    MSD_PHASE_WAKEUP = 6,   /**< From the notification to the thread resuming */
+    MSD_PHASES = 7
+} msd_phase_t;
+
+/**
+ * @brief Cost of a phase
+ */
+typedef struct {
+    uint32_t count;
+    uint64_t cycles;
+    uint32_t max;
+} msd_phase_cost_t;
+
+/**
+ * @brief Cost of the commands of an opcode
+ * @details Covers the command block checks, the command handler and the
+ *          status, the media accesses of the handler and the data phase of
+ *          READ_10/WRITE_10 excluded.
+ */
+typedef struct {
+    uint8_t opcode;
+    msd_phase_cost_t cost;
+} msd_opcode_cost_t;
+
+/**
+ * @brief Cost table of the command processing
+ * @details The cost per transferred block of a phase is its cycles divided by
+ *          @p blocks.
+ */
+typedef struct {
+    msd_phase_cost_t phases[MSD_PHASES];
+    uint32_t blocks;
+    msd_opcode_cost_t opcodes[USB_MSD_CYCLE_OPCODES];
+} msd_cycle_profile_t;
+#endif /* USB_MSD_USE_CYCLE_PROFILE */
+
+#if USB_MSD_USE_METADATA_CACHE || defined(__DOXYGEN__)
+/**
+ * @brief Metadata cache block slot
+ */
+typedef struct {
+    uint32_t blk;
+    uint32_t last_use;
+    bool_t dirty;
+} msd_cache_slot_t;
+
+/**
+ * @brief File system metadata cache
+ */
+typedef struct {
+    /**
+    * @brief Blocks of the volume metadata regions, [start; end[
+    */
+    uint32_t boot_blk;
+    uint32_t fat_start, fat_end;
+    uint32_t root_start, root_end;
+
+    /**
+    * @brief Cache content
+    */
+    msd_cache_slot_t slots[USB_MSD_METADATA_CACHE_BLOCKS];
+    uint8_t data[USB_MSD_METADATA_CACHE_BLOCKS][512];
+    uint32_t use_counter;
+    uint32_t dirty_count;
+
+    /**
+    * @brief Number of cached blocks that are not metadata (warm-up blocks),
+    *        they are dropped after their first use
+    */
+    uint32_t warm_count;
+
+    /**
+    * @brief Statistics
+    */
+    uint32_t hits;
+    uint32_t misses;
+} msd_metadata_cache_t;
+#endif /* USB_MSD_USE_METADATA_CACHE */
+
+#if (USB_MSD_TRACE_LEVEL >= 1) || defined(__DOXYGEN__)
+/**
+ * @brief Trace record types
+ * @details The record fields hold:
+ *          - START: USB configured, arg0 the counter frequency, arg1 the
+ *            system time.
+ *          - DROPPED: arg0 records lost while the host wasn't reading.
+ *          - CBW: code the opcode, count the blocks and arg0 the LBA of a
+ *            READ_10/WRITE_10, arg1 the data length.
+ *          - CSW: code the status, arg0 the residue, arg1 the tag.
+ *          - XFER: USB transfer started, code 1 for IN and 0 for OUT, arg0
+ *            the size.
+ *          - MEDIA: code bit 0 set for a write and bit 7 on failure, count
+ *            the blocks, arg0 the LBA, arg1 the duration.
+ *          .
+ *          The times and durations are counted by the HAL realtime counter.
+ */
+#define MSD_TRACE_START     0x01
+#define MSD_TRACE_DROPPED   0x02
+#define MSD_TRACE_CBW       0x10
+#define MSD_TRACE_CSW       0x11
+#define MSD_TRACE_RESET     0x12
+#define MSD_TRACE_XFER      0x20
+#define MSD_TRACE_XFER_DONE 0x21
+#define MSD_TRACE_MEDIA     0x22
+
+/**
+ * @brief Trace record, sent as is (little endian) to the host
+ */
+PACK_STRUCT_BEGIN typedef struct {
+    uint8_t type;
+    uint8_t code;
+    uint16_t count;
+    uint32_t time;
+    uint32_t arg0;
+    uint32_t arg1;
+} PACK_STRUCT_STRUCT msd_trace_record_t PACK_STRUCT_END;
+#endif /* USB_MSD_TRACE_LEVEL >= 1 */
+
+/**
+ * @brief Response to a READ_CAPACITY_10 SCSI command
+ */
+PACK_STRUCT_BEGIN typedef struct {
+    uint32_t last_block_addr;
+    uint32_t block_size;
+} PACK_STRUCT_STRUCT msd_scsi_read_capacity_10_response_t PACK_STRUCT_END;
+
+/**
+ * @brief Response to a READ_FORMAT_CAPACITIES SCSI command
+ */
+PACK_STRUCT_BEGIN typedef struct {
+    uint8_t reserved[3];
+    uint8_t capacity_list_length;
+    uint32_t block_count;
+    uint32_t desc_and_block_length;
+} PACK_STRUCT_STRUCT msd_scsi_read_format_capacities_response_t PACK_STRUCT_END;
+
+#if USB_MSD_USE_VPD || defined(__DOXYGEN__)
+/**
+ * @brief Longest unit serial number, longer ones are truncated
+ */
+#define MSD_VPD_SERIAL_SIZE 32
+#endif
+
+#if USB_MSD_USE_CMD_LOG_SENSE || defined(__DOXYGEN__)
+/**
+ * @brief Size of the log page buffer
+ * @details Holds the vendor page, 8 bytes per parameter, or the 80 bytes of
+ *          the general statistics page when there are few latency buckets.
+ */
+#define MSD_LOG_PAGE_SIZE (4 + 8 * (USB_MSD_LATENCY_BUCKETS + 7) + 16)
+#endif
+
+/**
+ * @brief Responses to the host probe commands, built when the media is attached
+ * @note  The log pages are built on request.
+ */
+typedef struct {
+    msd_scsi_read_capacity_10_response_t read_capacity_10;
+#if USB_MSD_USE_CMD_READ_FORMAT_CAPACITIES || defined(__DOXYGEN__)
+    msd_scsi_read_format_capacities_response_t read_format_capacities;
+#endif
+#if USB_MSD_USE_CMD_MODE_SENSE_6 || defined(__DOXYGEN__)
+    uint8_t mode_sense_6[4];
+#endif
+#if USB_MSD_USE_VPD || defined(__DOXYGEN__)
+    uint8_t vpd_page[4 + MSD_VPD_SERIAL_SIZE];
+#endif
+#if USB_MSD_USE_CMD_LOG_SENSE || defined(__DOXYGEN__)
+    uint8_t log_page[MSD_LOG_PAGE_SIZE];
+#endif
+} msd_scsi_responses_t;
+
+#if USB_MSD_USE_QOS || defined(__DOXYGEN__)
+/**
+ * @brief Token bucket
+ */
+typedef struct {
+    /**
+    * @brief Tokens per second, zero for no limit
+    */
+    uint32_t rate;
+
+    /**
+    * @brief Available tokens, negative while in debt
+    */
+    int32_t tokens;
+    systime_t last_refill;
+} msd_token_bucket_t;
+
+/**
+ * @brief Host bandwidth throttling state
+ */
+typedef struct {
+    msd_token_bucket_t bandwidth;
+    msd_token_bucket_t iops;
+
+    /**
+    * @brief Defer the host I/O while the firmware accesses the media
+    */
+    bool_t firmware_priority;
+    uint32_t firmware_io;
+    BinarySemaphore firmware_idle;
+
+    /**
+    * @brief Statistics, time the host I/O has been throttled and deferred
+    */
+    systime_t throttled_time;
+    systime_t deferred_time;
+} msd_qos_t;
+#endif /* USB_MSD_USE_QOS */
+
 /**
  * @brief Possible states for the USB mass storage driver
  */
 typedef enum {
     MSD_IDLE,
     MSD_READ_COMMAND_BLOCK,
-    MSD_EJECTED
+    MSD_READ_10,
+    MSD_WRITE_10,
+    MSD_SEND_STATUS
 } msd_state_t;
 
 /**
@@ -111,6 +815,101 @@ typedef struct {
     */
     uint8_t short_product_version[4];
 
+    /**
+    * @brief Optional working area of the mass storage thread
+    * @note  When NULL, a static working area of @p USB_MSD_THREAD_WA_SIZE
+    *        bytes is used, by one started instance at most. Required when
+    *        @p USB_MSD_THREAD_WA_SIZE is zero. Ignored when
+    *        @p USB_MSD_USE_SERVICE_THREAD is enabled.
+    */
+    void *thread_wa;
+    size_t thread_wa_size;
+
+    /**
+    * @brief Priority of the mass storage thread, @p NORMALPRIO when zero
+    * @note  Ignored when @p USB_MSD_USE_SERVICE_THREAD is enabled.
+    */
+    tprio_t thread_prio;
+
+    /**
+    * @brief Maximum number of blocks read or written between two preemption
+    *        points of READ_10 and WRITE_10, zero for no preemption point
+    * @note  The thread yields to the threads of the same priority at each
+    *        preemption point.
+    */
+    uint32_t yield_blocks;
+
+    /**
+    * @brief Time budget of a command, zero for no budget
+    * @note  Once a command has run longer, the thread sleeps one system tick
+    *        at each preemption point so that the lower priority threads run
+    *        too.
+    */
+    systime_t command_budget;
+
+#if USB_MSD_USE_WARMUP || defined(__DOXYGEN__)
+    /**
+    * @brief Block ranges to load at start-up
+    * @note  When NULL, the partition table, boot sector, FAT head and root
+    *        directory are loaded.
+    */
+    const msd_block_range_t *warmup_ranges;
+
+    /**
+    * @brief Number of entries in @p warmup_ranges
+    */
+    size_t warmup_range_count;
+#endif
+
+    /**
+    * @brief Number of the mass storage interface in the configuration
+    *        descriptor, to which the class requests are addressed
+    */
+    uint8_t interface_number;
+
+    /**
+    * @brief Longest time @p msdStop() waits for the driver to stop, zero to
+    *        wait as long as needed
+    */
+    systime_t stop_timeout;
+
+#if USB_MSD_USE_WATCHDOG || defined(__DOXYGEN__)
+    /**
+    * @brief Time a READ_10 or WRITE_10 may spend accessing the media, zero
+    *        for no limit
+    * @note  Only the block device accesses count, not the USB data phase nor
+    *        the preemption and throttling delays.
+    */
+    systime_t media_timeout;
+#endif
+
+#if USB_MSD_USE_PROFILER || defined(__DOXYGEN__)
+    /**
+    * @brief Alignment boundaries checked by the profiler, in blocks (e.g. 8
+    *        for 4 KiB clusters, the erase block size of the media), zero for
+    *        none
+    */
+    uint32_t profile_alignment[USB_MSD_PROFILER_ALIGNMENTS];
+#endif
+
+#if (USB_MSD_TRACE_LEVEL >= 1) || defined(__DOXYGEN__)
+    /**
+    * @brief Index of the bulk IN end-point streaming the trace, zero to
+    *        disable the trace
+    */
+    usbep_t trace_ep;
+#endif
+
+#if USB_MSD_USE_VPD || defined(__DOXYGEN__)
+    /**
+    * @brief Unit serial number reported in the vital product data, unique
+    *        to each device (e.g. built from the MCU unique ID)
+    * @note  ASCII string, maximum @p MSD_VPD_SERIAL_SIZE characters. When
+    *        NULL, the unit serial number page is not supported.
+    */
+    const char *serial_number;
+#endif
+
 } USBMassStorageConfig;
 
 /**
@@ -120,7 +919,11 @@ typedef struct {
  */
 typedef struct {
     const USBMassStorageConfig* config;
+#if !USB_MSD_USE_SERVICE_THREAD || defined(__DOXYGEN__)
 	BinarySemaphore bsem;
+#else
+	uint32_t index;
+#endif
     Thread* thread;
 	EventSource evt_connected, evt_ejected;
 	BlockDeviceInfo block_dev_info;
@@ -129,7 +932,79 @@ typedef struct {
 	msd_csw_t csw;
 	msd_scsi_sense_response_t sense;
 	msd_scsi_inquiry_response_t inquiry;
+	msd_scsi_responses_t responses;
 	bool_t result;
+	bool_t phase_error;
+	uint32_t data_moved;
+	/* READ_10/WRITE_10 started, its activity ends with the status */
+	bool_t rw_active;
+	bool_t media_attached;
+	bool_t not_ready_reported;
+	bool_t unit_attention;
+	bool_t reset_pending;
+	bool_t stopping;
+	/* medium removed by the host or the firmware */
+	bool_t host_ejected;
+	bool_t firmware_ejected;
+	bool_t media_unsupported;
+	uint8_t media_request;
+	BinarySemaphore media_ack;
+	systime_t start_time;
+	systime_t last_activity;
+	systime_t command_start;
+	USBEndpointConfig ep_config;
+	USBInEndpointState ep_in_state;
+	USBOutEndpointState ep_out_state;
+	/* READ_10 / WRITE_10 in progress */
+	uint32_t rw_block_address;
+	uint32_t rw_total;
+	uint32_t rw_count;
+	uint32_t rw_index;
+#if (USB_MSD_STATS_LEVEL >= 1) || defined(__DOXYGEN__)
+	msd_stats_t stats;
+#endif
+#if USB_MSD_USE_METADATA_CACHE || defined(__DOXYGEN__)
+	msd_metadata_cache_t cache;
+#endif
+#if USB_MSD_USE_QOS || defined(__DOXYGEN__)
+	msd_qos_t qos;
+#endif
+#if USB_MSD_USE_PROFILER || defined(__DOXYGEN__)
+	msd_profile_t profile;
+#endif
+#if USB_MSD_USE_CYCLE_PROFILE || defined(__DOXYGEN__)
+	msd_cycle_profile_t cycles;
+	uint32_t cycles_command;
+	uint32_t cycles_signal;
+	bool_t cycles_signaled;
+#endif
+#if USB_MSD_USE_WATCHDOG || defined(__DOXYGEN__)
+	/* media access run by the worker thread */
+	Thread *media_thread;
+	BinarySemaphore media_start;
+	BinarySemaphore media_done;
+	bool_t media_busy;
+	bool_t media_timed_out;
+	/* time spent in the media accesses of the command */
+	systime_t media_time;
+	bool_t media_write;
+	uint32_t media_blk;
+	uint8_t *media_buffer;
+	uint32_t media_count;
+	bool_t media_result;
+	WORKING_AREA(media_wa, USB_MSD_MEDIA_THREAD_WA_SIZE);
+#endif
+#if (USB_MSD_TRACE_LEVEL >= 1) || defined(__DOXYGEN__)
+	/* trace ring buffer, the records from tail to head are not sent yet */
+	USBEndpointConfig trace_ep_config;
+	USBInEndpointState trace_in_state;
+	msd_trace_record_t trace[USB_MSD_TRACE_RECORDS];
+	uint32_t trace_head;
+	uint32_t trace_tail;
+	uint32_t trace_sending;
+	uint32_t trace_dropped;
+#endif
+	uint8_t rw_buf[2][USB_MSD_BUFFER_BLOCKS * USB_MSD_BUFFER_BLOCK_SIZE];
 } USBMassStorageDriver;
 
 #ifdef __cplusplus
@@ -144,18 +1019,32 @@ void msdInit(USBMassStorageDriver *msdp);
 /**
  * @brief   Starts a USB mass storage driver.
  * @details This function is sufficient to have USB mass storage running, it internally
- *          runs a thread that handles USB requests and transfers.
- *          The block device must be connected but no file system must be mounted,
+ *          runs a thread that handles USB requests and transfers, or registers the
+ *          driver to the shared service thread when @p USB_MSD_USE_SERVICE_THREAD
+ *          is enabled.
+ *          The function doesn't wait for the block device, so the USB driver can
+ *          be started right away: the host is answered NOT READY until the block
+ *          device is ready, then the media is attached and reported with a UNIT
+ *          ATTENTION. No file system must be mounted on the block device,
  *          everything is handled by the host system.
+ *          When the USB device is already configured, e.g. after @p msdStop(),
+ *          the driver waits for a command block right away.
  */
 void msdStart(USBMassStorageDriver *msdp, const USBMassStorageConfig *config);
 
 /**
  * @brief   Stops a USB mass storage driver.
- * @details This function waits for current tasks to be finished, if any, and then
- *          stops the mass storage thread.
+ * @details The command in progress is cancelled at its next preemption point,
+ *          the USB transfer in progress is cancelled and the metadata cache
+ *          is written back. If the driver isn't stopped within the
+ *          @p stop_timeout of the configuration, the function returns and
+ *          can be called again to complete the stop.
+ *
+ * @return              The operation status.
+ * @retval CH_SUCCESS   The driver is stopped.
+ * @retval CH_FAILED    The driver is still stopping.
  */
-void msdStop(USBMassStorageDriver *msdp);
+bool_t msdStop(USBMassStorageDriver *msdp);
 
 /**
  * @brief   USB device configured handler.
@@ -171,7 +1060,8 @@ void msdConfigureHookI(USBMassStorageDriver *msdp);
  * @details Applications wanting to use the Mass Storage over USB driver can use
  *          this function as requests hook in the USB configuration.
  *          The following requests are emulated:
- *          - MSD_REQ_RESET.
+ *          - MSD_REQ_RESET, the transfer in progress is aborted and the
+ *            driver waits for a new command block.
  *          - MSD_GET_MAX_LUN.
  *          .
  *
@@ -182,6 +1072,92 @@ void msdConfigureHookI(USBMassStorageDriver *msdp);
  */
 bool_t msdRequestsHook(USBDriver *usbp);
 
+/**
+ * @brief   Removes the medium, so that the firmware can use the media.
+ * @details Waits for the command in progress, writes the metadata cache back
+ *          and reports the medium as not present to the host. The USB device
+ *          stays enumerated.
+ *
+ * @param[in] msdp      pointer to the @p USBMassStorageDriver object
+ */
+void msdEjectMedia(USBMassStorageDriver *msdp);
+
+/**
+ * @brief   Gives the medium back to the host.
+ * @details The media is attached again, the host being notified by a UNIT
+ *          ATTENTION. This also reverts an eject by the host, and retries a
+ *          medium that had an unsupported block size (@p media_unsupported).
+ *          While a media access abandoned by the watchdog has not returned,
+ *          the media is attached once it has.
+ *
+ * @param[in] msdp      pointer to the @p USBMassStorageDriver object
+ */
+void msdInsertMedia(USBMassStorageDriver *msdp);
+
+#if USB_MSD_USE_PROFILER || defined(__DOXYGEN__)
+/**
+ * @brief   Copies the I/O pattern profile.
+ *
+ * @param[in] msdp      pointer to the @p USBMassStorageDriver object
+ * @param[out] profile  copy of the profile
+ */
+void msdGetProfile(USBMassStorageDriver *msdp, msd_profile_t *profile);
+
+/**
+ * @brief   Clears the I/O pattern profile.
+ *
+ * @param[in] msdp      pointer to the @p USBMassStorageDriver object
+ */
+void msdResetProfile(USBMassStorageDriver *msdp);
+#endif
+
+#if USB_MSD_USE_CYCLE_PROFILE || defined(__DOXYGEN__)
+/**
+ * @brief   Copies the cost table of the command processing.
+ *
+ * @param[in] msdp      pointer to the @p USBMassStorageDriver object
+ * @param[out] profile  copy of the cost table
+ */
+void msdGetCycleProfile(USBMassStorageDriver *msdp, msd_cycle_profile_t *profile);
+
+/**
+ * @brief   Clears the cost table of the command processing.
+ *
+ * @param[in] msdp      pointer to the @p USBMassStorageDriver object
+ */
+void msdResetCycleProfile(USBMassStorageDriver *msdp);
+#endif
+
+#if USB_MSD_USE_QOS || defined(__DOXYGEN__)
+/**
+ * @brief   Limits the host bandwidth.
+ *
+ * @param[in] msdp      pointer to the @p USBMassStorageDriver object
+ * @param[in] bytes_per_sec  READ_10 and WRITE_10 data rate, zero for no limit
+ * @param[in] iops      READ_10 and WRITE_10 commands per second, zero for no
+ *                      limit
+ */
+void msdSetBandwidthLimit(USBMassStorageDriver *msdp, uint32_t bytes_per_sec, uint32_t iops);
+
+/**
+ * @brief   Gives the firmware I/O priority over the host I/O.
+ * @details When enabled, the host transfers are deferred, for up to
+ *          @p USB_MSD_QOS_MAX_DEFER at a time, while the firmware is between
+ *          @p msdFirmwareIOBegin() and @p msdFirmwareIOEnd().
+ */
+void msdSetFirmwarePriority(USBMassStorageDriver *msdp, bool_t enable);
+
+/**
+ * @brief   Notifies the driver that the firmware starts accessing the media.
+ */
+void msdFirmwareIOBegin(USBMassStorageDriver *msdp);
+
+/**
+ * @brief   Notifies the driver that the firmware is done with the media.
+ */
+void msdFirmwareIOEnd(USBMassStorageDriver *msdp);
+#endif
+
 #ifdef __cplusplus
 }
 #endif